@@ -8,9 +8,19 @@ extern "C" {
 #include <chiasm/types.h>
 #include <chiasm/util.h>
 #include <chiasm/device.h>
+#include <chiasm/backend.h>
 #include <chiasm/decode.h>
 #include <chiasm/plugin.h>
 #include <chiasm/distortion.h>
+#include <chiasm/journal.h>
+#include <chiasm/stats.h>
+#include <chiasm/trace.h>
+#include <chiasm/monitor.h>
+#include <chiasm/cputime.h>
+#include <chiasm/log.h>
+#include <chiasm/realtime.h>
+#include <chiasm/pool.h>
+#include <chiasm/qos.h>
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,58 @@
+#ifndef CHIASM_BACKEND_H_
+#define CHIASM_BACKEND_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <chiasm/types.h>
+
+/**
+ * @brief Video4Linux2 capture device. Used for any name without a prefix.
+ */
+extern const struct ch_backend ch_v4l2_backend;
+
+/**
+ * @brief Synthetic moving test pattern in YUYV, MJPEG or H.264, named
+ *        synth[@<fps>]. Frames are generated ahead of time and cycled, so the
+ *        source costs nothing per frame.
+ */
+extern const struct ch_backend ch_synth_backend;
+
+/**
+ * @brief Sequence of image files in a directory, named images:<dir>[@<fps>].
+ *        JPEG files are passed through as MJPEG, others are converted to
+ *        YUYV. The framesize is taken from the first image. The stream ends
+ *        after the last image.
+ */
+extern const struct ch_backend ch_images_backend;
+
+/**
+ * @brief Replay of a journal, set up by ch_replay_journal.
+ */
+extern const struct ch_backend ch_journal_backend;
+
+/**
+ * @brief Wait until a generated frame is due at the device's rate.
+ *
+ * @param device Device generating frames.
+ * @param due Time the frame is due, zero before the first. Advanced to the
+ *            time of the next frame.
+ * @return None.
+ */
+void ch_backend_pace(struct ch_device *device, struct timespec *due);
+
+/**
+ * @brief Timestamp a generated frame with the current time on the same clock
+ *        as V4L2 capture timestamps.
+ *
+ * @param buf Frame to timestamp.
+ * @return None.
+ */
+void ch_backend_timestamp(struct ch_frmbuf *buf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef CHIASM_CPUTIME_H_
+#define CHIASM_CPUTIME_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+
+#include <chiasm/types.h>
+
+/**
+ * @brief CPU cost of the calling thread at a point in time.
+ */
+struct ch_cpu_sample {
+    uint64_t cpu_ns;       /**< CPU time of the thread. */
+    uint64_t cycles;       /**< CPU cycles, if counted. */
+    uint64_t instructions; /**< Instructions retired, if counted. */
+    uint64_t cache_misses; /**< Cache misses, if counted. */
+};
+
+/**
+ * @brief Count cycles, instructions and cache misses with hardware
+ *        performance counters, in addition to CPU time. Each thread opens its
+ *        counters when it first samples. Must be called before streaming.
+ *
+ * @return 0 on success, -1 if counters are unavailable to this process.
+ */
+int ch_cpu_enable_perf(void);
+
+/**
+ * @brief Sample the CPU cost of the calling thread.
+ *
+ * @param sample Sample to fill in.
+ * @return None.
+ */
+void ch_cpu_sample(struct ch_cpu_sample *sample);
+
+/**
+ * @brief Record the CPU cost of the calling thread since a sample, into the
+ *        CPU stage histogram and the cumulative counters.
+ *
+ * @param stats Histograms indexed by enum ch_stage.
+ * @param mon Counters to add the cost to, or NULL.
+ * @param start Sample taken when the work started.
+ * @return None.
+ */
+void ch_cpu_record(struct ch_hist *stats, struct ch_mon_counters *mon,
+                   const struct ch_cpu_sample *start);
+
+/**
+ * @brief Close the performance counters of the calling thread, if open.
+ *
+ * @return None.
+ */
+void ch_cpu_release(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
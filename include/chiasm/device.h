@@ -154,7 +154,34 @@ int ch_set_ctrl(struct ch_device *device, struct ch_ctrl *ctrl, int32_t value);
 int ch_set_fmt(struct ch_device *device);
 
 /**
- * @brief Stream video and call a callback upon every new frame.
+ * @brief Begin streaming from a device.
+ *
+ * @param device Device to begin streaming from.
+ * @return 0 on success, -1 on failure.
+ */
+int ch_start_stream(struct ch_device *device);
+
+/**
+ * @brief Stop streaming from a device.
+ *
+ * @param device Device to stop streaming from.
+ * @return 0 on success, -1 on failure.
+ */
+int ch_stop_stream(struct ch_device *device);
+
+/**
+ * @brief Update a device's framerate estimate on a new frame.
+ *
+ * @param device Device receiving the frame.
+ * @param pt Time of the previous frame, negative before the first. Updated.
+ * @return None.
+ */
+void ch_update_fps(struct ch_device *device, double *pt);
+
+/**
+ * @brief Stream video and call a callback upon every new frame. With the
+ *        worker pool running, callbacks and conversions run on it, except for
+ *        plugins with their own scheduling, which keep a dedicated thread.
  *
  * @param device Device to stream from.
  * @param plugins Array of plugins to use for callbacks.
@@ -8,13 +8,25 @@ extern "C" {
 #include <chiasm/types.h>
 
 /**
- * @brief Load a camera calibration saved from a file.
+ * @brief Load a camera calibration saved from a file. Rectification maps are
+ *        cached in a binary file next to the calibration (filename.cache),
+ *        keyed by the calibration contents, the device framesize and the
+ *        requested output. A valid cache is memory-mapped directly and shared
+ *        between processes; otherwise the maps are computed and the cache is
+ *        rewritten.
+ *
+ *        The maps rectify and rescale in one pass: only the region roi of the
+ *        rectified frame is produced, scaled to outsize. Neither may exceed
+ *        the device framesize.
  *
  * @param device The device to load the camera calibration for.
  * @param filename Filename of calibration file.
- * @return Allocated calibration file on success, NULL on failure.
+ * @param outsize Size of the rectified output image. NULL for the framesize.
+ * @param roi Region of the rectified frame to output. NULL for the full frame.
+ * @return 0 on success, -1 on failure.
  */
-int ch_load_calibration(struct ch_device *device, const char *filename);
+int ch_load_calibration(struct ch_device *device, const char *filename,
+                        const struct ch_rect *outsize, const struct ch_roi *roi);
 
 /**
  * @brief Close a loaded calibration.
@@ -25,7 +37,8 @@ int ch_load_calibration(struct ch_device *device, const char *filename);
 void ch_close_calibration(struct ch_device *device);
 
 /**
- * @brief Undistorts an image based on a calibrated camera's parameters.
+ * @brief Undistorts an image based on a calibrated camera's parameters. The
+ *        result has the calibration's outsize and keeps the plugin's stride.
  *
  * @param device Device image was taken on.
  * @param cx Context for plugin the image is being undistorted for.
@@ -41,8 +54,15 @@ void ch_undistort(struct ch_device *device, struct ch_dl_cx *cx, struct ch_frmbu
 // Only show C++ functions if C++
 #ifdef __cplusplus
 
+#include <vector>
+
 #include <opencv2/core/core.hpp>
 
+#define CH_BOARD_WINDOW 11   // Smallest subpixel refinement window per side.
+#define CH_BOARD_ITER   30   // Subpixel refinement maximum iteration count.
+#define CH_BOARD_EPS    0.05 // Subpixel refinement delta epsilon criteria.
+#define CH_CALIB_ITER   30   // Maximum iterations of a calibration from scratch.
+
 using namespace std;
 
 /**
@@ -62,6 +82,49 @@ void ch_save_calibration(string filename, cv::Size image_size,
                          double reproj_err, cv::Mat camera_mat,
                          cv::Mat distortion_coeffs);
 
+/**
+ * @brief Get the scale at which to search images for a calibration board.
+ *
+ * @param image_size Size of the images.
+ * @param search_width Widest image to search.
+ * @return Scale of at most 1.
+ */
+double ch_board_scale(cv::Size image_size, int search_width);
+
+/**
+ * @brief Find calibration board corners in a downscaled image, and refine
+ *        them at full resolution.
+ *
+ * @param image Full resolution grayscale image.
+ * @param small Image downscaled by scale to search, or image if scale is 1.
+ * @param scale Scale from ch_board_scale.
+ * @param board_size Inner corners of the board.
+ * @param corners Corner locations to fill in, at full resolution.
+ * @return true if a board was found.
+ */
+bool ch_find_board(const cv::Mat &image, const cv::Mat &small, double scale,
+                   cv::Size board_size, vector< cv::Point2f > &corners);
+
+/**
+ * @brief Calibrate a camera from board views, with the calibration flags
+ *        used throughout the library.
+ *
+ * @param image_points Board corners found in each view.
+ * @param image_size Size of the images.
+ * @param board_size Inner corners of the board.
+ * @param square_size Size of squares on the board.
+ * @param guess Start from camera_mat and distortion_coeffs instead of
+ *              from scratch?
+ * @param iter Maximum iterations.
+ * @param camera_mat Intrinsic camera parameter matrix, filled in.
+ * @param distortion_coeffs Distortion coefficients, filled in.
+ * @return Reprojection error.
+ */
+double ch_calibrate_camera(const vector< vector< cv::Point2f > > &image_points,
+                           cv::Size image_size, cv::Size board_size,
+                           double square_size, bool guess, int iter,
+                           cv::Mat &camera_mat, cv::Mat &distortion_coeffs);
+
 #endif
 
 #endif
@@ -0,0 +1,83 @@
+#ifndef CHIASM_JOURNAL_H_
+#define CHIASM_JOURNAL_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <chiasm/types.h>
+
+/**
+ * @brief Create a journal file for a device's stream. The file is preallocated
+ *        to hold capacity bytes of frames and memory-mapped. Once full, the
+ *        oldest frames are overwritten.
+ *
+ * @param journal Journal to fill in.
+ * @param filename Filename of the journal. Replaced if it exists.
+ * @param capacity Bytes of frames and record headers the journal holds.
+ * @param device Device whose pixel format and framesize are recorded.
+ * @return 0 on success, -1 on failure.
+ */
+int ch_create_journal(struct ch_journal *journal, const char *filename,
+                      uint64_t capacity, struct ch_device *device);
+
+/**
+ * @brief Open a journal file for reading. The device's pixel format and
+ *        framesize are set to those recorded. Frames appended after opening
+ *        are not read.
+ *
+ * @param journal Journal to fill in.
+ * @param filename Filename of the journal.
+ * @param device Device to set the recorded format on.
+ * @return 0 on success, -1 on failure.
+ */
+int ch_open_journal(struct ch_journal *journal, const char *filename,
+                    struct ch_device *device);
+
+/**
+ * @brief Close a journal created or opened.
+ *
+ * @param journal Journal to close.
+ * @return None.
+ */
+void ch_close_journal(struct ch_journal *journal);
+
+/**
+ * @brief Append a frame to a journal, overwriting the oldest frames if full.
+ *
+ * @param journal Journal opened by ch_create_journal.
+ * @param frame Frame to append. Its bytesused and timestamp are recorded.
+ * @return 0 on success, -1 on failure.
+ */
+int ch_append_journal(struct ch_journal *journal, const struct ch_frmbuf *frame);
+
+/**
+ * @brief Read the next frame from a journal, oldest first.
+ *
+ * @param journal Journal opened by ch_open_journal.
+ * @param frame Filled in to point into the journal mapping. The frame data is
+ *              followed by zeroed padding, so it can be decoded in place.
+ * @return 1 on a frame being read, 0 at the end of the journal, -1 on failure.
+ */
+int ch_read_journal(struct ch_journal *journal, struct ch_frmbuf *frame);
+
+/**
+ * @brief Stream the frames of a journal through decoding and plugins as if
+ *        they came from the device.
+ *
+ * @param device Device set up by ch_open_journal.
+ * @param journal Journal to replay.
+ * @param realtime If true, frames are paced by their timestamps. Otherwise
+ *                 frames are replayed as fast as possible.
+ * @param plugins Array of plugins to use for callbacks.
+ * @param n_plugins Number of plugins in the array.
+ * @return 0 on success, -1 on failure.
+ */
+int ch_replay_journal(struct ch_device *device, struct ch_journal *journal,
+                      bool realtime, struct ch_dl **plugins, uint32_t n_plugins);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef CHIASM_LOG_H_
+#define CHIASM_LOG_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+
+#include <chiasm/types.h>
+
+#define CH_LOG_ENTRIES  64   // Messages buffered per thread.
+#define CH_LOG_TEXT     120  // Longest message buffered, longer are cut.
+#define CH_LOG_RATE     10.0 // Messages written per second once bursting.
+#define CH_LOG_BURST    20   // Messages written before rate limiting.
+#define CH_LOG_INTERVAL 0.05 // Seconds between drains.
+
+/**
+ * @brief Write errors from a background thread instead of the caller.
+ *        ch_error and ch_error_no then only copy the message into a ring of
+ *        the calling thread, without locks or system calls. Repeats of the
+ *        last message from a thread are counted rather than buffered, and
+ *        the writer is rate limited, so an error storm cannot stall the
+ *        caller. Messages that do not fit are dropped and counted.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int ch_start_logger(void);
+
+/**
+ * @brief Write out buffered messages and stop the background writer.
+ *        Errors are written synchronously again afterwards.
+ *
+ * @return None.
+ */
+void ch_stop_logger(void);
+
+/**
+ * @brief Buffer a message for the background writer.
+ *
+ * @param buf Message.
+ * @param has_err Does the message have an error number?
+ * @param err Error number.
+ * @return 0 if buffered or counted, -1 if the caller should write it.
+ */
+int ch_log_post(const char *buf, bool has_err, int err);
+
+/**
+ * @brief Write a message to syslog and, if enabled, stderr.
+ *
+ * @param buf Message.
+ * @param has_err Does the message have an error number?
+ * @param err Error number.
+ * @return None.
+ */
+void ch_log_write(const char *buf, bool has_err, int err);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
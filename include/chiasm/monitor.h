@@ -0,0 +1,67 @@
+#ifndef CHIASM_MONITOR_H_
+#define CHIASM_MONITOR_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+#include <chiasm/types.h>
+
+#define CH_MON_MAGIC   0x4e4d4843 // "CHMN"
+#define CH_MON_VERSION 3
+#define CH_MON_PREFIX  "chiasm."  // Prefix of monitoring segment names.
+
+/**
+ * @brief Publish the stage histograms and counters of a device and its
+ *        plugins in a shared-memory segment, so they can be watched from
+ *        other processes. Stage timing is enabled for the device and plugins
+ *        with the histograms in the segment. Must be called before streaming.
+ *
+ * @param mon Monitor to fill in.
+ * @param name Name of the segment. NULL for CH_MON_PREFIX and the pid.
+ * @param device Device to publish.
+ * @param plugins Loaded plugins to publish.
+ * @param n_plugins Number of plugins in the array.
+ * @return 0 on success, -1 on failure.
+ */
+int ch_open_monitor(struct ch_monitor *mon, const char *name,
+                    struct ch_device *device, struct ch_dl **plugins,
+                    size_t n_plugins);
+
+/**
+ * @brief Stop publishing and remove the segment. Stage timing is disabled
+ *        for the device and plugins.
+ *
+ * @param mon Monitor opened with ch_open_monitor.
+ * @param device Published device.
+ * @param plugins Published plugins.
+ * @param n_plugins Number of plugins in the array.
+ * @return None.
+ */
+void ch_close_monitor(struct ch_monitor *mon, struct ch_device *device,
+                      struct ch_dl **plugins, size_t n_plugins);
+
+/**
+ * @brief Map a published segment read-only.
+ *
+ * @param mon Monitor to fill in.
+ * @param name Name of the segment.
+ * @return 0 on success, -1 on failure.
+ */
+int ch_attach_monitor(struct ch_monitor *mon, const char *name);
+
+/**
+ * @brief Unmap a segment mapped by ch_attach_monitor.
+ *
+ * @param mon Attached monitor.
+ * @return None.
+ */
+void ch_detach_monitor(struct ch_monitor *mon);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -23,6 +23,25 @@ struct ch_dl *ch_dl_load(const char *name);
  */
 void ch_dl_close(struct ch_dl *plugin);
 
+/**
+ * @brief Will a plugin run on the worker pool? Plugins do when the pool is
+ *        running and they do not ask for their own scheduling. May be called
+ *        from CH_DL_INIT.
+ *
+ * @param cx Context of the plugin.
+ * @return True if callbacks run as tasks on the pool.
+ */
+bool ch_plugin_pooled(const struct ch_dl_cx *cx);
+
+/**
+ * @brief Was an option given to a plugin?
+ *
+ * @param cx Context of the plugin.
+ * @param name Name of the option.
+ * @return True if name is one of the comma-separated options.
+ */
+bool ch_plugin_option(const struct ch_dl_cx *cx, const char *name);
+
 /**
  * @brief Initialize an array of plugins with a device.
  *
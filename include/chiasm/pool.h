@@ -0,0 +1,88 @@
+#ifndef CHIASM_POOL_H_
+#define CHIASM_POOL_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include <chiasm/types.h>
+
+#define CH_POOL_MAX 64 // Largest number of workers.
+
+/**
+ * @brief Is a task more urgent than another? Higher priorities are, then
+ *        earlier due times.
+ *
+ * @param a Task to compare.
+ * @param b Task to compare against.
+ * @return True if a should run before b.
+ */
+static inline bool
+ch_task_before(const struct ch_task *a, const struct ch_task *b)
+{
+    if (a->priority != b->priority)
+        return (a->priority > b->priority);
+
+    return (a->due > 0 && (b->due == 0 || a->due < b->due));
+}
+
+/**
+ * @brief Start the worker pool shared by the whole library. Each worker
+ *        queues the tasks it submits itself, and steals the oldest tasks of
+ *        other workers when it runs out, so the pool stays busy without
+ *        running more threads than it was sized for.
+ *
+ * @param n_workers Number of workers, 0 for the number of online CPUs.
+ * @return 0 on success, -1 on failure.
+ */
+int ch_start_pool(size_t n_workers);
+
+/**
+ * @brief Run the remaining tasks and stop the workers.
+ *
+ * @return None.
+ */
+void ch_stop_pool(void);
+
+/**
+ * @brief Is the worker pool running?
+ *
+ * @return True if tasks run on the pool, false if they run when submitted.
+ */
+bool ch_pool_running(void);
+
+/**
+ * @brief Get the parallelism available from the pool.
+ *
+ * @return Number of workers, or of online CPUs if the pool is not running.
+ */
+size_t ch_pool_size(void);
+
+/**
+ * @brief Submit a task. It is added to its group before returning. Within a
+ *        queue, tasks of blocking groups run first, then the most urgent by
+ *        priority and due time.
+ *        Without a running pool, the task is run before returning instead.
+ *
+ * @param task Task to run. Must stay valid until it finishes.
+ * @return None.
+ */
+void ch_pool_submit(struct ch_task *task);
+
+/**
+ * @brief Wait for every task in a group to finish, running queued tasks of
+ *        the group in the meantime. May be called from a task.
+ *
+ * @param group Group to wait on.
+ * @return None.
+ */
+void ch_pool_wait(struct ch_task_group *group);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef CHIASM_QOS_H_
+#define CHIASM_QOS_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include <chiasm/types.h>
+
+#define CH_QOS_EWMA       0.2  // Update rate of the latency average.
+#define CH_QOS_HEADROOM   0.6  // Fraction of the target below which to step up.
+#define CH_QOS_SETTLE     15   // Frames to wait after a step.
+#define CH_QOS_SCALE_STEP 0.75 // Multiplicative step of the output scale.
+
+/**
+ * @brief Hold the latency target of a device by stepping plugin quality.
+ *        Over the target, the least urgent plugin with room left is stepped
+ *        down: its output is scaled down first, then it degrades its own
+ *        work, then frames are skipped, each within the bounds it declared.
+ *        With headroom, the most urgent degraded plugin is stepped back up.
+ *        Called once per frame before handing it to the plugins.
+ *
+ * @param device Device holding the target.
+ * @param plugins The array of plugins.
+ * @param n_plugins The number of plugins in the array.
+ * @return None.
+ */
+void ch_qos_update(struct ch_device *device, struct ch_dl **plugins,
+                   size_t n_plugins);
+
+/**
+ * @brief Record the latency of a frame handled by a plugin.
+ *
+ * @param cx Context of the plugin.
+ * @param latency Seconds from capture to the end of the callback.
+ * @return None.
+ */
+void ch_qos_record(struct ch_dl_cx *cx, double latency);
+
+/**
+ * @brief Should the current frame be skipped for a plugin to lower its rate?
+ *
+ * @param cx Context of the plugin.
+ * @return True if the frame is skipped.
+ */
+bool ch_qos_skip(struct ch_dl_cx *cx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef CHIASM_REALTIME_H_
+#define CHIASM_REALTIME_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <chiasm/types.h>
+
+#define CH_RT_STACK (512 * 1024) // Bytes of stack faulted in when locking.
+
+/**
+ * @brief Parse thread scheduling in <cpus>[:<priority>] format, where cpus is
+ *        a comma-separated list of CPUs and ranges such as 0,2-3, and may be
+ *        empty for any CPU.
+ *
+ * @param str String to parse.
+ * @param rt Scheduling to fill in.
+ * @return 0 on success, -1 on failure.
+ */
+int ch_parse_rt(const char *str, struct ch_rt *rt);
+
+/**
+ * @brief Apply scheduling to the calling thread. It keeps it afterwards.
+ *        SCHED_FIFO priorities need CAP_SYS_NICE or an RLIMIT_RTPRIO.
+ *
+ * @param rt Scheduling to apply.
+ * @return 0 on success, -1 on failure.
+ */
+int ch_rt_apply(const struct ch_rt *rt);
+
+/**
+ * @brief Lock the process in memory so streaming never waits on page faults.
+ *        Everything mapped now and later is faulted in and locked, which
+ *        covers buffers allocated when streaming starts and the stacks of
+ *        pipeline threads. Freed memory is kept by malloc rather than
+ *        returned, and the stack of the calling thread is faulted in.
+ *        Must be called before streaming, and not with a journal mapped.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int ch_rt_lock_memory(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef CHIASM_STATS_H_
+#define CHIASM_STATS_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+
+#include <chiasm/types.h>
+#include <chiasm/trace.h>
+
+/**
+ * @brief Current time on the monotonic clock.
+ *
+ * @return Time in nanoseconds.
+ */
+uint64_t ch_stats_now(void);
+
+/**
+ * @brief Name of a stage.
+ *
+ * @param stage Stage to name.
+ * @return Static string naming the stage.
+ */
+const char *ch_stage_name(enum ch_stage stage);
+
+/**
+ * @brief Check if stages are timed, either into histograms or the trace.
+ *
+ * @param stats Histograms of the timed object, or NULL.
+ * @return True if the stage should be timed.
+ */
+static inline bool
+ch_stage_timed(const struct ch_hist *stats)
+{
+    return (stats != NULL || ch_tracing);
+}
+
+/**
+ * @brief Record a timed stage into its histogram, if any, and the trace.
+ *
+ * @param stats Histograms indexed by enum ch_stage, or NULL.
+ * @param stage Stage that was timed.
+ * @param frame Number of the frame in the stream.
+ * @param t0 Start of the stage from ch_stats_now.
+ * @param t1 End of the stage from ch_stats_now.
+ * @return None.
+ */
+void ch_stage_record(struct ch_hist *stats, enum ch_stage stage,
+                     uint64_t frame, uint64_t t0, uint64_t t1);
+
+/**
+ * @brief Record a value in a histogram. Only one thread may record into a
+ *        histogram.
+ *
+ * @param hist Histogram to record into.
+ * @param ns Value in nanoseconds.
+ * @return None.
+ */
+void ch_hist_record(struct ch_hist *hist, uint64_t ns);
+
+/**
+ * @brief Get a percentile of the values recorded in a histogram.
+ *
+ * @param hist Histogram to read.
+ * @param p Percentile between 0 and 100.
+ * @return Upper bound of the bucket holding the percentile in nanoseconds.
+ */
+uint64_t ch_hist_percentile(const struct ch_hist *hist, double p);
+
+/**
+ * @brief Enable stage timing and CPU cost counters for a device and its
+ *        plugins. Must be called before streaming.
+ *
+ * @param device Device to time.
+ * @param plugins Loaded plugins to time.
+ * @param n_plugins Number of plugins in the array.
+ * @return 0 on success, -1 on failure.
+ */
+int ch_init_stats(struct ch_device *device, struct ch_dl **plugins,
+                  size_t n_plugins);
+
+/**
+ * @brief Print p50, p99 and max of every timed stage, then the average CPU
+ *        cost per frame of each thread.
+ *
+ * @param file File to print to.
+ * @param device Timed device.
+ * @param plugins Timed plugins.
+ * @param n_plugins Number of plugins in the array.
+ * @return None.
+ */
+void ch_print_stats(FILE *file, struct ch_device *device,
+                    struct ch_dl **plugins, size_t n_plugins);
+
+/**
+ * @brief Disable stage timing and free the histograms and counters.
+ *
+ * @param device Timed device.
+ * @param plugins Timed plugins.
+ * @param n_plugins Number of plugins in the array.
+ * @return None.
+ */
+void ch_destroy_stats(struct ch_device *device, struct ch_dl **plugins,
+                      size_t n_plugins);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef CHIASM_TRACE_H_
+#define CHIASM_TRACE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include <chiasm/types.h>
+
+#define CH_TRACE_EVENTS (1 << 16) // Default events kept per thread.
+
+// Are stage events being traced?
+extern bool ch_tracing;
+
+/**
+ * @brief Start tracing stage events. Each thread records into its own ring,
+ *        keeping its latest events. Must be called before streaming.
+ *
+ * @param events Events kept per thread.
+ * @return 0 on success, -1 on failure.
+ */
+int ch_trace_start(size_t events);
+
+/**
+ * @brief Name the calling thread in the trace.
+ *
+ * @param name Name of the thread. Only the part after the last '/' is used.
+ * @return None.
+ */
+void ch_trace_name(const char *name);
+
+/**
+ * @brief Record a stage event on the calling thread. Lock-free, and does
+ *        nothing unless tracing.
+ *
+ * @param stage Stage the event covers.
+ * @param frame Number of the frame in the stream.
+ * @param t0 Start of the event from ch_stats_now.
+ * @param t1 End of the event from ch_stats_now.
+ * @return None.
+ */
+void ch_trace_event(enum ch_stage stage, uint64_t frame, uint64_t t0,
+                    uint64_t t1);
+
+/**
+ * @brief Write the events of every thread as a Chrome trace JSON file, for
+ *        chrome://tracing or Perfetto. Must be called after streaming.
+ *
+ * @param filename Filename to write to.
+ * @return 0 on success, -1 on failure.
+ */
+int ch_trace_dump(const char *filename);
+
+/**
+ * @brief Stop tracing and free every thread's events. Must be called after
+ *        streaming.
+ *
+ * @return None.
+ */
+void ch_trace_stop(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -10,6 +10,7 @@ extern "C" {
 #include <stdbool.h>
 #include <pthread.h>
 #include <time.h>
+#include <sys/time.h>
 
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
@@ -17,6 +18,10 @@ extern "C" {
 
 #define CH_DL_NUMBUF 2
 
+#define CH_HIST_SUB_BITS 5  // Sub-buckets per power of two, as bits.
+#define CH_HIST_MAX_BITS 40 // Largest value recorded, as bits.
+#define CH_HIST_BINS ((CH_HIST_MAX_BITS - CH_HIST_SUB_BITS + 1) << CH_HIST_SUB_BITS)
+
 /**
  * @brief Simple struct to describe a rectangle.
  */
@@ -25,6 +30,167 @@ struct ch_rect {
     uint32_t height; /**< Height dimension. */
 };
 
+/**
+ * @brief Simple struct to describe a region of an image.
+ */
+struct ch_roi {
+    uint32_t       x;    /**< Left edge of the region. */
+    uint32_t       y;    /**< Top edge of the region. */
+    struct ch_rect size; /**< Dimensions of the region. */
+};
+
+/**
+ * @brief Log-linear histogram of latencies in nanoseconds. Buckets are
+ *        within 1 / 2^CH_HIST_SUB_BITS of their value. Written by one thread,
+ *        readable from any.
+ */
+struct ch_hist {
+    uint64_t count;              /**< Number of values recorded. */
+    uint64_t max;                /**< Largest value recorded. */
+    uint64_t bins[CH_HIST_BINS]; /**< Count of values per bucket. */
+};
+
+/**
+ * @brief Pipeline stages timed into histograms.
+ */
+enum ch_stage {
+    CH_STAGE_WAIT,      /**< Waiting on the source for a frame. */
+    CH_STAGE_DEQUEUE,   /**< Dequeuing a frame from the source. */
+    CH_STAGE_DECODE,    /**< Decoding a frame. */
+    CH_STAGE_CONVERT,   /**< Converting a frame for a plugin. */
+    CH_STAGE_UNDISTORT, /**< Undistorting a frame for a plugin. */
+    CH_STAGE_CALLBACK,  /**< Plugin callback on a frame. */
+    CH_STAGE_LATENCY,   /**< Capture to end of plugin callback. */
+    CH_STAGE_CPU,       /**< CPU time of a thread spent on a frame. */
+    CH_STAGE_NUM
+};
+
+/**
+ * @brief Live counters of a device or plugin, published for monitoring.
+ *        Updated with relaxed atomic stores.
+ */
+struct ch_mon_counters {
+    uint64_t frames;    /**< Frames received by a device, or taken by a
+                           plugin. */
+    uint64_t dropped;   /**< Frames a plugin missed while it was busy. */
+    uint64_t pending;   /**< Frames waiting for a plugin, 0 or 1. */
+    uint64_t busy;      /**< Is the plugin in its callback? */
+    uint64_t fps_milli; /**< Framerate estimate of a device, in thousandths
+                           of a frame per second. */
+    uint64_t cpu_ns;    /**< CPU time of the thread spent on frames. */
+    uint64_t cycles;    /**< CPU cycles spent on frames, if counted. */
+    uint64_t instructions; /**< Instructions retired on frames, if counted. */
+    uint64_t cache_misses; /**< Cache misses on frames, if counted. */
+    uint64_t perf_samples; /**< Frames with hardware events counted. */
+    uint64_t late;      /**< Frames a plugin finished after its deadline. */
+    uint64_t shed;      /**< Frames shed from a plugin for more urgent ones. */
+};
+
+/**
+ * @brief Published state of a device or plugin.
+ */
+struct ch_mon_source {
+    char                   name[64];             /**< Name of the source. */
+    struct ch_mon_counters counters;             /**< Live counters. */
+    struct ch_hist         stages[CH_STAGE_NUM]; /**< Stage histograms. */
+};
+
+/**
+ * @brief Layout of a shared-memory monitoring segment. The device is the
+ *        first source, followed by each plugin.
+ */
+struct ch_mon_block {
+    uint32_t             magic;     /**< CH_MON_MAGIC once initialized. */
+    uint32_t             version;   /**< CH_MON_VERSION. */
+    uint32_t             pid;       /**< Process publishing the segment. */
+    uint32_t             n_sources; /**< Number of sources that follow. */
+    uint64_t             started;   /**< Monotonic time publishing started. */
+    uint32_t             pixfmt;    /**< V4L2 format of the device. */
+    struct ch_rect       framesize; /**< Framesize of the device. */
+    uint32_t             reserved;
+    struct ch_mon_source sources[]; /**< Device, then plugins. */
+};
+
+/**
+ * @brief A mapped monitoring segment.
+ */
+struct ch_monitor {
+    char                 name[64]; /**< Name of the shared-memory object. */
+    int                  fd;       /**< File-descriptor of the object. */
+    struct ch_mon_block *block;    /**< Mapped segment. */
+    size_t               length;   /**< Length of the mapping. */
+    bool                 owner;    /**< Did we create the segment? */
+};
+
+/**
+ * @brief Tasks waited on together.
+ */
+struct ch_task_group {
+    uint32_t pending; /**< Tasks submitted and not yet finished. */
+    uint32_t queued;  /**< Tasks submitted and not yet started. */
+    bool     blocking; /**< Is a thread held up until the group finishes?
+                          Its tasks are taken before other queued tasks. */
+};
+
+/**
+ * @brief A task for the worker pool. Owned by the pool from submission until
+ *        its group is waited on.
+ */
+struct ch_task {
+    void                 (*fn)(void *); /**< Function to run. */
+    void                 *arg;          /**< Argument to the function. */
+    struct ch_task_group *group;        /**< Group to finish in, or NULL. */
+    int                  priority;      /**< Higher runs first. */
+    uint64_t             due;           /**< Time from ch_stats_now to finish
+                                           by, earlier first among equal
+                                           priorities. 0 for none. */
+    struct ch_task       *next;         /**< Newer task in the same queue. */
+    struct ch_task       *prev;         /**< Older task in the same queue. */
+};
+
+/**
+ * @brief Quality scaling of a plugin. The bounds may be set in CH_DL_INIT,
+ *        the rest is set by the controller.
+ */
+struct ch_qos {
+    double   scale_min;  /**< Smallest fraction of the output size to scale
+                            to. 1 to keep the size. */
+    uint32_t levels;     /**< Steps the plugin degrades its own work by, such
+                            as decimation. 0 for none. */
+    uint32_t skip_max;   /**< Most frames skipped between frames handed to
+                            the plugin. 0 to keep the rate. */
+
+    uint32_t level;      /**< Current step, 0 at full quality. */
+    double   scale;      /**< Current fraction of the output size. Change
+                            with mutex held. */
+    uint32_t own;        /**< Current step of the plugin's own degradation,
+                            for the plugin to read. */
+    uint32_t skip;       /**< Current frames skipped between frames handed
+                            over. */
+    uint32_t skipped;    /**< Frames skipped since the last handed over. */
+    uint64_t latency_ns; /**< Smoothed latency from capture to the end of
+                            the callback. */
+};
+
+/**
+ * @brief Quality scaling controller of a device.
+ */
+struct ch_qos_ctl {
+    double   target; /**< Latency in seconds from capture to the end of every
+                        callback to hold. 0 to disable. */
+    uint32_t settle; /**< Frames since the last step. */
+};
+
+/**
+ * @brief Scheduling of a pipeline thread.
+ */
+struct ch_rt {
+    uint64_t cpus;     /**< CPUs the thread may run on, a bit per CPU. Zero
+                          for any. */
+    int      priority; /**< SCHED_FIFO priority. Zero for the default
+                          policy. */
+};
+
 /**
  * @brief Container for an allocated array of image pixelformats.
  */
@@ -90,8 +256,11 @@ struct ch_ctrls {
  * @brief A framebuffer for image frame I/O.
  */
 struct ch_frmbuf {
-    uint8_t  *start;  /**< Start of framebuffer array. */
-    uint32_t  length; /**< Length of the array. */
+    uint8_t  *start;          /**< Start of framebuffer array. */
+    uint32_t  length;         /**< Length of the array. */
+    uint32_t  bytesused;      /**< Bytes of frame data in the array. */
+    struct timeval timestamp; /**< Capture time of the frame. */
+    uint64_t  sequence;       /**< Number of the frame in the stream. */
 };
 
 /**
@@ -104,10 +273,46 @@ struct ch_calibration {
     double  reproj_err;        /**< Reprojection error of calibration. */
     double  camera_mat[3][3];  /**< Camera intrinsics matrix. */
     double  distort_coeffs[5]; /**< Distortion coefficients of camera. */
+    struct ch_roi  roi;        /**< Region of the rectified frame output. */
+    struct ch_rect outsize;    /**< Size of the rectified output image. */
+    double  rect_mat[3][3];    /**< Intrinsics of the rectified output image. */
     void    *map1;             /**< Rectification map 1. */
     void    *map2;             /**< Rectification map 2. */
-    uint8_t *temp1;            /**< Temporary buffer used for undistort. */
-    uint8_t *temp2;            /**< Temporary buffer used for undistort. */
+    void    *cache;            /**< Memory-mapped calibration cache, or NULL
+                                  if the maps were computed locally. */
+    size_t   cache_length;     /**< Length of the mapped calibration cache. */
+};
+
+/**
+ * @brief A journal of frames kept in a memory-mapped ring file.
+ */
+struct ch_journal {
+    int       fd;       /**< File-descriptor of the journal file. */
+    uint8_t  *map;      /**< Memory-mapped journal file. */
+    size_t    length;   /**< Length of the mapping. */
+    uint64_t  cursor;   /**< Position of the next record to read. */
+    uint64_t  end;      /**< Position the reader stops at. */
+};
+
+struct ch_device;
+
+/**
+ * @brief Operations of a frame source backing a device. Operations not
+ *        needed by a source may be NULL.
+ */
+struct ch_backend {
+    const char *prefix; /**< Device name prefix selecting the backend. */
+    int (*open)(struct ch_device *);    /**< Open the source. */
+    int (*close)(struct ch_device *);   /**< Close the source. */
+    int (*set_fmt)(struct ch_device *); /**< Apply the format and framesize. */
+    int (*start)(struct ch_device *);   /**< Begin streaming. */
+    int (*stop)(struct ch_device *);    /**< Stop streaming. */
+    int (*next)(struct ch_device *,
+                struct ch_frmbuf **);   /**< Wait for the next frame. 1 on a
+                                           frame, 0 if none yet or the stream
+                                           ended, -1 on failure. */
+    int (*release)(struct ch_device *,
+                   struct ch_frmbuf *); /**< Return a frame from next. */
 };
 
 /**
@@ -128,8 +333,23 @@ struct ch_device {
     struct timeval   timeout;     /**< Timeout on select to get new image. */
     bool             stream;      /**< Is the device currently streaming? */
     double           fps;         /**< Current framerate of the device. */
+    uint64_t         frames;      /**< Frames received while streaming. */
 
     struct ch_calibration *calib; /**< Loaded calibration of camera. */
+
+    const struct ch_backend *backend; /**< Source of frames. Selected by
+                                         name when opened. */
+    void             *backend_cx; /**< State of the backend. */
+    double           rate;        /**< Framerate of generated sources. Zero
+                                     to generate as fast as possible. */
+
+    struct ch_hist   *stats;      /**< Histograms indexed by enum ch_stage,
+                                     or NULL if not timed. */
+    struct ch_mon_counters *mon;  /**< Published counters, or NULL. */
+
+    struct ch_rt     rt;          /**< Scheduling of the capture thread,
+                                     which also decodes. */
+    struct ch_qos_ctl qos;        /**< Quality scaling of the plugins. */
 };
 
 /**
@@ -139,6 +359,11 @@ struct ch_decode_cx {
     AVCodecContext     *codec_cx;  /**< libavcodec codec context. */
     AVFrame            *frame_in;  /**< Allocated input frame. */
     enum AVPixelFormat in_pixfmt;  /**< Decoded output pixel format. */
+    struct ch_frmbuf   *in_buf;    /**< Input buffer of the current frame. */
+    bool               passthrough; /**< If true, frames are not decoded as
+                                       all plugins take the input payload. */
+    uint64_t           cpu_ns;     /**< CPU time of conversions of the
+                                      current frame run on other threads. */
 };
 
 /**
@@ -148,6 +373,8 @@ struct ch_dl_cx {
     struct ch_frmbuf   out_buffer[CH_DL_NUMBUF]; /**< Output buffers. */
     uint64_t           nonce[CH_DL_NUMBUF];      /**< Output buffer nonce. */
     uint32_t           select;     /**< Which buffer are we currently using? */
+    uint8_t            *undist_buffer; /**< Scratch buffer swapped with the
+                                          output buffer by undistortion. */
 
     pthread_t          thread;     /**< Thread ID for plugin. */
     pthread_mutex_t    mutex;      /**< Mutex for thread producer / consumer. */
@@ -156,11 +383,50 @@ struct ch_dl_cx {
 
     bool               undistort;  /**< If true, undistorts the image if
                                       a calibration is loaded. */
+    bool               passthrough; /**< If true, output buffers receive the
+                                       undecoded input payload. Pixel format,
+                                       size and undistortion are ignored. */
     enum AVPixelFormat out_pixfmt; /**< Output pixel format. */
     uint32_t           b_per_pix;  /**< Bytes per pixel in output format. */
     uint32_t           out_stride; /**< Stride of the output image. */
+    struct ch_rect     out_size;   /**< Requested output image size, scaled
+                                      during conversion. Zero for the
+                                      framesize. Ignored when undistorting.
+                                      Change with mutex held. */
+    struct ch_rect     out_frmsize[CH_DL_NUMBUF]; /**< Size of the image in
+                                                     each output buffer. */
+    struct ch_rect     sws_size;   /**< Output size of the SWS context. */
     struct SwsContext  *sws_cx;    /**< SWS context for decoding. */
     AVFrame            *frame_out; /**< Allocated output frame. */
+
+    struct ch_hist     *stats;     /**< Histograms indexed by enum ch_stage,
+                                      or NULL if not timed. */
+    struct ch_mon_counters *mon;   /**< Published counters, or NULL. */
+
+    struct ch_rt       rt;         /**< Scheduling of the plugin thread. May
+                                      be set by the plugin in CH_DL_INIT. */
+    const char         *options;   /**< Comma-separated options given to the
+                                      plugin, or NULL. */
+
+    uint64_t           taken;      /**< Nonce of the last frame taken. */
+    bool               pooled;     /**< Are callbacks run on the worker pool
+                                      instead of a dedicated thread? */
+    bool               queued;     /**< Is a callback task in flight? */
+    struct ch_task     task;       /**< Callback task on the worker pool. */
+    struct ch_task_group group;    /**< Group of the callback task. */
+
+    int                priority;   /**< Urgency against other plugins, higher
+                                      first. May be set in CH_DL_INIT. */
+    double             deadline;   /**< Seconds from capture by which the
+                                      callback should finish. May be set in
+                                      CH_DL_INIT. Zero for none. */
+    bool               at_risk;    /**< Are recent frames close to missing
+                                      the deadline? */
+    uint32_t           shed_run;   /**< Frames shed in a row. */
+    uint64_t           late;       /**< Frames finished after the deadline. */
+    uint64_t           shed;       /**< Frames shed for more urgent plugins. */
+
+    struct ch_qos      qos;        /**< Quality scaling of the plugin. */
 };
 
 /**
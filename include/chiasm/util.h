@@ -23,12 +23,15 @@ extern "C" {
 #define CH_DEFAULT_BUFNUM    5
 #define CH_DEFAULT_TIMEOUT   2.0
 #define CH_DEFAULT_NUMFRAMES 0
+#define CH_DEFAULT_RATE      30.0
 #define CH_DEFAULT_OUTFMT    AV_PIX_FMT_RGB24
 
 #define CH_FPS_UPDATE        0.3
 
 #define CH_HELP_D \
-    " -d   Device name. " CH_STR(CH_DEFAULT_DEVICE) " by default.\n"
+    " -d   Device name. " CH_STR(CH_DEFAULT_DEVICE) " by default.\n" \
+    "      synth[@<fps>] for a synthetic pattern, images:<dir>[@<fps>] for\n" \
+    "      an image sequence. Rate 0 runs as fast as possible.\n"
 
 #define CH_HELP_F \
     " -f   Image format code. " CH_STR(CH_DEFAULT_FORMAT) " by default.\n"
@@ -133,6 +136,23 @@ void ch_set_log(bool val);
  */
 void ch_set_stderr(bool val);
 
+/**
+ * @brief Sets the counter of heap allocations kept by the program, if it
+ *        wraps malloc to count them as ch_stream -M does.
+ *
+ * @param counter Allocations from every thread, NULL for none.
+ * @return None.
+ */
+void ch_set_alloc_counter(const uint64_t *counter);
+
+/**
+ * @brief Gets the number of heap allocations made so far in the process.
+ *
+ * @param count Filled in with the count.
+ * @return True if allocations are counted, false otherwise.
+ */
+bool ch_get_alloc_count(uint64_t *count);
+
 /**
  * @brief Error message with stringified error number and message.
  *
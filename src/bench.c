@@ -0,0 +1,515 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include <libavutil/pixdesc.h>
+
+#include <linux/videodev2.h>
+#include <chiasm.h>
+
+#define MAX_ITEMS 16
+
+#define DEFAULT_FORMATS   "YUYV,MJPG,H264"
+#define DEFAULT_SIZES     "640x480,1280x720,1920x1080"
+#define DEFAULT_OUTFMTS   "rgb24,bgra,gray8"
+#define DEFAULT_FRAMES    200
+#define WARMUP_FRAMES     16 // One cycle of the synthetic source.
+
+/**
+ * @brief Totals of a benchmarked stage.
+ */
+struct bench_stage {
+    uint64_t ns;     /**< Time spent in the stage. */
+    uint64_t bytes;  /**< Bytes of image data produced. */
+    uint64_t allocs; /**< Heap allocations made. */
+    uint64_t frames; /**< Frames processed. */
+};
+
+uint32_t formats[MAX_ITEMS];          // V4L2 formats to generate.
+size_t n_formats = 0;
+struct ch_rect sizes[MAX_ITEMS];      // Framesizes to generate.
+size_t n_sizes = 0;
+enum AVPixelFormat outfmts[MAX_ITEMS]; // Plugin output formats.
+size_t n_outfmts = 0;
+uint32_t n_frames = DEFAULT_FRAMES;   // Frames timed per case.
+bool undistort = true;                // Benchmark undistortion?
+char tmpdir[] = "/tmp/ch_bench.XXXXXX";
+
+// Allocations counted by the wrappers below, from every thread.
+uint64_t allocs = 0;
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+void *
+malloc(size_t size)
+{
+    __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+    return (__libc_malloc(size));
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+    __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+    return (__libc_calloc(nmemb, size));
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+    __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+    return (__libc_realloc(ptr, size));
+}
+
+int
+posix_memalign(void **ptr, size_t alignment, size_t size)
+{
+    __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+
+    void *p = __libc_memalign(alignment, size);
+    if (p == NULL)
+        return (ENOMEM);
+
+    *ptr = p;
+    return (0);
+}
+
+/**
+ * @brief Get the number of allocations made so far.
+ */
+static inline uint64_t
+alloc_count(void)
+{
+    return (__atomic_load_n(&allocs, __ATOMIC_RELAXED));
+}
+
+/**
+ * @brief Split a comma separated list in place.
+ *
+ * @param list List to split.
+ * @param items Array to fill with the items.
+ * @return Number of items.
+ */
+static size_t
+split_list(char *list, char *items[MAX_ITEMS])
+{
+    size_t n = 0;
+    char *save = NULL;
+    char *item = strtok_r(list, ",", &save);
+
+    while (item != NULL && n < MAX_ITEMS) {
+        items[n++] = item;
+        item = strtok_r(NULL, ",", &save);
+    }
+
+    return (n);
+}
+
+/**
+ * @brief Parse the list of input formats.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int
+parse_formats(char *list)
+{
+    char *items[MAX_ITEMS];
+    n_formats = split_list(list, items);
+
+    size_t idx;
+    for (idx = 0; idx < n_formats; idx++) {
+        if (strlen(items[idx]) != 4) {
+            fprintf(stderr, "Invalid format code %s.\n", items[idx]);
+            return (-1);
+        }
+
+        formats[idx] = ch_string_to_pixfmt(items[idx]);
+    }
+
+    return (0);
+}
+
+/**
+ * @brief Parse the list of framesizes.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int
+parse_sizes(char *list)
+{
+    char *items[MAX_ITEMS];
+    n_sizes = split_list(list, items);
+
+    size_t idx;
+    for (idx = 0; idx < n_sizes; idx++) {
+        if (sscanf(items[idx], "%ux%u",
+                   &sizes[idx].width, &sizes[idx].height) != 2) {
+            fprintf(stderr, "Invalid geometry %s.\n", items[idx]);
+            return (-1);
+        }
+    }
+
+    return (0);
+}
+
+/**
+ * @brief Parse the list of output pixel formats.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int
+parse_outfmts(char *list)
+{
+    char *items[MAX_ITEMS];
+    n_outfmts = split_list(list, items);
+
+    size_t idx;
+    for (idx = 0; idx < n_outfmts; idx++) {
+        outfmts[idx] = av_get_pix_fmt(items[idx]);
+        if (outfmts[idx] == AV_PIX_FMT_NONE) {
+            fprintf(stderr, "Invalid output format %s.\n", items[idx]);
+            return (-1);
+        }
+    }
+
+    return (0);
+}
+
+/**
+ * @brief Write a calibration of a mildly distorted camera for a framesize.
+ *
+ * @param filename Filename to write to.
+ * @param size Framesize of the calibration.
+ * @return 0 on success, -1 on failure.
+ */
+static int
+write_calibration(const char *filename, struct ch_rect size)
+{
+    FILE *file = fopen(filename, "w");
+    if (file == NULL) {
+        ch_error_no("Failed to write benchmark calibration.", errno);
+        return (-1);
+    }
+
+    double f = 0.8 * size.width;
+
+    fprintf(file,
+            "%%YAML:1.0\n"
+            "image_size: [ %u, %u ]\n"
+            "board_size: [ 9, 6 ]\n"
+            "square_size: 1.\n"
+            "reprojection_error: 0.\n"
+            "camera_matrix: !!opencv-matrix\n"
+            "   rows: 3\n"
+            "   cols: 3\n"
+            "   dt: d\n"
+            "   data: [ %f, 0., %f, 0., %f, %f, 0., 0., 1. ]\n"
+            "distortion_coefficients: !!opencv-matrix\n"
+            "   rows: 5\n"
+            "   cols: 1\n"
+            "   dt: d\n"
+            "   data: [ -0.25, 0.08, 0., 0., 0. ]\n",
+            size.width, size.height,
+            f, size.width / 2.0, f, size.height / 2.0);
+
+    fclose(file);
+    return (0);
+}
+
+/**
+ * @brief Print the result of a stage.
+ */
+static void
+print_stage(uint32_t format, struct ch_rect size, const char *stage,
+            const char *outfmt, const struct bench_stage *result)
+{
+    if (result->frames == 0)
+        return;
+
+    char format_buf[5];
+    ch_pixfmt_to_string(format, format_buf);
+
+    char size_buf[32];
+    snprintf(size_buf, sizeof(size_buf), "%ux%u", size.width, size.height);
+
+    double ns = (double) result->ns / result->frames;
+    double mbs = (result->ns > 0) ? 1e3 * result->bytes / result->ns : 0.0;
+
+    printf("%-6s %-10s %-10s %-8s %12.0f %10.1f %10.2f\n",
+           format_buf, size_buf, stage, outfmt, ns, mbs,
+           (double) result->allocs / result->frames);
+    fflush(stdout);
+}
+
+/**
+ * @brief Benchmark decoding, conversion to every output format and
+ *        undistortion of a generated stream.
+ *
+ * @param format V4L2 format to generate.
+ * @param size Framesize to generate.
+ * @return 0 on success, -1 on failure.
+ */
+static int
+bench_case(uint32_t format, struct ch_rect size)
+{
+    struct ch_device device;
+    struct ch_decode_cx decode;
+    struct ch_dl_cx cxs[MAX_ITEMS];
+    struct bench_stage decoded, converted[MAX_ITEMS], undistorted[MAX_ITEMS];
+    char calib_file[64];
+
+    ch_init_device(&device);
+    device.name = (char *) "synth@0";
+    device.in_pixfmt = format;
+    device.framesize = size;
+
+    CH_CLEAR(&decoded);
+    CH_CLEAR(&decode);
+    calib_file[0] = '\0';
+
+    size_t idx;
+    for (idx = 0; idx < n_outfmts; idx++) {
+        CH_CLEAR(&cxs[idx]);
+        CH_CLEAR(&converted[idx]);
+        CH_CLEAR(&undistorted[idx]);
+    }
+
+    int r = -1;
+    size_t n_cxs = 0;
+
+    if (ch_open_device(&device) == -1)
+        return (-1);
+
+    if (ch_set_fmt(&device) == -1 || ch_start_stream(&device) == -1)
+        goto close;
+
+    if (ch_init_decode_cx(&device, &decode) == -1)
+        goto stop;
+
+    if (undistort) {
+        snprintf(calib_file, sizeof(calib_file), "%s/%ux%u.yml",
+                 tmpdir, size.width, size.height);
+
+        if (write_calibration(calib_file, size) == -1
+            || ch_load_calibration(&device, calib_file, NULL, NULL) == -1)
+            goto clean;
+    }
+
+    for (n_cxs = 0; n_cxs < n_outfmts; n_cxs++) {
+        cxs[n_cxs].out_pixfmt = outfmts[n_cxs];
+        cxs[n_cxs].undistort = undistort;
+
+        if (ch_init_plugin_out(&device, &cxs[n_cxs]) == -1)
+            goto clean;
+    }
+
+    // The first cycle sets up codec and conversion state, so is not timed.
+    uint32_t frame;
+    for (frame = 0; frame < WARMUP_FRAMES + n_frames; frame++) {
+        bool timed = (frame >= WARMUP_FRAMES);
+
+        struct ch_frmbuf *buf;
+        if (device.backend->next(&device, &buf) != 1)
+            goto clean;
+
+        uint64_t a0 = alloc_count();
+        uint64_t t0 = ch_stats_now();
+
+        int finish = ch_decode(&device, buf, &decode);
+        if (finish == -1)
+            goto clean;
+
+        uint64_t t1 = ch_stats_now();
+        uint64_t a1 = alloc_count();
+
+        if (finish == 0)
+            continue;
+
+        if (timed) {
+            decoded.ns += t1 - t0;
+            decoded.bytes += avpicture_get_size(decode.in_pixfmt,
+                                                size.width, size.height);
+            decoded.allocs += a1 - a0;
+            decoded.frames++;
+        }
+
+        for (idx = 0; idx < n_cxs; idx++) {
+            struct ch_dl_cx *cx = &cxs[idx];
+
+            a0 = alloc_count();
+            t0 = ch_stats_now();
+
+            if (ch_output(&device, &decode, cx) == -1)
+                goto clean;
+
+            t1 = ch_stats_now();
+            a1 = alloc_count();
+
+            // Output goes to the buffer after the selected one.
+            struct ch_frmbuf *out =
+                &cx->out_buffer[(cx->select + 1) % CH_DL_NUMBUF];
+
+            if (timed) {
+                converted[idx].ns += t1 - t0;
+                converted[idx].bytes += out->bytesused;
+                converted[idx].allocs += a1 - a0;
+                converted[idx].frames++;
+            }
+
+            if (device.calib == NULL)
+                continue;
+
+            a0 = alloc_count();
+            t0 = ch_stats_now();
+
+            ch_undistort(&device, cx, out);
+
+            t1 = ch_stats_now();
+            a1 = alloc_count();
+
+            if (timed) {
+                undistorted[idx].ns += t1 - t0;
+                undistorted[idx].bytes += (uint64_t) cx->out_stride
+                    * device.calib->outsize.height;
+                undistorted[idx].allocs += a1 - a0;
+                undistorted[idx].frames++;
+            }
+        }
+    }
+
+    print_stage(format, size, "decode", "-", &decoded);
+
+    for (idx = 0; idx < n_cxs; idx++) {
+        const char *name = av_get_pix_fmt_name(outfmts[idx]);
+        print_stage(format, size, "convert", name, &converted[idx]);
+        print_stage(format, size, "undistort", name, &undistorted[idx]);
+    }
+
+    r = 0;
+
+clean:
+    for (idx = 0; idx < n_cxs; idx++)
+        ch_destroy_plugin_out(&cxs[idx]);
+
+    ch_close_calibration(&device);
+
+    if (calib_file[0] != '\0') {
+        char cache_file[80];
+        snprintf(cache_file, sizeof(cache_file), "%s.cache", calib_file);
+
+        unlink(cache_file);
+        unlink(calib_file);
+    }
+
+    ch_destroy_decode_cx(&decode);
+
+stop:
+    ch_stop_stream(&device);
+
+close:
+    ch_close_device(&device);
+
+    if (r == -1) {
+        char format_buf[5];
+        ch_pixfmt_to_string(format, format_buf);
+        fprintf(stderr, "Benchmark of %s %ux%u failed.\n",
+                format_buf, size.width, size.height);
+    }
+
+    return (r);
+}
+
+int
+main(int argc, char *argv[])
+{
+    char format_list[] = DEFAULT_FORMATS;
+    char size_list[] = DEFAULT_SIZES;
+    char outfmt_list[] = DEFAULT_OUTFMTS;
+
+    ch_set_stderr(true);
+
+    parse_formats(format_list);
+    parse_sizes(size_list);
+    parse_outfmts(outfmt_list);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "f:g:o:n:uh?")) != -1) {
+        switch (opt) {
+        case 'f':
+            if (parse_formats(optarg) == -1)
+                return (-1);
+
+            break;
+
+        case 'g':
+            if (parse_sizes(optarg) == -1)
+                return (-1);
+
+            break;
+
+        case 'o':
+            if (parse_outfmts(optarg) == -1)
+                return (-1);
+
+            break;
+
+        case 'n':
+            n_frames = (uint32_t) strtoul(optarg, NULL, 10);
+            break;
+
+        case 'u':
+            undistort = false;
+            break;
+
+        case 'h':
+        case '?':
+        default:
+            printf(
+                "Usage: %s [OPTIONS]\n"
+                "Times ch_decode, ch_output and ch_undistort on synthetic frames.\n"
+                "Reports time per frame, image data produced per second and\n"
+                "heap allocations per frame.\n"
+                "Options:\n"
+                " -f   Comma separated input formats. " DEFAULT_FORMATS " by default.\n"
+                " -g   Comma separated frame geometries in <w>x<h> format.\n"
+                "      " DEFAULT_SIZES " by default.\n"
+                " -o   Comma separated output pixel formats. " DEFAULT_OUTFMTS " by default.\n"
+                " -n   Frames timed per case. " CH_STR(DEFAULT_FRAMES) " by default.\n"
+                " -u   Skip undistortion.\n"
+                " -?,h Show this help.\n",
+                argv[0]
+            );
+
+            return (0);
+        }
+    }
+
+    if (undistort && mkdtemp(tmpdir) == NULL) {
+        ch_error_no("Failed to create benchmark directory.", errno);
+        return (-1);
+    }
+
+    printf("%-6s %-10s %-10s %-8s %12s %10s %10s\n", "format", "size",
+           "stage", "output", "ns/frame", "MB/s", "allocs");
+
+    int r = 0;
+
+    size_t idx;
+    for (idx = 0; idx < n_formats; idx++) {
+        size_t jdx;
+        for (jdx = 0; jdx < n_sizes; jdx++)
+            if (bench_case(formats[idx], sizes[jdx]) == -1)
+                r = -1;
+    }
+
+    if (undistort)
+        rmdir(tmpdir);
+
+    return (r);
+}
@@ -0,0 +1,395 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+
+#include <sys/stat.h>
+
+#include <iostream>
+#include <algorithm>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/calib3d/calib3d.hpp>
+#include <opencv2/highgui/highgui.hpp>
+
+#include <chiasm.h>
+
+using namespace std;
+
+string out_filename = "calibration.xml";
+
+cv::Size image_size;          // Size of the images.
+cv::Size board_size(4, 4);    // Size of the calibration board.
+double   square_size = 29.0;  // Size of a square on the calibration board in mm.
+int      search_width = 640;  // Width of the downscaled image searched for boards.
+
+vector< string > filenames;   // Image files to calibrate from.
+cv::VideoCapture video;       // Recorded video to calibrate from.
+bool             use_video = false;
+
+pthread_mutex_t next_mutex = PTHREAD_MUTEX_INITIALIZER;
+size_t          next_frame = 0;   // Index of the next frame to process.
+bool            size_error = false; // Did a frame mismatch? Set under next_mutex.
+
+/**
+ * @brief Result of searching a single frame for a calibration board.
+ */
+struct frame_result {
+    bool                  found;   /**< Was a board found? */
+    vector< cv::Point2f > corners; /**< Refined board corners. */
+};
+
+vector< frame_result > results;   // Results indexed by frame.
+
+/**
+ * @brief Check if a filename has an image extension readable by OpenCV.
+ */
+static bool
+is_image(const string &name)
+{
+    const char *exts[] = {
+        ".png", ".jpg", ".jpeg", ".pgm", ".ppm", ".bmp", ".tif", ".tiff", NULL
+    };
+
+    size_t dot = name.rfind('.');
+    if (dot == string::npos)
+        return (false);
+
+    string ext = name.substr(dot);
+    transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+
+    size_t idx;
+    for (idx = 0; exts[idx] != NULL; idx++)
+        if (ext == exts[idx])
+            return (true);
+
+    return (false);
+}
+
+/**
+ * @brief Add an input path. Directories add all images they contain, images
+ *        are added directly and anything else is opened as a recorded video.
+ *
+ * @param path Path to add.
+ * @return 0 on success, -1 on failure.
+ */
+static int
+add_input(const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) == -1) {
+        fprintf(stderr, "Failed to find input %s.\n", path);
+        return (-1);
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        DIR *dir = opendir(path);
+        if (dir == NULL) {
+            fprintf(stderr, "Failed to open directory %s.\n", path);
+            return (-1);
+        }
+
+        vector< string > names;
+
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL)
+            if (is_image(entry->d_name))
+                names.push_back((string) path + "/" + entry->d_name);
+
+        closedir(dir);
+
+        // Sort so results are reproducible between runs.
+        sort(names.begin(), names.end());
+        filenames.insert(filenames.end(), names.begin(), names.end());
+
+    } else if (is_image(path)) {
+        filenames.push_back(path);
+
+    } else {
+        if (use_video || !filenames.empty()) {
+            fprintf(stderr, "Only a single recorded video may be given.\n");
+            return (-1);
+        }
+
+        if (!video.open(path)) {
+            fprintf(stderr, "Failed to open recorded video %s.\n", path);
+            return (-1);
+        }
+
+        use_video = true;
+    }
+
+    if (use_video && !filenames.empty()) {
+        fprintf(stderr, "Cannot mix recorded video and image inputs.\n");
+        return (-1);
+    }
+
+    return (0);
+}
+
+/**
+ * @brief Get the next frame to process.
+ *
+ * @param image Grayscale image to fill.
+ * @param index Index of the frame.
+ * @return true if a frame was available.
+ */
+static bool
+next_image(cv::Mat &image, size_t &index)
+{
+    pthread_mutex_lock(&next_mutex);
+
+    // Video frames must be decoded in order, images can be read in parallel.
+    bool r = true;
+    cv::Mat color;
+    string filename;
+
+    index = next_frame;
+
+    if (use_video) {
+        if (!video.read(color))
+            r = false;
+        else {
+            next_frame++;
+            results.resize(next_frame);
+        }
+
+    } else if (index < filenames.size()) {
+        filename = filenames[index];
+        next_frame++;
+
+    } else
+        r = false;
+
+    pthread_mutex_unlock(&next_mutex);
+
+    if (!r)
+        return (false);
+
+    if (use_video) {
+        if (color.channels() > 1)
+            cv::cvtColor(color, image, CV_BGR2GRAY);
+        else
+            image = color;
+
+    } else
+        image = cv::imread(filename, CV_LOAD_IMAGE_GRAYSCALE);
+
+    return (true);
+}
+
+/**
+ * @brief Find calibration board corners, searching a downscaled image first
+ *        and refining the corners at full resolution.
+ *
+ * @param image Image to search.
+ * @param result Result to fill in.
+ * @return None.
+ */
+static void
+find_board(const cv::Mat &image, struct frame_result &result)
+{
+    double scale = ch_board_scale(image.size(), search_width);
+    cv::Mat small = image;
+
+    if (scale < 1.0)
+        cv::resize(image, small, cv::Size(), scale, scale, cv::INTER_AREA);
+
+    result.found = ch_find_board(image, small, scale, board_size,
+                                 result.corners);
+}
+
+/**
+ * @brief Worker thread that searches frames for calibration boards.
+ *
+ * @return Always NULL.
+ */
+static void *
+board_worker(void *arg)
+{
+    arg = (void *) arg;
+
+    cv::Mat image;
+    size_t index;
+
+    while (next_image(image, index)) {
+        if (image.empty()) {
+            fprintf(stderr, "Failed to read frame %zu.\n", index);
+            continue;
+        }
+
+        if (image.cols != image_size.width || image.rows != image_size.height) {
+            fprintf(stderr, "Frame %zu has mismatched size.\n", index);
+
+            pthread_mutex_lock(&next_mutex);
+            size_error = true;
+            pthread_mutex_unlock(&next_mutex);
+
+            continue;
+        }
+
+        struct frame_result result;
+        find_board(image, result);
+
+        pthread_mutex_lock(&next_mutex);
+        results[index] = result;
+        pthread_mutex_unlock(&next_mutex);
+    }
+
+    return (NULL);
+}
+
+/**
+ * @brief Determine the image size from the first frame.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int
+probe_size(void)
+{
+    cv::Mat image;
+
+    if (use_video) {
+        image_size = cv::Size((int) video.get(CV_CAP_PROP_FRAME_WIDTH),
+                              (int) video.get(CV_CAP_PROP_FRAME_HEIGHT));
+
+    } else {
+        image = cv::imread(filenames[0], CV_LOAD_IMAGE_GRAYSCALE);
+        if (image.empty()) {
+            fprintf(stderr, "Failed to read %s.\n", filenames[0].c_str());
+            return (-1);
+        }
+
+        image_size = image.size();
+        results.resize(filenames.size());
+    }
+
+    if (image_size.width <= 0 || image_size.height <= 0) {
+        fprintf(stderr, "Failed to determine image size.\n");
+        return (-1);
+    }
+
+    return (0);
+}
+
+int
+main(int argc, char *argv[])
+{
+    long n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    // Enable error output to stderr.
+    ch_set_stderr(true);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:s:o:j:w:h?")) != -1) {
+        switch (opt) {
+        case 'b':
+            if (sscanf(optarg, "%dx%d",
+                       &board_size.width, &board_size.height) != 2) {
+                fprintf(stderr, "Error parsing board size string.\n");
+                return (-1);
+            }
+
+            break;
+
+        case 's':
+            square_size = atof(optarg);
+            break;
+
+        case 'o':
+            out_filename = optarg;
+            break;
+
+        case 'j':
+            n_threads = atol(optarg);
+            break;
+
+        case 'w':
+            search_width = atoi(optarg);
+            break;
+
+        case 'h':
+        case '?':
+        default:
+            printf(
+                "Usage: %s [OPTIONS] <DIRECTORY | IMAGE... | VIDEO>\n"
+                "Options:\n"
+                " -b   Board size in <w>x<h> inner corners. 4x4 by default.\n"
+                " -s   Size of a board square. 29.0 by default.\n"
+                " -o   Output calibration filename. calibration.xml by default.\n"
+                " -j   Number of detection threads. All cores by default.\n"
+                " -w   Width to search for boards at. 640 by default.\n"
+                " -?,h Show this help.\n",
+                argv[0]
+            );
+
+            return (0);
+        }
+    }
+
+    if (n_threads < 1)
+        n_threads = 1;
+
+    int idx;
+    for (idx = optind; idx < argc; idx++)
+        if (add_input(argv[idx]) == -1)
+            return (-1);
+
+    if (!use_video && filenames.empty()) {
+        fprintf(stderr, "No input frames given.\n");
+        return (-1);
+    }
+
+    if (probe_size() == -1)
+        return (-1);
+
+    // Search all frames for boards in parallel.
+    vector< pthread_t > threads(n_threads);
+    long started;
+    for (started = 0; started < n_threads; started++)
+        if (ch_start_thread(&threads[started], NULL, board_worker, NULL) == -1)
+            break;
+
+    long jdx;
+    for (jdx = 0; jdx < started; jdx++)
+        ch_join_thread(threads[jdx], NULL);
+
+    if (started == 0 || size_error)
+        return (-1);
+
+    // Gather views in frame order so results are reproducible.
+    vector< vector< cv::Point2f > > image_points;
+
+    size_t kdx;
+    for (kdx = 0; kdx < results.size(); kdx++)
+        if (results[kdx].found)
+            image_points.push_back(results[kdx].corners);
+
+    fprintf(stderr, "Found calibration board in %zu of %zu frames.\n",
+            image_points.size(), results.size());
+
+    if (image_points.empty())
+        return (-1);
+
+    // Same setup as the calibration plugin.
+    cv::Mat camera_mat, distortion_coeffs;
+    double error = ch_calibrate_camera(image_points, image_size, board_size,
+                                       square_size, false, CH_CALIB_ITER,
+                                       camera_mat, distortion_coeffs);
+
+    cerr << "Camera calibrated. Reprojection error: " << error << endl;
+    cerr << "Intrisic Matrix:" << endl;
+    cerr << camera_mat << endl;
+    cerr << "Distortion Coefficients:" << endl;
+    cerr << distortion_coeffs << endl;
+
+    ch_save_calibration(out_filename, image_size, board_size, square_size,
+                        error, camera_mat, distortion_coeffs);
+
+    return (0);
+}
@@ -0,0 +1,156 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+
+#include <linux/perf_event.h>
+
+#include <chiasm.h>
+
+#define CH_CPU_EVENTS 3 // Cycles, instructions and cache misses.
+
+// Count hardware events as well as CPU time?
+static bool ch_cpu_perf = false;
+
+// Counter group of the calling thread. The first is the group leader.
+static __thread int ch_cpu_fds[CH_CPU_EVENTS] = {-1, -1, -1};
+static __thread bool ch_cpu_failed = false;
+
+/**
+ * @brief Open a hardware counter on the calling thread.
+ *
+ * @param config Event to count.
+ * @param group Group leader, or -1 to lead a new group.
+ * @return File-descriptor of the counter, -1 on failure.
+ */
+static int
+ch_cpu_open(uint64_t config, int group)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return ((int) syscall(__NR_perf_event_open, &attr, 0, -1, group, 0));
+}
+
+/**
+ * @brief Open the counter group of the calling thread.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int
+ch_cpu_open_group(void)
+{
+    static const uint64_t events[CH_CPU_EVENTS] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES
+    };
+
+    size_t idx;
+    for (idx = 0; idx < CH_CPU_EVENTS; idx++) {
+        ch_cpu_fds[idx] = ch_cpu_open(events[idx], ch_cpu_fds[0]);
+
+        if (ch_cpu_fds[idx] == -1) {
+            ch_error_no("Failed to open performance counter.", errno);
+            ch_cpu_release();
+            return (-1);
+        }
+    }
+
+    return (0);
+}
+
+int
+ch_cpu_enable_perf(void)
+{
+    // Probe on the calling thread so failure is reported up front.
+    if (ch_cpu_fds[0] == -1 && ch_cpu_open_group() == -1)
+        return (-1);
+
+    ch_cpu_perf = true;
+    return (0);
+}
+
+void
+ch_cpu_sample(struct ch_cpu_sample *sample)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+    sample->cpu_ns = (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    sample->cycles = sample->instructions = sample->cache_misses = 0;
+
+    if (!ch_cpu_perf || ch_cpu_failed)
+        return;
+
+    if (ch_cpu_fds[0] == -1 && ch_cpu_open_group() == -1) {
+        // Don't retry on every frame.
+        ch_cpu_failed = true;
+        return;
+    }
+
+    // Group reads return the number of events followed by each value.
+    uint64_t values[1 + CH_CPU_EVENTS];
+    if (read(ch_cpu_fds[0], values, sizeof(values)) != sizeof(values))
+        return;
+
+    sample->cycles = values[1];
+    sample->instructions = values[2];
+    sample->cache_misses = values[3];
+}
+
+/**
+ * @brief Add to a counter with a single writer.
+ */
+static inline void
+ch_cpu_add(uint64_t *counter, uint64_t value)
+{
+    __atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+void
+ch_cpu_record(struct ch_hist *stats, struct ch_mon_counters *mon,
+              const struct ch_cpu_sample *start)
+{
+    struct ch_cpu_sample end;
+    ch_cpu_sample(&end);
+
+    ch_hist_record(&stats[CH_STAGE_CPU], end.cpu_ns - start->cpu_ns);
+
+    if (mon == NULL)
+        return;
+
+    ch_cpu_add(&mon->cpu_ns, end.cpu_ns - start->cpu_ns);
+
+    // Counters read as zero when unavailable, so skip partial samples.
+    if (start->cycles > 0 && end.cycles >= start->cycles) {
+        ch_cpu_add(&mon->cycles, end.cycles - start->cycles);
+        ch_cpu_add(&mon->instructions, end.instructions - start->instructions);
+        ch_cpu_add(&mon->cache_misses, end.cache_misses - start->cache_misses);
+        ch_cpu_add(&mon->perf_samples, 1);
+    }
+}
+
+void
+ch_cpu_release(void)
+{
+    size_t idx;
+    for (idx = 0; idx < CH_CPU_EVENTS; idx++) {
+        if (ch_cpu_fds[idx] != -1)
+            close(ch_cpu_fds[idx]);
+
+        ch_cpu_fds[idx] = -1;
+    }
+}
@@ -1,3 +1,4 @@
+#include <stdlib.h>
 #include <stdint.h>
 #include <stddef.h>
 #include <string.h>
@@ -51,13 +52,10 @@ ch_init_plugin_out(struct ch_device *device, struct ch_dl_cx *cx)
             goto clean;
     }
 
+    // Undistortion output is swapped with the output buffers, so must match.
     if (device->calib) {
-        device->calib->temp1 = (uint8_t *) ch_calloc(length, sizeof(uint8_t));
-        if (device->calib->temp1 == NULL)
-            goto clean;
-
-        device->calib->temp2 = (uint8_t *) ch_calloc(length, sizeof(uint8_t));
-        if (device->calib->temp2 == NULL)
+        cx->undist_buffer = (uint8_t *) ch_calloc(length, sizeof(uint8_t));
+        if (cx->undist_buffer == NULL)
             goto clean;
     }
 
@@ -82,6 +80,9 @@ ch_destroy_plugin_out(struct ch_dl_cx *cx)
         if (cx->out_buffer[idx].start)
             free(cx->out_buffer[idx].start);
 
+    if (cx->undist_buffer)
+        free(cx->undist_buffer);
+
     if (cx->frame_out)
         av_frame_free(&cx->frame_out);
 
@@ -101,6 +102,9 @@ ch_init_decode_cx(struct ch_device *device, struct ch_decode_cx *cx)
     AVCodec *codec = NULL;
     enum AVCodecID codec_id = AV_CODEC_ID_NONE;
     cx->codec_cx = NULL;
+    cx->in_buf = NULL;
+    cx->passthrough = false;
+    cx->cpu_ns = 0;
 
     // Setup I/O frames.
     cx->frame_in = av_frame_alloc();
@@ -175,6 +179,12 @@ ch_decode(struct ch_device *device, struct ch_frmbuf *in_buf,
 {
     int finish = 0;
 
+    cx->in_buf = in_buf;
+
+    // Plugins only want the input payload.
+    if (cx->passthrough)
+        return (1);
+
     // Uncompressed stream.
     if (device->in_pixfmt == V4L2_PIX_FMT_YUYV) {
 	if (avpicture_fill((AVPicture *) cx->frame_in,
@@ -193,7 +203,7 @@ ch_decode(struct ch_device *device, struct ch_frmbuf *in_buf,
 	av_init_packet(&packet);
 
 	packet.data = in_buf->start;
-	packet.size = in_buf->length;
+	packet.size = in_buf->bytesused;
 
 	if (avcodec_decode_video2(cx->codec_cx, cx->frame_in,
 				  &finish, &packet) < 0) {
@@ -209,27 +219,101 @@ ch_decode(struct ch_device *device, struct ch_frmbuf *in_buf,
     return (finish);
 }
 
+/**
+ * @brief Copy the undecoded input payload into a plugin output buffer,
+ *        growing the buffer if the payload does not fit.
+ *
+ * @param in_buf Input buffer of the current frame.
+ * @param cx Plugin output context to use.
+ * @param idx Output buffer to fill.
+ * @return 0 on success, -1 on failure.
+ */
+static int
+ch_output_passthrough(const struct ch_frmbuf *in_buf, struct ch_dl_cx *cx,
+                      uint32_t idx)
+{
+    struct ch_frmbuf *out = &cx->out_buffer[idx];
+
+    if (in_buf->bytesused > out->length) {
+        uint8_t *start = (uint8_t *) realloc(out->start, in_buf->bytesused);
+        if (start == NULL) {
+            ch_error_no("Failed to grow passthrough buffer.", errno);
+            return (-1);
+        }
+
+        out->start = start;
+        out->length = in_buf->bytesused;
+    }
+
+    memcpy(out->start, in_buf->start, in_buf->bytesused);
+    out->bytesused = in_buf->bytesused;
+
+    cx->nonce[idx] = cx->nonce[cx->select] + 1;
+
+    return (0);
+}
+
 int
 ch_output(struct ch_device *device, struct ch_decode_cx *decode,
           struct ch_dl_cx *cx)
 {
     uint32_t idx = (cx->select + 1) % CH_DL_NUMBUF;
+    struct ch_frmbuf *out = &cx->out_buffer[idx];
+
+    out->timestamp = decode->in_buf->timestamp;
+    out->sequence = decode->in_buf->sequence;
+
+    if (cx->passthrough)
+        return (ch_output_passthrough(decode->in_buf, cx, idx));
+
+    // Scale to the requested size, which must fit in the output buffers.
+    // Undistortion works on the full frame, so does not scale here.
+    struct ch_rect size = device->framesize;
+    if (cx->out_size.width > 0 && cx->out_size.height > 0
+        && !(cx->undistort && device->calib)) {
+        if (cx->out_size.width < size.width)
+            size.width = cx->out_size.width;
+
+        if (cx->out_size.height < size.height)
+            size.height = cx->out_size.height;
+    }
+
+    // Quality scaling shrinks the output further, keeping sizes even.
+    if (cx->qos.scale < 1.0 && !(cx->undistort && device->calib)) {
+        size.width = (uint32_t) (size.width * cx->qos.scale) & ~1u;
+        size.height = (uint32_t) (size.height * cx->qos.scale) & ~1u;
+
+        if (size.width < 2)
+            size.width = 2;
+
+        if (size.height < 2)
+            size.height = 2;
+    }
 
     if (0 > avpicture_fill((AVPicture *) cx->frame_out,
-                           cx->out_buffer[idx].start,
+                           out->start,
                            cx->out_pixfmt, cx->out_stride / cx->b_per_pix,
                            device->framesize.height)) {
         ch_error("Failed to setup output frame fields.");
         return (-1);
     }
 
+    // Recreate the context when the output size changes.
+    if (cx->sws_cx
+        && (cx->sws_size.width != size.width
+            || cx->sws_size.height != size.height)) {
+        sws_freeContext(cx->sws_cx);
+        cx->sws_cx = NULL;
+    }
+
     if (cx->sws_cx == NULL) {
+        cx->sws_size = size;
         cx->sws_cx = sws_getContext(
             device->framesize.width,
             device->framesize.height,
             decode->in_pixfmt,
-            device->framesize.width,
-            device->framesize.height,
+            size.width,
+            size.height,
             cx->out_pixfmt,
             SWS_BILINEAR,
             NULL,
@@ -253,6 +337,8 @@ ch_output(struct ch_device *device, struct ch_decode_cx *decode,
         cx->frame_out->linesize
     );
 
+    out->bytesused = cx->out_stride * size.height;
+    cx->out_frmsize[idx] = size;
     cx->nonce[idx] = cx->nonce[cx->select] + 1;
 
     return (0);
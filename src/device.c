@@ -16,8 +16,6 @@
 
 #include <chiasm.h>
 
-int ch_stop_stream(struct ch_device *device);
-
 /**
  * @brief Parse a double from a string.
  *
@@ -211,12 +209,29 @@ ch_init_device(struct ch_device *device)
     device->timeout = ch_sec_to_timeval(CH_DEFAULT_TIMEOUT);
     device->stream = false;
     device->fps = 0.0;
+    device->frames = 0;
 
     device->calib = NULL;
+
+    device->backend = NULL;
+    device->backend_cx = NULL;
+    device->rate = CH_DEFAULT_RATE;
+
+    device->stats = NULL;
+    device->mon = NULL;
+
+    device->rt = (struct ch_rt) {0, 0};
+    device->qos = (struct ch_qos_ctl) {0.0, 0};
 }
 
-int
-ch_open_device(struct ch_device *device)
+/**
+ * @brief Opens a Video4Linux2 device.
+ *
+ * @param device Device to open.
+ * @return 0 on success, -1 on failure.
+ */
+static int
+ch_v4l2_open(struct ch_device *device)
 {
     struct stat st;
 
@@ -251,8 +266,14 @@ error:
     return (-1);
 }
 
-int
-ch_close_device(struct ch_device *device)
+/**
+ * @brief Closes a Video4Linux2 device.
+ *
+ * @param device Device to close.
+ * @return 0 on success, -1 on failure.
+ */
+static int
+ch_v4l2_close(struct ch_device *device)
 {
     // Only close file-descriptor if still open.
     if (device->fd > 0) {
@@ -708,8 +729,14 @@ ch_validate_frmsize(struct ch_device *device)
     return (r);
 }
 
-int
-ch_set_fmt(struct ch_device *device)
+/**
+ * @brief Sets the format and framesize of a Video4Linux2 device.
+ *
+ * @param device Device to set.
+ * @return 0 on success, -1 on failure.
+ */
+static int
+ch_v4l2_set_fmt(struct ch_device *device)
 {
     // Validate request.
     if (ch_validate_fmt(device) == -1)
@@ -844,8 +871,8 @@ error:
  * @param device Device to begin streaming from.
  * @return 0 on success, -1 on failure.
  */
-int
-ch_start_stream(struct ch_device *device)
+static int
+ch_v4l2_start(struct ch_device *device)
 {
     if (ch_map_buffers(device) == -1)
         return (-1);
@@ -877,6 +904,7 @@ ch_start_stream(struct ch_device *device)
     }
 
     device->stream = true;
+    device->frames = 0;
     return (0);
 
 error:
@@ -890,11 +918,9 @@ error:
  * @param device Device to stop streaming from.
  * @return 0 on succes, -1 on failure.
  */
-int
-ch_stop_stream(struct ch_device *device)
+static int
+ch_v4l2_stop(struct ch_device *device)
 {
-    device->stream = false;
-
     // Send command to device to stop stream.
     if (device->fd > 0) {
         enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
@@ -920,6 +946,248 @@ ch_stop_stream(struct ch_device *device)
     return (0);
 }
 
+/**
+ * @brief Wait for and dequeue the next frame from a device.
+ *
+ * @param device Device to dequeue from.
+ * @param buf Filled in with the dequeued buffer.
+ * @return 1 on a frame, 0 if interrupted, -1 on failure.
+ */
+static int
+ch_v4l2_next(struct ch_device *device, struct ch_frmbuf **buf)
+{
+    bool timed = ch_stage_timed(device->stats);
+    uint64_t t0 = (timed) ? ch_stats_now() : 0;
+
+    // Wait on select for a new frame.
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(device->fd, &fds);
+
+    struct timeval temp = device->timeout;
+    int r = select(device->fd + 1, &fds, NULL, NULL, &temp);
+
+    uint64_t t1 = (timed) ? ch_stats_now() : 0;
+
+    if (r == -1) {
+        if (errno == EINTR)
+            return (0);
+
+        ch_error_no("Error on select.", errno);
+        return (-1);
+
+    } else if (r == 0) {
+        ch_error("Timeout on select.");
+        return (-1);
+    }
+
+    // Verify we are still streaming after select.
+    if (!device->stream)
+        return (0);
+
+    // Dequeue buffer.
+    struct v4l2_buffer vbuf;
+    CH_CLEAR(&vbuf);
+
+    vbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    vbuf.memory = V4L2_MEMORY_MMAP;
+
+    if (ch_ioctl(device, VIDIOC_DQBUF, &vbuf) == -1) {
+        ch_error("Failure dequeing buffer.");
+        return (-1);
+    }
+
+    if (timed) {
+        ch_stage_record(device->stats, CH_STAGE_WAIT, device->frames, t0, t1);
+        ch_stage_record(device->stats, CH_STAGE_DEQUEUE, device->frames,
+                        t1, ch_stats_now());
+    }
+
+    // Verify buffer is valid.
+    if (vbuf.index >= device->num_buffers) {
+        ch_error("Bad buffer index returned from dequeue.");
+        return (-1);
+    }
+
+    // Set current size and capture time of input buffer.
+    *buf = &device->in_buffers[vbuf.index];
+    (*buf)->bytesused = vbuf.bytesused;
+    (*buf)->timestamp = vbuf.timestamp;
+
+    return (1);
+}
+
+/**
+ * @brief Requeue a buffer dequeued by ch_v4l2_next.
+ *
+ * @param device Device the buffer belongs to.
+ * @param buf Buffer to requeue.
+ * @return 0 on success, -1 on failure.
+ */
+static int
+ch_v4l2_release(struct ch_device *device, struct ch_frmbuf *buf)
+{
+    struct v4l2_buffer vbuf;
+    CH_CLEAR(&vbuf);
+
+    vbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    vbuf.memory = V4L2_MEMORY_MMAP;
+    vbuf.index = buf - device->in_buffers;
+
+    if (ch_ioctl(device, VIDIOC_QBUF, &vbuf) == -1) {
+        ch_error("Failure requeing buffer.");
+        return (-1);
+    }
+
+    return (0);
+}
+
+const struct ch_backend ch_v4l2_backend = {
+    "",
+    ch_v4l2_open,
+    ch_v4l2_close,
+    ch_v4l2_set_fmt,
+    ch_v4l2_start,
+    ch_v4l2_stop,
+    ch_v4l2_next,
+    ch_v4l2_release
+};
+
+// Backends selected by device name prefix. V4L2 matches anything left.
+static const struct ch_backend *ch_backends[] = {
+    &ch_synth_backend,
+    &ch_images_backend,
+    &ch_v4l2_backend,
+    NULL
+};
+
+int
+ch_open_device(struct ch_device *device)
+{
+    size_t idx;
+    for (idx = 0; ch_backends[idx] != NULL; idx++)
+        if (strncmp(device->name, ch_backends[idx]->prefix,
+                    strlen(ch_backends[idx]->prefix)) == 0)
+            break;
+
+    device->backend = ch_backends[idx];
+
+    // Generated sources take their rate after the name.
+    const char *rate = strrchr(device->name, '@');
+    if (device->backend != &ch_v4l2_backend && rate != NULL
+        && ch_parse_double((char *) rate + 1, &device->rate) == -1) {
+        ch_error("Invalid source rate.");
+        return (-1);
+    }
+
+    if (device->backend->open && device->backend->open(device) == -1) {
+        device->backend = NULL;
+        return (-1);
+    }
+
+    return (0);
+}
+
+int
+ch_close_device(struct ch_device *device)
+{
+    const struct ch_backend *backend = device->backend;
+    if (backend == NULL)
+        return (0);
+
+    device->backend = NULL;
+
+    if (backend->close && backend->close(device) == -1)
+        return (-1);
+
+    return (0);
+}
+
+int
+ch_set_fmt(struct ch_device *device)
+{
+    if (device->backend == NULL) {
+        ch_error("Device is not open.");
+        return (-1);
+    }
+
+    if (device->backend->set_fmt)
+        return (device->backend->set_fmt(device));
+
+    return (0);
+}
+
+int
+ch_start_stream(struct ch_device *device)
+{
+    if (device->backend == NULL) {
+        ch_error("Device is not open.");
+        return (-1);
+    }
+
+    if (device->backend->start && device->backend->start(device) == -1)
+        return (-1);
+
+    device->stream = true;
+    return (0);
+}
+
+int
+ch_stop_stream(struct ch_device *device)
+{
+    device->stream = false;
+
+    if (device->backend && device->backend->stop)
+        return (device->backend->stop(device));
+
+    return (0);
+}
+
+void
+ch_backend_pace(struct ch_device *device, struct timespec *due)
+{
+    if (device->rate <= 0.0)
+        return;
+
+    if (due->tv_sec == 0 && due->tv_nsec == 0)
+        clock_gettime(CLOCK_MONOTONIC, due);
+
+    bool timed = ch_stage_timed(device->stats);
+    uint64_t t0 = (timed) ? ch_stats_now() : 0;
+
+    while (device->stream
+           && clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, due, NULL) == EINTR);
+
+    if (timed)
+        ch_stage_record(device->stats, CH_STAGE_WAIT, device->frames,
+                        t0, ch_stats_now());
+
+    *due = ch_sec_to_timespec(ch_timespec_to_sec(*due) + 1.0 / device->rate);
+}
+
+void
+ch_backend_timestamp(struct ch_frmbuf *buf)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    buf->timestamp.tv_sec = ts.tv_sec;
+    buf->timestamp.tv_usec = ts.tv_nsec / 1000;
+}
+
+void
+ch_update_fps(struct ch_device *device, double *pt)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    double t = ch_timespec_to_sec(ts);
+
+    if (*pt > 0)
+        device->fps = (1.0 - CH_FPS_UPDATE) * device->fps
+            + CH_FPS_UPDATE * (1.0 / (t - *pt));
+    *pt = t;
+}
+
 int
 ch_stream(struct ch_device *device, struct ch_dl **plugins, uint32_t n_plugins)
 {
@@ -928,15 +1196,19 @@ ch_stream(struct ch_device *device, struct ch_dl **plugins, uint32_t n_plugins)
         return (-1);
     }
 
-    struct timespec ts;
     double pt = -1;
 
+    ch_trace_name("capture");
+
+    // Scheduling failures are reported, but streaming goes on without.
+    ch_rt_apply(&device->rt);
+
     int r = 0;
     // Initialize and create plugin context and threads.
     if ((r = ch_init_plugins(device, plugins, n_plugins)) == -1)
         goto clean;
 
-    // Start streaming from the camera.
+    // Start streaming from the source.
     if ((r = ch_start_stream(device)) == -1)
         goto clean;
 
@@ -945,83 +1217,68 @@ ch_stream(struct ch_device *device, struct ch_dl **plugins, uint32_t n_plugins)
     if ((r = ch_init_decode_cx(device, &decode)) == -1)
         goto clean;
 
-    while (device->stream) {
-        // Update FPS
-        clock_gettime(CLOCK_MONOTONIC, &ts);
-        double t = ch_timespec_to_sec(ts);
-
-        if (pt > 0)
-            device->fps = (1.0 - CH_FPS_UPDATE) * device->fps
-                + CH_FPS_UPDATE * (1.0 / (t - pt));
-        pt = t;
-
-        // Wait on select for a new frame.
-        fd_set fds;
-        FD_ZERO(&fds);
-        FD_SET(device->fd, &fds);
-
-        struct timeval temp = device->timeout;
-        r = select(device->fd + 1, &fds, NULL, NULL, &temp);
-
-        if (r == -1) {
-	    if (errno == EINTR) {
-		r = 0;
-		continue;
-	    }
-
-            ch_error_no("Error on select.", errno);
-            break;
+    // Skip decoding entirely if no plugin needs decoded frames.
+    decode.passthrough = (n_plugins > 0);
 
-        } else if (r == 0) {
-            ch_error("Timeout on select.");
-            r = -1;
-            break;
-        }
+    uint32_t idx;
+    for (idx = 0; idx < n_plugins; idx++)
+        if (!plugins[idx]->cx.passthrough)
+            decode.passthrough = false;
 
-        // Verify we are still streaming after select.
-        if (!device->stream)
+    while (device->stream) {
+        // Wait for the next frame from the source.
+        struct ch_frmbuf *buf;
+        if ((r = device->backend->next(device, &buf)) == -1)
             break;
 
-        // Dequeue buffer.
-        struct v4l2_buffer buf;
-        CH_CLEAR(&buf);
+        if (r == 0)
+            continue;
 
-        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory = V4L2_MEMORY_MMAP;
+        ch_update_fps(device, &pt);
+        buf->sequence = device->frames++;
 
-        if ((r = ch_ioctl(device, VIDIOC_DQBUF, &buf)) == -1) {
-            ch_error("Failure dequeing buffer.");
-            break;
-        }
+        // CPU cost covers decoding and conversion for every plugin.
+        struct ch_cpu_sample cpu;
+        if (device->stats)
+            ch_cpu_sample(&cpu);
 
-        // Verify buffer is valid.
-        if (buf.index > device->num_buffers) {
-            ch_error("Bad buffer index returned from dequeue.");
-            r = -1;
-            break;
+        if (device->mon) {
+            __atomic_store_n(&device->mon->frames, device->frames,
+                             __ATOMIC_RELAXED);
+            __atomic_store_n(&device->mon->fps_milli,
+                             (uint64_t) (device->fps * 1000.0), __ATOMIC_RELAXED);
         }
 
-        // Set current size of input buffer.
-	device->in_buffers[buf.index].length = buf.bytesused;
-
         // Decode the new frame.
-        if ((r = ch_decode(device, &device->in_buffers[buf.index], &decode)) == -1)
+        bool timed = ch_stage_timed(device->stats);
+        uint64_t t0 = (timed) ? ch_stats_now() : 0;
+
+        if ((r = ch_decode(device, buf, &decode)) == -1)
             break;
 
+        if (timed)
+            ch_stage_record(device->stats, CH_STAGE_DECODE, buf->sequence,
+                            t0, ch_stats_now());
+
         if ((r = ch_update_plugins(device, &decode, plugins, n_plugins)) == -1)
             break;
 
-        // Queue buffer.
-        if ((r = ch_ioctl(device, VIDIOC_QBUF, &buf)) == -1) {
-            ch_error("Failure requeing buffer.");
-            break;
+        if (device->stats) {
+            cpu.cpu_ns -= decode.cpu_ns;
+            ch_cpu_record(device->stats, device->mon, &cpu);
         }
+
+        // Return the buffer to the source.
+        if (device->backend->release
+            && (r = device->backend->release(device, buf)) == -1)
+            break;
     }
 
 clean:
     ch_destroy_decode_cx(&decode);
     ch_quit_plugins(plugins, n_plugins);
     ch_stop_stream(device);
+    ch_cpu_release();
 
     return (r);
 }
@@ -1,4 +1,18 @@
 #include <iostream>
+#include <string>
+#include <algorithm>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <float.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #include <opencv2/core/core.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
@@ -6,8 +20,283 @@
 
 #include <chiasm.h>
 
+#define CH_CALIB_CACHE_EXT     ".cache"
+#define CH_CALIB_CACHE_MAGIC   0x48435843 // "CXCH"
+#define CH_CALIB_CACHE_VERSION 2
+#define CH_CALIB_CACHE_ALIGN   64
+
+/**
+ * @brief On-disk header of a binary calibration cache. The rectification maps
+ *        follow the header at the recorded offsets.
+ */
+struct ch_calib_cache_header {
+    uint32_t       magic;             /**< Always CH_CALIB_CACHE_MAGIC. */
+    uint32_t       version;           /**< Always CH_CALIB_CACHE_VERSION. */
+    uint64_t       key;               /**< Hash of calibration and output. */
+    struct ch_rect framesize;         /**< Size of frame calibration was done on. */
+    struct ch_rect boardsize;         /**< Size of calibration board. */
+    double         squaresize;        /**< Size of square on calibration board. */
+    double         reproj_err;        /**< Reprojection error of calibration. */
+    double         camera_mat[3][3];  /**< Camera intrinsics matrix. */
+    double         distort_coeffs[5]; /**< Distortion coefficients of camera. */
+    struct ch_roi  roi;               /**< Region of the rectified frame output. */
+    struct ch_rect outsize;           /**< Size of the rectified output image. */
+    double         rect_mat[3][3];    /**< Intrinsics of the rectified output. */
+    uint64_t       map1_offset;       /**< Offset of map 1 (CV_16SC2). */
+    uint64_t       map1_length;       /**< Length of map 1 in bytes. */
+    uint64_t       map2_offset;       /**< Offset of map 2 (CV_16UC1). */
+    uint64_t       map2_length;       /**< Length of map 2 in bytes. */
+};
+
+/**
+ * @brief FNV-1a hash over a buffer.
+ *
+ * @param buf Buffer to hash.
+ * @param length Length of the buffer.
+ * @param hash Hash to continue from.
+ * @return The updated hash.
+ */
+static uint64_t
+ch_hash(const void *buf, size_t length, uint64_t hash)
+{
+    const uint8_t *p = (const uint8_t *) buf;
+
+    size_t idx;
+    for (idx = 0; idx < length; idx++) {
+        hash ^= p[idx];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return (hash);
+}
+
+/**
+ * @brief Read the entire contents of a file.
+ *
+ * @param filename File to read.
+ * @param contents String to fill with file contents.
+ * @return 0 on success, -1 on failure.
+ */
+static int
+ch_read_file(const char *filename, string &contents)
+{
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL) {
+        ch_error_no("Failed to open calibration file.", errno);
+        return (-1);
+    }
+
+    char buf[4096];
+    size_t r;
+    while ((r = fread(buf, 1, sizeof(buf), file)) > 0)
+        contents.append(buf, r);
+
+    int err = ferror(file);
+    fclose(file);
+
+    if (err) {
+        ch_error("Failed to read calibration file.");
+        return (-1);
+    }
+
+    return (0);
+}
+
+/**
+ * @brief Round an offset up to the cache alignment.
+ */
+static inline uint64_t
+ch_cache_align(uint64_t offset)
+{
+    return ((offset + CH_CALIB_CACHE_ALIGN - 1)
+            & ~((uint64_t) CH_CALIB_CACHE_ALIGN - 1));
+}
+
+/**
+ * @brief Memory-map a binary calibration cache and use its precomputed
+ *        rectification maps.
+ *
+ * @param device Device the calibration is for.
+ * @param calib Calibration to fill in.
+ * @param cache_name Filename of the cache.
+ * @param key Expected key of the cache.
+ * @return 0 on success, -1 if the cache is missing or stale.
+ */
+static int
+ch_map_calib_cache(struct ch_device *device, struct ch_calibration *calib,
+                   const string &cache_name, uint64_t key)
+{
+    int fd = open(cache_name.c_str(), O_RDONLY);
+    if (fd == -1)
+        return (-1);
+
+    struct stat st;
+    if (fstat(fd, &st) == -1
+        || (size_t) st.st_size < sizeof(struct ch_calib_cache_header)) {
+        close(fd);
+        return (-1);
+    }
+
+    void *cache = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (cache == MAP_FAILED) {
+        ch_error_no("Failed to map calibration cache.", errno);
+        return (-1);
+    }
+
+    const struct ch_calib_cache_header *header =
+        (const struct ch_calib_cache_header *) cache;
+
+    uint64_t map1_length = (uint64_t) calib->outsize.width
+        * calib->outsize.height * 2 * sizeof(int16_t);
+    uint64_t map2_length = (uint64_t) calib->outsize.width
+        * calib->outsize.height * sizeof(uint16_t);
+
+    // Reject caches from other versions, calibrations or outputs.
+    if (header->magic != CH_CALIB_CACHE_MAGIC
+        || header->version != CH_CALIB_CACHE_VERSION
+        || header->key != key
+        || header->framesize.width != device->framesize.width
+        || header->framesize.height != device->framesize.height
+        || memcmp(&header->roi, &calib->roi, sizeof(calib->roi)) != 0
+        || header->outsize.width != calib->outsize.width
+        || header->outsize.height != calib->outsize.height
+        || header->map1_length != map1_length
+        || header->map2_length != map2_length
+        || header->map1_offset + map1_length > (uint64_t) st.st_size
+        || header->map2_offset + map2_length > (uint64_t) st.st_size) {
+        munmap(cache, st.st_size);
+        return (-1);
+    }
+
+    calib->framesize = header->framesize;
+    calib->boardsize = header->boardsize;
+    calib->squaresize = header->squaresize;
+    calib->reproj_err = header->reproj_err;
+    memcpy(calib->camera_mat, header->camera_mat, sizeof(calib->camera_mat));
+    memcpy(calib->distort_coeffs, header->distort_coeffs,
+           sizeof(calib->distort_coeffs));
+    memcpy(calib->rect_mat, header->rect_mat, sizeof(calib->rect_mat));
+
+    // Maps point directly into the shared mapping and are never written to.
+    uint8_t *base = (uint8_t *) cache;
+    calib->map1 = new cv::Mat(calib->outsize.height, calib->outsize.width,
+                              CV_16SC2, base + header->map1_offset);
+    calib->map2 = new cv::Mat(calib->outsize.height, calib->outsize.width,
+                              CV_16UC1, base + header->map2_offset);
+
+    calib->cache = cache;
+    calib->cache_length = st.st_size;
+
+    return (0);
+}
+
+/**
+ * @brief Write all of a buffer to a file-descriptor.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int
+ch_write_all(int fd, const void *buf, size_t length)
+{
+    const uint8_t *p = (const uint8_t *) buf;
+
+    while (length > 0) {
+        ssize_t r = write(fd, p, length);
+        if (r == -1) {
+            if (errno == EINTR)
+                continue;
+
+            return (-1);
+        }
+
+        p += r;
+        length -= r;
+    }
+
+    return (0);
+}
+
+/**
+ * @brief Write a binary calibration cache. The cache is written to a temporary
+ *        file and renamed into place so concurrent readers never see a partial
+ *        cache.
+ *
+ * @param calib Calibration to save.
+ * @param cache_name Filename of the cache.
+ * @param key Key of the cache.
+ * @param map1 Rectification map 1.
+ * @param map2 Rectification map 2.
+ * @return 0 on success, -1 on failure.
+ */
+static int
+ch_write_calib_cache(struct ch_calibration *calib, const string &cache_name,
+                     uint64_t key, const cv::Mat &map1, const cv::Mat &map2)
+{
+    if (!map1.isContinuous() || !map2.isContinuous())
+        return (-1);
+
+    struct ch_calib_cache_header header;
+    CH_CLEAR(&header);
+
+    header.magic = CH_CALIB_CACHE_MAGIC;
+    header.version = CH_CALIB_CACHE_VERSION;
+    header.key = key;
+    header.framesize = calib->framesize;
+    header.boardsize = calib->boardsize;
+    header.squaresize = calib->squaresize;
+    header.reproj_err = calib->reproj_err;
+    memcpy(header.camera_mat, calib->camera_mat, sizeof(header.camera_mat));
+    memcpy(header.distort_coeffs, calib->distort_coeffs,
+           sizeof(header.distort_coeffs));
+    header.roi = calib->roi;
+    header.outsize = calib->outsize;
+    memcpy(header.rect_mat, calib->rect_mat, sizeof(header.rect_mat));
+
+    header.map1_length = map1.total() * map1.elemSize();
+    header.map1_offset = ch_cache_align(sizeof(header));
+    header.map2_length = map2.total() * map2.elemSize();
+    header.map2_offset = ch_cache_align(header.map1_offset + header.map1_length);
+
+    char pid[32];
+    snprintf(pid, sizeof(pid), ".%d", (int) getpid());
+    string temp_name = cache_name + pid;
+
+    int fd = open(temp_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        ch_error_no("Failed to create calibration cache.", errno);
+        return (-1);
+    }
+
+    static const uint8_t pad[CH_CALIB_CACHE_ALIGN] = { 0 };
+
+    if (ch_write_all(fd, &header, sizeof(header)) == -1
+        || ch_write_all(fd, pad, header.map1_offset - sizeof(header)) == -1
+        || ch_write_all(fd, map1.data, header.map1_length) == -1
+        || ch_write_all(fd, pad, header.map2_offset
+                        - (header.map1_offset + header.map1_length)) == -1
+        || ch_write_all(fd, map2.data, header.map2_length) == -1) {
+        ch_error_no("Failed to write calibration cache.", errno);
+        close(fd);
+        unlink(temp_name.c_str());
+        return (-1);
+    }
+
+    close(fd);
+
+    if (rename(temp_name.c_str(), cache_name.c_str()) == -1) {
+        ch_error_no("Failed to move calibration cache into place.", errno);
+        unlink(temp_name.c_str());
+        return (-1);
+    }
+
+    return (0);
+}
+
 int
-ch_load_calibration(struct ch_device *device, const char *filename)
+ch_load_calibration(struct ch_device *device, const char *filename,
+                    const struct ch_rect *outsize, const struct ch_roi *roi)
 {
     struct ch_calibration *calib =
         (struct ch_calibration *) ch_calloc(1, sizeof(struct ch_calibration));
@@ -15,14 +304,61 @@ ch_load_calibration(struct ch_device *device, const char *filename)
     if (calib == NULL)
         return (-1);
 
-    cv::FileStorage in((string) filename, cv::FileStorage::READ);
+    // Default to rectifying the full frame at full resolution.
+    if (roi)
+        calib->roi = *roi;
+    else {
+        calib->roi.x = 0;
+        calib->roi.y = 0;
+        calib->roi.size = device->framesize;
+    }
+
+    calib->outsize = (outsize) ? *outsize : calib->roi.size;
+
+    if (calib->roi.size.width == 0 || calib->roi.size.height == 0
+        || calib->roi.x + calib->roi.size.width > device->framesize.width
+        || calib->roi.y + calib->roi.size.height > device->framesize.height) {
+        ch_error("Rectification region is outside of the frame.");
+        free(calib);
+        return (-1);
+    }
+
+    if (calib->outsize.width == 0 || calib->outsize.height == 0
+        || calib->outsize.width > device->framesize.width
+        || calib->outsize.height > device->framesize.height) {
+        ch_error("Rectification output size is larger than the frame.");
+        free(calib);
+        return (-1);
+    }
+
+    string contents;
+    if (ch_read_file(filename, contents) == -1) {
+        free(calib);
+        return (-1);
+    }
+
+    // Cache is keyed on the calibration contents, framesize and output.
+    uint64_t key = ch_hash(contents.data(), contents.size(),
+                           0xcbf29ce484222325ULL);
+    key = ch_hash(&device->framesize, sizeof(device->framesize), key);
+    key = ch_hash(&calib->roi, sizeof(calib->roi), key);
+    key = ch_hash(&calib->outsize, sizeof(calib->outsize), key);
+
+    string cache_name = (string) filename + CH_CALIB_CACHE_EXT;
+
+    // Use precomputed maps if available.
+    if (ch_map_calib_cache(device, calib, cache_name, key) == 0) {
+        device->calib = calib;
+        return (0);
+    }
+
+    cv::FileStorage in(contents, cv::FileStorage::READ | cv::FileStorage::MEMORY);
 
     if (!in.isOpened()) {
         ch_error((const char *) "Failed to open calibration file.");
         free(calib);
         return (-1);
     }
-
     cv::Size image_size;
     in["image_size"] >> image_size;
 
@@ -63,18 +399,44 @@ ch_load_calibration(struct ch_device *device, const char *filename)
             calib->distort_coeffs[idx] = distort_coeffs.at<double>(idx);
     }
 
+    // Shift the rectified intrinsics to the region and scale to the output,
+    // so the maps only sample the pixels that are actually produced.
+    cv::Mat rect_mat = cv::getOptimalNewCameraMatrix(camera_mat, distort_coeffs,
+                                                     image_size, 1, image_size, 0);
+
+    double sx = (double) calib->outsize.width / calib->roi.size.width;
+    double sy = (double) calib->outsize.height / calib->roi.size.height;
+
+    rect_mat.at<double>(0, 0) *= sx;
+    rect_mat.at<double>(0, 1) *= sx;
+    rect_mat.at<double>(0, 2) = (rect_mat.at<double>(0, 2) - calib->roi.x) * sx;
+    rect_mat.at<double>(1, 1) *= sy;
+    rect_mat.at<double>(1, 2) = (rect_mat.at<double>(1, 2) - calib->roi.y) * sy;
+
+    {
+        size_t idx;
+        for (idx = 0; idx < 3; idx++) {
+            size_t jdx;
+            for (jdx = 0; jdx < 3; jdx++)
+                calib->rect_mat[idx][jdx] = rect_mat.at<double>(idx, jdx);
+        }
+    }
+
     cv::Mat *map1 = new cv::Mat();
     cv::Mat *map2 = new cv::Mat();
-    cv::initUndistortRectifyMap(camera_mat, distort_coeffs, cv::Mat(),
-                                cv::getOptimalNewCameraMatrix(camera_mat, distort_coeffs,
-                                                              image_size, 1, image_size, 0),
-                                image_size, CV_16SC2, *map1, *map2);
+    cv::initUndistortRectifyMap(camera_mat, distort_coeffs, cv::Mat(), rect_mat,
+                                cv::Size(calib->outsize.width,
+                                         calib->outsize.height),
+                                CV_16SC2, *map1, *map2);
 
     calib->map1 = map1;
     calib->map2 = map2;
 
     in.release();
 
+    // Failure to cache is not fatal, the maps are recomputed next time.
+    ch_write_calib_cache(calib, cache_name, key, *map1, *map2);
+
     device->calib = calib;
 
     return (0);
@@ -90,11 +452,8 @@ ch_close_calibration(struct ch_device *device)
         delete map1;
         delete map2;
 
-        if (device->calib->temp1)
-            free(device->calib->temp1);
-
-        if (device->calib->temp2)
-            free(device->calib->temp2);
+        if (device->calib->cache)
+            munmap(device->calib->cache, device->calib->cache_length);
 
         free(device->calib);
     }
@@ -120,78 +479,107 @@ ch_save_calibration(string filename, cv::Size image_size, cv::Size board_size,
     out.release();
 }
 
-/**
- * @brief Convert a ch_frmbuf array image into a OpenCV Mat image.
- *
- * @param buf ch_frmbuf to convert.
- * @param mat Output Mat to fill. Should already be allocated.
- * @param size Image size.
- * @param stride Stride of buf.
- * @param b_per_pix Bytes per pixel in ch_frmbuf.
- * @return None.
- */
-void
-ch_frmbuf_to_mat(struct ch_frmbuf *buf, cv::Mat &mat, struct ch_rect *size,
-                 uint32_t stride, uint32_t b_per_pix)
+double
+ch_board_scale(cv::Size image_size, int search_width)
 {
-    size_t idx;
-    for (idx = 0; idx < size->height; idx++) {
-        uint8_t *dest = mat.ptr(idx);
-        uint8_t *src = &buf->start[idx * stride];
+    if (search_width <= 0 || image_size.width <= search_width)
+        return (1.0);
 
-        memcpy(dest, src, b_per_pix * size->width);
-    }
+    return ((double) search_width / image_size.width);
 }
 
-/**
- * @brief Convert an OpenCV Mat image into a ch_frmbuf array.
- *
- * @param mat Mat to convert.
- * @param buf ch_frmbuf to output to.
- * @param size Image size.
- * @param stride Stride of buf.
- * @param b_per_pix Bytes per pixel in ch_frmbuf.
- * @return None.
- */
-void
-ch_mat_to_frmbuf(cv::Mat &mat, struct ch_frmbuf *buf, struct ch_rect *size,
-                 uint32_t stride, uint32_t b_per_pix)
+bool
+ch_find_board(const cv::Mat &image, const cv::Mat &small, double scale,
+              cv::Size board_size, vector< cv::Point2f > &corners)
 {
+    int flags = CV_CALIB_CB_ADAPTIVE_THRESH | CV_CALIB_CB_FAST_CHECK
+        | CV_CALIB_CB_NORMALIZE_IMAGE;
+
+    if (!cv::findChessboardCorners(small, board_size, corners, flags))
+        return (false);
+
     size_t idx;
-    for (idx = 0; idx < size->height; idx++) {
-        uint8_t *dest = &buf->start[idx * stride];
-        uint8_t *src = mat.ptr(idx);
+    for (idx = 0; idx < corners.size(); idx++) {
+        corners[idx].x /= scale;
+        corners[idx].y /= scale;
+    }
+
+    // Window must cover the error of the coarse corners.
+    int coarse = (int) (1.0 / scale + 0.5) * 2;
+    cv::Size window(max(CH_BOARD_WINDOW, coarse), max(CH_BOARD_WINDOW, coarse));
+
+    cv::cornerSubPix(image, corners, window, cv::Size(-1, -1),
+                     cv::TermCriteria(CV_TERMCRIT_EPS | CV_TERMCRIT_ITER,
+                                      CH_BOARD_ITER, CH_BOARD_EPS));
+
+    return (true);
+}
 
-        memcpy(dest, src, b_per_pix * size->width);
+double
+ch_calibrate_camera(const vector< vector< cv::Point2f > > &image_points,
+                    cv::Size image_size, cv::Size board_size,
+                    double square_size, bool guess, int iter,
+                    cv::Mat &camera_mat, cv::Mat &distortion_coeffs)
+{
+    int flags = CV_CALIB_FIX_PRINCIPAL_POINT | CV_CALIB_FIX_ASPECT_RATIO
+        | CV_CALIB_FIX_K4 | CV_CALIB_FIX_K5;
+
+    // Create reference object points.
+    vector< cv::Point3f > corners;
+
+    int idx;
+    for (idx = 0; idx < board_size.width; idx++) {
+        int jdx;
+        for (jdx = 0; jdx < board_size.height; jdx++)
+            corners.push_back(
+                cv::Point3f(square_size * idx, square_size * jdx, 0));
     }
+
+    vector< vector < cv::Point3f > > object_points;
+    object_points.resize(image_points.size(), corners);
+
+    if (guess)
+        flags |= CV_CALIB_USE_INTRINSIC_GUESS;
+
+    else {
+        // Create camera project matrix.
+        camera_mat = cv::Mat::eye(3, 3, CV_64F);
+
+        // If fixed aspect ratio, set F_x to 0.
+        if (flags & CV_CALIB_FIX_ASPECT_RATIO)
+            camera_mat.at< double >(0, 0) = 1.0;
+
+        distortion_coeffs = cv::Mat::zeros(8, 1, CV_64F);
+    }
+
+    vector< cv::Mat > rotation_vec, translation_vec;
+
+    return (cv::calibrateCamera(
+        object_points, image_points, image_size, camera_mat,
+        distortion_coeffs, rotation_vec, translation_vec, flags,
+        cv::TermCriteria(CV_TERMCRIT_EPS | CV_TERMCRIT_ITER, iter,
+                         DBL_EPSILON)));
 }
 
 void
 ch_undistort(struct ch_device *device, struct ch_dl_cx *cx, struct ch_frmbuf *buf)
 {
+    struct ch_calibration *calib = device->calib;
+
     cv::Size image_size(device->framesize.width, device->framesize.height);
+    cv::Size out_size(calib->outsize.width, calib->outsize.height);
 
-    cv::Mat *map1 = reinterpret_cast< cv::Mat * >(device->calib->map1);
-    cv::Mat *map2 = reinterpret_cast< cv::Mat * >(device->calib->map2);
+    cv::Mat *map1 = reinterpret_cast< cv::Mat * >(calib->map1);
+    cv::Mat *map2 = reinterpret_cast< cv::Mat * >(calib->map2);
 
-    cv::Mat image;
-    if (cx->out_stride == device->framesize.width * cx->b_per_pix)
-        image = cv::Mat(image_size, CV_8UC(cx->b_per_pix), buf->start);
-    else {
-        image = cv::Mat(image_size, CV_8UC(cx->b_per_pix), device->calib->temp1);
-        ch_frmbuf_to_mat(buf, image, &device->framesize,
-                         cx->out_stride, cx->b_per_pix);
-    }
+    // Wrap the buffers with the plugin's stride to avoid repacking the rows.
+    cv::Mat image(image_size, CV_8UC(cx->b_per_pix), buf->start, cx->out_stride);
+    cv::Mat undist(out_size, CV_8UC(cx->b_per_pix), cx->undist_buffer,
+                   cx->out_stride);
 
-    cv::Mat undist(image_size, CV_8UC(cx->b_per_pix), device->calib->temp2);
     cv::remap(image, undist, *map1, *map2, cv::INTER_LINEAR);
 
-    if (cx->out_stride == device->framesize.width * cx->b_per_pix) {
-        uint8_t *temp = buf->start;
-        buf->start = device->calib->temp2;
-        device->calib->temp2 = temp;
-    } else {
-        ch_mat_to_frmbuf(undist, buf, &device->framesize,
-                         cx->out_stride, cx->b_per_pix);
-    }
+    uint8_t *temp = buf->start;
+    buf->start = cx->undist_buffer;
+    cx->undist_buffer = temp;
 }
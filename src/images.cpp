@@ -0,0 +1,297 @@
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
+
+#include <linux/videodev2.h>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/highgui/highgui.hpp>
+
+#include <chiasm.h>
+
+#define CH_IMAGES_PREFIX "images:"
+
+using namespace std;
+
+/**
+ * @brief State of an image sequence source.
+ */
+struct ch_images_cx {
+    vector< string >  files;   /**< Images in the sequence, sorted by name. */
+    size_t            next;    /**< Next image to return. */
+    struct timespec   due;     /**< Time the next frame is due. */
+    struct ch_frmbuf  frame;   /**< Frame returned to the stream. */
+    vector< uint8_t > data;    /**< Storage of the frame. */
+};
+
+/**
+ * @brief Get the lowercase extension of a filename.
+ */
+static string
+ch_images_ext(const string &name)
+{
+    size_t dot = name.rfind('.');
+    if (dot == string::npos)
+        return ("");
+
+    string ext = name.substr(dot);
+    transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+
+    return (ext);
+}
+
+/**
+ * @brief Check if a file is a JPEG image.
+ */
+static bool
+ch_images_is_jpeg(const string &name)
+{
+    string ext = ch_images_ext(name);
+    return (ext == ".jpg" || ext == ".jpeg");
+}
+
+/**
+ * @brief Open an image sequence, listing the images in its directory.
+ */
+static int
+ch_images_open(struct ch_device *device)
+{
+    static const char *exts[] = {
+        ".png", ".jpg", ".jpeg", ".pgm", ".ppm", ".bmp", ".tif", ".tiff", NULL
+    };
+
+    // Directory runs from the prefix to the optional rate.
+    string path = device->name + strlen(CH_IMAGES_PREFIX);
+    size_t at = path.rfind('@');
+    if (at != string::npos)
+        path.erase(at);
+
+    DIR *dir = opendir(path.c_str());
+    if (dir == NULL) {
+        ch_error_no("Failed to open image directory.", errno);
+        return (-1);
+    }
+
+    struct ch_images_cx *cx = new struct ch_images_cx;
+    cx->next = 0;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        string ext = ch_images_ext(entry->d_name);
+
+        size_t idx;
+        for (idx = 0; exts[idx] != NULL; idx++)
+            if (ext == exts[idx])
+                cx->files.push_back(path + "/" + entry->d_name);
+    }
+
+    closedir(dir);
+
+    if (cx->files.empty()) {
+        ch_error("No images found in directory.");
+        delete cx;
+        return (-1);
+    }
+
+    sort(cx->files.begin(), cx->files.end());
+
+    device->backend_cx = cx;
+    return (0);
+}
+
+/**
+ * @brief Close an image sequence.
+ */
+static int
+ch_images_close(struct ch_device *device)
+{
+    delete (struct ch_images_cx *) device->backend_cx;
+    device->backend_cx = NULL;
+
+    return (0);
+}
+
+/**
+ * @brief Validate the format of an image sequence and take the framesize
+ *        from its first image.
+ */
+static int
+ch_images_set_fmt(struct ch_device *device)
+{
+    struct ch_images_cx *cx = (struct ch_images_cx *) device->backend_cx;
+
+    if (device->in_pixfmt == V4L2_PIX_FMT_MJPEG) {
+        size_t idx;
+        for (idx = 0; idx < cx->files.size(); idx++) {
+            if (!ch_images_is_jpeg(cx->files[idx])) {
+                ch_error("MJPEG image sequences must only hold JPEG images.");
+                return (-1);
+            }
+        }
+
+    } else if (device->in_pixfmt != V4L2_PIX_FMT_YUYV) {
+        ch_error("Unsupported format for image sequence.");
+        return (-1);
+    }
+
+    cv::Mat image = cv::imread(cx->files[0], CV_LOAD_IMAGE_COLOR);
+    if (image.empty()) {
+        ch_error("Failed to read first image of sequence.");
+        return (-1);
+    }
+
+    // YUYV pairs pixels, so drop an odd column.
+    device->framesize.width = image.cols & ~1;
+    device->framesize.height = image.rows;
+
+    return (0);
+}
+
+/**
+ * @brief Rewind an image sequence.
+ */
+static int
+ch_images_start(struct ch_device *device)
+{
+    struct ch_images_cx *cx = (struct ch_images_cx *) device->backend_cx;
+
+    cx->next = 0;
+    cx->due.tv_sec = 0;
+    cx->due.tv_nsec = 0;
+
+    if (device->in_pixfmt == V4L2_PIX_FMT_YUYV)
+        cx->data.resize(2 * device->framesize.width * device->framesize.height);
+
+    return (0);
+}
+
+/**
+ * @brief Read a JPEG image as an MJPEG frame, without decoding it.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int
+ch_images_read_jpeg(struct ch_images_cx *cx, const string &filename)
+{
+    FILE *file = fopen(filename.c_str(), "rb");
+    if (file == NULL) {
+        ch_error_no("Failed to open image.", errno);
+        return (-1);
+    }
+
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    cx->data.resize((length > 0) ? length : 0);
+
+    bool ok = (length > 0
+               && fread(&cx->data[0], 1, length, file) == (size_t) length);
+    fclose(file);
+
+    if (!ok) {
+        ch_error("Failed to read image.");
+        return (-1);
+    }
+
+    return (0);
+}
+
+/**
+ * @brief Read an image and convert it to YUYV at the device framesize.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int
+ch_images_read_yuyv(struct ch_device *device, struct ch_images_cx *cx,
+                    const string &filename)
+{
+    cv::Mat image = cv::imread(filename, CV_LOAD_IMAGE_COLOR);
+    if (image.empty()) {
+        ch_error("Failed to read image.");
+        return (-1);
+    }
+
+    int w = device->framesize.width;
+    int h = device->framesize.height;
+
+    if (image.cols != w || image.rows != h)
+        cv::resize(image, image, cv::Size(w, h), 0, 0, cv::INTER_AREA);
+
+    cv::Mat yuv;
+    cv::cvtColor(image, yuv, CV_BGR2YUV);
+
+    // Pack pixel pairs, averaging their chroma.
+    int y;
+    for (y = 0; y < h; y++) {
+        const uint8_t *in = yuv.ptr(y);
+        uint8_t *out = &cx->data[2 * w * y];
+
+        int x;
+        for (x = 0; x < w; x += 2) {
+            const uint8_t *p = in + 3 * x;
+
+            out[2 * x + 0] = p[0];
+            out[2 * x + 1] = (p[1] + p[4] + 1) / 2;
+            out[2 * x + 2] = p[3];
+            out[2 * x + 3] = (p[2] + p[5] + 1) / 2;
+        }
+    }
+
+    return (0);
+}
+
+/**
+ * @brief Return the next image of the sequence once it is due. Ends the
+ *        stream after the last image.
+ */
+static int
+ch_images_next(struct ch_device *device, struct ch_frmbuf **buf)
+{
+    struct ch_images_cx *cx = (struct ch_images_cx *) device->backend_cx;
+
+    if (cx->next >= cx->files.size()) {
+        device->stream = false;
+        return (0);
+    }
+
+    const string &filename = cx->files[cx->next++];
+
+    int r;
+    if (device->in_pixfmt == V4L2_PIX_FMT_MJPEG)
+        r = ch_images_read_jpeg(cx, filename);
+    else
+        r = ch_images_read_yuyv(device, cx, filename);
+
+    if (r == -1)
+        return (-1);
+
+    ch_backend_pace(device, &cx->due);
+
+    cx->frame.start = &cx->data[0];
+    cx->frame.length = cx->frame.bytesused = cx->data.size();
+    ch_backend_timestamp(&cx->frame);
+
+    *buf = &cx->frame;
+    return (1);
+}
+
+const struct ch_backend ch_images_backend = {
+    CH_IMAGES_PREFIX,
+    ch_images_open,
+    ch_images_close,
+    ch_images_set_fmt,
+    ch_images_start,
+    NULL,
+    ch_images_next,
+    NULL
+};
@@ -0,0 +1,398 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <chiasm.h>
+
+#define CH_JOURNAL_MAGIC   0x4c4a4843 // "CHJL"
+#define CH_JOURNAL_VERSION 2
+#define CH_JOURNAL_ALIGN   64         // Alignment of records in the ring.
+#define CH_JOURNAL_DATA    4096       // Offset of the ring in the file.
+#define CH_JOURNAL_PAD     0x1        // Record only pads to the end of the ring.
+
+#ifndef AV_INPUT_BUFFER_PADDING_SIZE
+#define AV_INPUT_BUFFER_PADDING_SIZE FF_INPUT_BUFFER_PADDING_SIZE
+#endif
+
+// Zeroed bytes after frame data, so compressed frames can be decoded in place.
+#define CH_JOURNAL_TRAIL   AV_INPUT_BUFFER_PADDING_SIZE
+
+/**
+ * @brief On-disk header of a journal. Positions are logical and only grow;
+ *        records are found at their position modulo the capacity.
+ */
+struct ch_journal_header {
+    uint32_t       magic;     /**< Always CH_JOURNAL_MAGIC. */
+    uint32_t       version;   /**< Always CH_JOURNAL_VERSION. */
+    uint32_t       pixfmt;    /**< V4L2 pixel format of the frames. */
+    struct ch_rect framesize; /**< Size of the frames. */
+    uint32_t       reserved;
+    uint64_t       capacity;  /**< Length of the ring in bytes. */
+    uint64_t       head;      /**< Position of the oldest record. */
+    uint64_t       tail;      /**< Position after the newest record. */
+    uint64_t       frames;    /**< Number of frames ever appended. */
+};
+
+/**
+ * @brief Header of a record in the ring. Frame data follows it, then at least
+ *        CH_JOURNAL_TRAIL zeroed bytes.
+ */
+struct ch_journal_record {
+    uint32_t flags;   /**< CH_JOURNAL_PAD or 0. */
+    uint32_t length;  /**< Length of the frame data. */
+    uint64_t size;    /**< Size of the record including padding. */
+    uint64_t seq;     /**< Frame number in the journal. */
+    int64_t  tv_sec;  /**< Capture time of the frame, seconds. */
+    int64_t  tv_usec; /**< Capture time of the frame, microseconds. */
+};
+
+/**
+ * @brief Get the header of a mapped journal.
+ */
+static inline struct ch_journal_header *
+ch_journal_header(struct ch_journal *journal)
+{
+    return ((struct ch_journal_header *) journal->map);
+}
+
+/**
+ * @brief Get the record at a position in the ring.
+ */
+static inline struct ch_journal_record *
+ch_journal_record(struct ch_journal *journal, uint64_t pos)
+{
+    struct ch_journal_header *header = ch_journal_header(journal);
+    return ((struct ch_journal_record *)
+            (journal->map + CH_JOURNAL_DATA + pos % header->capacity));
+}
+
+int
+ch_create_journal(struct ch_journal *journal, const char *filename,
+                  uint64_t capacity, struct ch_device *device)
+{
+    journal->map = NULL;
+    journal->cursor = journal->end = 0;
+
+    capacity -= capacity % CH_JOURNAL_ALIGN;
+    if (capacity < CH_JOURNAL_ALIGN) {
+        ch_error("Journal capacity is too small.");
+        return (-1);
+    }
+
+    journal->length = CH_JOURNAL_DATA + capacity;
+
+    if ((journal->fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1) {
+        ch_error_no("Failed to create journal.", errno);
+        return (-1);
+    }
+
+    // Reserve the whole file now, so writes never fault on a full disk.
+    int r;
+    if ((r = posix_fallocate(journal->fd, 0, journal->length)) != 0) {
+        ch_error_no("Failed to preallocate journal.", r);
+        goto clean;
+    }
+
+    journal->map = (uint8_t *) mmap(NULL, journal->length,
+                                    PROT_READ | PROT_WRITE, MAP_SHARED,
+                                    journal->fd, 0);
+
+    if (journal->map == MAP_FAILED) {
+        ch_error_no("Failed to map journal.", errno);
+        journal->map = NULL;
+        goto clean;
+    }
+
+    struct ch_journal_header *header = ch_journal_header(journal);
+    memset(header, 0, sizeof(*header));
+
+    header->version = CH_JOURNAL_VERSION;
+    header->pixfmt = device->in_pixfmt;
+    header->framesize = device->framesize;
+    header->capacity = capacity;
+
+    // Written last, so a partially created journal is never read.
+    __atomic_store_n(&header->magic, CH_JOURNAL_MAGIC, __ATOMIC_RELEASE);
+
+    return (0);
+
+clean:
+    ch_close_journal(journal);
+    return (-1);
+}
+
+int
+ch_open_journal(struct ch_journal *journal, const char *filename,
+                struct ch_device *device)
+{
+    journal->map = NULL;
+
+    if ((journal->fd = open(filename, O_RDONLY)) == -1) {
+        ch_error_no("Failed to open journal.", errno);
+        return (-1);
+    }
+
+    struct stat st;
+    if (fstat(journal->fd, &st) == -1) {
+        ch_error_no("Failed to stat journal.", errno);
+        goto clean;
+    }
+
+    if ((size_t) st.st_size < CH_JOURNAL_DATA) {
+        ch_error("Journal is truncated.");
+        goto clean;
+    }
+
+    journal->length = st.st_size;
+    journal->map = (uint8_t *) mmap(NULL, journal->length, PROT_READ,
+                                    MAP_SHARED, journal->fd, 0);
+
+    if (journal->map == MAP_FAILED) {
+        ch_error_no("Failed to map journal.", errno);
+        journal->map = NULL;
+        goto clean;
+    }
+
+    struct ch_journal_header *header = ch_journal_header(journal);
+
+    if (header->magic != CH_JOURNAL_MAGIC
+        || header->version != CH_JOURNAL_VERSION) {
+        ch_error("File is not a journal of this version.");
+        goto clean;
+    }
+
+    if (header->capacity == 0 || header->capacity % CH_JOURNAL_ALIGN != 0
+        || CH_JOURNAL_DATA + header->capacity > journal->length) {
+        ch_error("Journal is truncated.");
+        goto clean;
+    }
+
+    madvise(journal->map, journal->length, MADV_SEQUENTIAL);
+
+    journal->cursor = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+    journal->end = __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE);
+
+    device->in_pixfmt = header->pixfmt;
+    device->framesize = header->framesize;
+
+    return (0);
+
+clean:
+    ch_close_journal(journal);
+    return (-1);
+}
+
+void
+ch_close_journal(struct ch_journal *journal)
+{
+    if (journal->map)
+        munmap(journal->map, journal->length);
+
+    if (journal->fd != -1)
+        close(journal->fd);
+
+    journal->map = NULL;
+    journal->fd = -1;
+}
+
+/**
+ * @brief Drop the oldest records until there is room for more.
+ *
+ * @param journal Journal to make room in.
+ * @param size Bytes needed after the tail.
+ * @return None.
+ */
+static void
+ch_journal_reserve(struct ch_journal *journal, uint64_t size)
+{
+    struct ch_journal_header *header = ch_journal_header(journal);
+
+    uint64_t head = header->head;
+    while (header->tail + size - head > header->capacity)
+        head += ch_journal_record(journal, head)->size;
+
+    // Readers must see the new head before its records are overwritten.
+    __atomic_store_n(&header->head, head, __ATOMIC_RELEASE);
+}
+
+int
+ch_append_journal(struct ch_journal *journal, const struct ch_frmbuf *frame)
+{
+    struct ch_journal_header *header = ch_journal_header(journal);
+
+    uint64_t size = sizeof(struct ch_journal_record) + frame->bytesused
+        + CH_JOURNAL_TRAIL;
+    size += CH_JOURNAL_ALIGN - 1;
+    size -= size % CH_JOURNAL_ALIGN;
+
+    if (size > header->capacity) {
+        ch_error("Frame is too large for journal.");
+        return (-1);
+    }
+
+    // Records are contiguous. Pad out the end of the ring if it won't fit.
+    uint64_t left = header->capacity - header->tail % header->capacity;
+    if (left < size) {
+        ch_journal_reserve(journal, left);
+
+        struct ch_journal_record *pad = ch_journal_record(journal, header->tail);
+        pad->flags = CH_JOURNAL_PAD;
+        pad->length = 0;
+        pad->size = left;
+
+        __atomic_store_n(&header->tail, header->tail + left, __ATOMIC_RELEASE);
+    }
+
+    ch_journal_reserve(journal, size);
+
+    struct ch_journal_record *record = ch_journal_record(journal, header->tail);
+    record->flags = 0;
+    record->length = frame->bytesused;
+    record->size = size;
+    record->seq = header->frames;
+    record->tv_sec = frame->timestamp.tv_sec;
+    record->tv_usec = frame->timestamp.tv_usec;
+
+    memcpy(record + 1, frame->start, frame->bytesused);
+    memset((uint8_t *) (record + 1) + frame->bytesused, 0, CH_JOURNAL_TRAIL);
+
+    // Publish the record once complete.
+    __atomic_store_n(&header->tail, header->tail + size, __ATOMIC_RELEASE);
+    header->frames++;
+
+    return (0);
+}
+
+int
+ch_read_journal(struct ch_journal *journal, struct ch_frmbuf *frame)
+{
+    struct ch_journal_header *header = ch_journal_header(journal);
+
+    while (journal->cursor < journal->end) {
+        struct ch_journal_record *record =
+            ch_journal_record(journal, journal->cursor);
+
+        uint64_t left = header->capacity - journal->cursor % header->capacity;
+        if (record->size == 0 || record->size % CH_JOURNAL_ALIGN != 0
+            || record->size > left
+            || sizeof(*record) + record->length > record->size) {
+            ch_error("Corrupt record in journal.");
+            return (-1);
+        }
+
+        journal->cursor += record->size;
+
+        if (record->flags & CH_JOURNAL_PAD)
+            continue;
+
+        // Decoders read past the end of compressed frames.
+        if (sizeof(*record) + record->length + CH_JOURNAL_TRAIL > record->size) {
+            ch_error("Corrupt record in journal.");
+            return (-1);
+        }
+
+        frame->start = (uint8_t *) (record + 1);
+        frame->length = record->length;
+        frame->bytesused = record->length;
+        frame->timestamp.tv_sec = record->tv_sec;
+        frame->timestamp.tv_usec = record->tv_usec;
+
+        return (1);
+    }
+
+    return (0);
+}
+
+/**
+ * @brief State of a journal being replayed.
+ */
+struct ch_journal_replay {
+    struct ch_journal *journal;  /**< Journal to read frames from. */
+    bool              realtime;  /**< Pace frames by their timestamps? */
+    double            first;     /**< Recorded time of the first frame. */
+    struct timespec   start;     /**< Wall time of the first frame. */
+    struct ch_frmbuf  frame;     /**< Frame returned to the stream. */
+};
+
+/**
+ * @brief Return the next frame of a journal once it is due. Ends the stream
+ *        after the last frame.
+ */
+static int
+ch_journal_next(struct ch_device *device, struct ch_frmbuf **buf)
+{
+    struct ch_journal_replay *replay =
+        (struct ch_journal_replay *) device->backend_cx;
+
+    int r;
+    if ((r = ch_read_journal(replay->journal, &replay->frame)) <= 0) {
+        device->stream = false;
+        return (r);
+    }
+
+    // Sleep until the frame is due relative to the first.
+    if (replay->realtime) {
+        double t = ch_timeval_to_sec(replay->frame.timestamp);
+
+        if (replay->first < 0) {
+            replay->first = t;
+            clock_gettime(CLOCK_MONOTONIC, &replay->start);
+        }
+
+        struct timespec due = ch_sec_to_timespec(
+            ch_timespec_to_sec(replay->start) + (t - replay->first));
+
+        bool timed = ch_stage_timed(device->stats);
+        uint64_t t0 = (timed) ? ch_stats_now() : 0;
+
+        while (device->stream
+               && clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+                                  &due, NULL) == EINTR);
+
+        if (timed)
+            ch_stage_record(device->stats, CH_STAGE_WAIT, device->frames,
+                            t0, ch_stats_now());
+    }
+
+    *buf = &replay->frame;
+    return (1);
+}
+
+const struct ch_backend ch_journal_backend = {
+    "",
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    ch_journal_next,
+    NULL
+};
+
+int
+ch_replay_journal(struct ch_device *device, struct ch_journal *journal,
+                  bool realtime, struct ch_dl **plugins, uint32_t n_plugins)
+{
+    struct ch_journal_replay replay;
+    replay.journal = journal;
+    replay.realtime = realtime;
+    replay.first = -1;
+
+    device->backend = &ch_journal_backend;
+    device->backend_cx = &replay;
+
+    int r = ch_stream(device, plugins, n_plugins);
+
+    device->backend = NULL;
+    device->backend_cx = NULL;
+
+    return ((r == -1) ? -1 : 0);
+}
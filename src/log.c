@@ -0,0 +1,322 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <chiasm.h>
+
+#define CH_LOG_COUNT(r) ((r) & 0xffffffffull) // Repeats in ring->repeats.
+#define CH_LOG_INDEX(r) ((uint32_t) ((r) >> 32)) // Message in ring->repeats.
+
+/**
+ * @brief A buffered message.
+ */
+struct ch_log_entry {
+    char     text[CH_LOG_TEXT]; /**< Message, cut to fit. */
+    int32_t  err;               /**< Error number, if any. */
+    bool     has_err;           /**< Does the message have an error number? */
+    uint64_t repeats;           /**< If nonzero, only counts repeats of the
+                                   previous message. */
+};
+
+/**
+ * @brief Ring of messages from one thread. The thread only writes head and
+ *        the writer thread only writes tail.
+ */
+struct ch_log_ring {
+    struct ch_log_ring  *next;    /**< Ring of another thread. */
+    uint32_t             head;    /**< Next entry to fill. */
+    uint32_t             tail;    /**< Next entry to write out. */
+    uint64_t             repeats; /**< Index of the last message buffered in
+                                     the upper half, and its repeats not yet
+                                     buffered in the lower half. */
+    uint64_t             dropped; /**< Messages that did not fit. */
+    struct ch_log_entry  last;    /**< Last message buffered. Owned by the
+                                     posting thread. */
+    struct ch_log_entry  written; /**< Last message written. Owned by the
+                                     writer thread. */
+    struct ch_log_entry  entries[CH_LOG_ENTRIES];
+};
+
+static struct ch_log_ring *ch_log_rings = NULL;
+static bool ch_log_running = false;
+static uint64_t ch_log_gen = 0;
+static pthread_t ch_log_thread;
+
+static __thread struct ch_log_ring *ch_log_local = NULL;
+static __thread uint64_t ch_log_local_gen = 0;
+
+// Rate limiting state of the writer thread.
+static double ch_log_tokens = CH_LOG_BURST;
+static double ch_log_refilled = 0.0;
+static uint64_t ch_log_suppressed = 0;
+
+/**
+ * @brief Get the ring of the calling thread, creating it on first use.
+ *
+ * @return The ring, or NULL if it could not be allocated.
+ */
+static struct ch_log_ring *
+ch_log_ring(void)
+{
+    if (ch_log_local && ch_log_local_gen == ch_log_gen)
+        return (ch_log_local);
+
+    // Not ch_calloc, which logs on failure.
+    struct ch_log_ring *ring = (struct ch_log_ring *)
+        calloc(1, sizeof(struct ch_log_ring));
+
+    if (ring == NULL)
+        return (NULL);
+
+    ring->next = __atomic_load_n(&ch_log_rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&ch_log_rings, &ring->next, ring, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    ch_log_local = ring;
+    ch_log_local_gen = ch_log_gen;
+
+    return (ring);
+}
+
+/**
+ * @brief Buffer an entry in a ring.
+ *
+ * @return 0 on success, -1 if the ring is full.
+ */
+static int
+ch_log_push(struct ch_log_ring *ring, const struct ch_log_entry *entry)
+{
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    if (ring->head - tail >= CH_LOG_ENTRIES) {
+        // The drainer takes the count by exchange, so add atomically.
+        __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return (-1);
+    }
+
+    ring->entries[ring->head % CH_LOG_ENTRIES] = *entry;
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+
+    return (0);
+}
+
+int
+ch_log_post(const char *buf, bool has_err, int err)
+{
+    if (!__atomic_load_n(&ch_log_running, __ATOMIC_ACQUIRE))
+        return (-1);
+
+    struct ch_log_ring *ring = ch_log_ring();
+    if (ring == NULL)
+        return (-1);
+
+    // Count repeats of the last message instead of buffering them.
+    if (ring->last.text[0] != '\0' && ring->last.has_err == has_err
+        && ring->last.err == err
+        && strncmp(ring->last.text, buf, CH_LOG_TEXT - 1) == 0) {
+        __atomic_add_fetch(&ring->repeats, 1, __ATOMIC_RELAXED);
+        return (0);
+    }
+
+    // Repeats not yet written out belong before the new message.
+    uint64_t repeats = __atomic_exchange_n(&ring->repeats, 0, __ATOMIC_RELAXED);
+    if (CH_LOG_COUNT(repeats) > 0) {
+        struct ch_log_entry notice;
+        notice.text[0] = '\0';
+        notice.has_err = false;
+        notice.err = 0;
+        notice.repeats = CH_LOG_COUNT(repeats);
+
+        ch_log_push(ring, &notice);
+    }
+
+    snprintf(ring->last.text, CH_LOG_TEXT, "%s", buf);
+    ring->last.has_err = has_err;
+    ring->last.err = err;
+    ring->last.repeats = 0;
+
+    uint32_t index = ring->head;
+
+    // Repeats of a dropped message are dropped too, rather than counted.
+    if (ch_log_push(ring, &ring->last) == -1) {
+        ring->last.text[0] = '\0';
+        return (0);
+    }
+
+    __atomic_store_n(&ring->repeats, (uint64_t) index << 32, __ATOMIC_RELAXED);
+
+    return (0);
+}
+
+/**
+ * @brief Write a message if the rate limit allows, otherwise count it.
+ */
+static void
+ch_log_limit(const char *buf, bool has_err, int err)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    double now = ch_timespec_to_sec(ts);
+
+    ch_log_tokens += (now - ch_log_refilled) * CH_LOG_RATE;
+    if (ch_log_tokens > CH_LOG_BURST)
+        ch_log_tokens = CH_LOG_BURST;
+
+    ch_log_refilled = now;
+
+    if (ch_log_tokens < 1.0) {
+        ch_log_suppressed++;
+        return;
+    }
+
+    // Report what was suppressed before writing again.
+    if (ch_log_suppressed > 0 && ch_log_tokens >= 2.0) {
+        char notice[64];
+        snprintf(notice, sizeof(notice), "%llu messages suppressed.",
+                 (unsigned long long) ch_log_suppressed);
+
+        ch_log_write(notice, false, 0);
+        ch_log_suppressed = 0;
+        ch_log_tokens -= 1.0;
+    }
+
+    ch_log_write(buf, has_err, err);
+    ch_log_tokens -= 1.0;
+}
+
+/**
+ * @brief Write a count of repeats of the last message written from a ring.
+ */
+static void
+ch_log_repeats(struct ch_log_ring *ring, uint64_t repeats)
+{
+    char notice[CH_LOG_TEXT + 64];
+    snprintf(notice, sizeof(notice), "Repeated %llu times: %s",
+             (unsigned long long) repeats, ring->written.text);
+
+    ch_log_limit(notice, ring->written.has_err, ring->written.err);
+}
+
+/**
+ * @brief Write out everything buffered in every ring.
+ */
+static void
+ch_log_drain(void)
+{
+    struct ch_log_ring *ring;
+    for (ring = __atomic_load_n(&ch_log_rings, __ATOMIC_ACQUIRE); ring != NULL;
+         ring = ring->next) {
+        uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+        while (ring->tail != head) {
+            struct ch_log_entry *entry =
+                &ring->entries[ring->tail % CH_LOG_ENTRIES];
+
+            if (entry->repeats > 0) {
+                ch_log_repeats(ring, entry->repeats);
+            } else {
+                ch_log_limit(entry->text, entry->has_err, entry->err);
+                ring->written = *entry;
+            }
+
+            __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+        }
+
+        // Repeats at the end of a storm are only counted, so flush them once
+        // the message they repeat is written.
+        uint64_t repeats = __atomic_load_n(&ring->repeats, __ATOMIC_RELAXED);
+        if (CH_LOG_COUNT(repeats) > 0
+            && (int32_t) (ring->tail - CH_LOG_INDEX(repeats)) > 0
+            && __atomic_compare_exchange_n(&ring->repeats, &repeats,
+                                           repeats & ~0xffffffffull, false,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            ch_log_repeats(ring, CH_LOG_COUNT(repeats));
+
+        uint64_t dropped = __atomic_exchange_n(&ring->dropped, 0,
+                                               __ATOMIC_RELAXED);
+        if (dropped > 0) {
+            char notice[64];
+            snprintf(notice, sizeof(notice), "%llu messages dropped.",
+                     (unsigned long long) dropped);
+
+            ch_log_limit(notice, false, 0);
+        }
+    }
+}
+
+/**
+ * @brief Writer thread. Drains the rings periodically.
+ */
+static void *
+ch_log_loop(void *arg)
+{
+    arg = (void *) arg;
+
+    struct timespec interval = ch_sec_to_timespec(CH_LOG_INTERVAL);
+
+    while (__atomic_load_n(&ch_log_running, __ATOMIC_ACQUIRE)) {
+        nanosleep(&interval, NULL);
+        ch_log_drain();
+    }
+
+    // Messages posted before stopping are still written.
+    ch_log_drain();
+
+    return (NULL);
+}
+
+int
+ch_start_logger(void)
+{
+    if (ch_log_running)
+        return (0);
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    ch_log_tokens = CH_LOG_BURST;
+    ch_log_refilled = ch_timespec_to_sec(ts);
+    ch_log_suppressed = 0;
+
+    __atomic_store_n(&ch_log_running, true, __ATOMIC_RELEASE);
+
+    if (ch_start_thread(&ch_log_thread, NULL, ch_log_loop, NULL) == -1) {
+        __atomic_store_n(&ch_log_running, false, __ATOMIC_RELEASE);
+        return (-1);
+    }
+
+    return (0);
+}
+
+void
+ch_stop_logger(void)
+{
+    if (!ch_log_running)
+        return;
+
+    __atomic_store_n(&ch_log_running, false, __ATOMIC_RELEASE);
+    ch_join_thread(ch_log_thread, NULL);
+
+    // Suppressed messages are still reported.
+    if (ch_log_suppressed > 0) {
+        char notice[64];
+        snprintf(notice, sizeof(notice), "%llu messages suppressed.",
+                 (unsigned long long) ch_log_suppressed);
+
+        ch_log_write(notice, false, 0);
+        ch_log_suppressed = 0;
+    }
+
+    struct ch_log_ring *ring = __atomic_exchange_n(&ch_log_rings, NULL,
+                                                   __ATOMIC_ACQUIRE);
+    while (ring) {
+        struct ch_log_ring *next = ring->next;
+        free(ring);
+        ring = next;
+    }
+
+    // Threads still holding a freed ring allocate a new one.
+    ch_log_gen++;
+}
@@ -0,0 +1,207 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <chiasm.h>
+
+/**
+ * @brief Get the length of a segment with a number of sources.
+ */
+static inline size_t
+ch_monitor_length(size_t n_sources)
+{
+    return (sizeof(struct ch_mon_block)
+            + n_sources * sizeof(struct ch_mon_source));
+}
+
+/**
+ * @brief Get the path of a segment for shm_open.
+ */
+static void
+ch_monitor_path(const struct ch_monitor *mon, char *path, size_t length)
+{
+    snprintf(path, length, "/%s", mon->name);
+}
+
+/**
+ * @brief Name a published source, using the filename of a path.
+ */
+static void
+ch_monitor_name(struct ch_mon_source *source, const char *name)
+{
+    const char *base = strrchr(name, '/');
+    snprintf(source->name, sizeof(source->name), "%s",
+             (base && base[1] != '\0') ? base + 1 : name);
+}
+
+int
+ch_open_monitor(struct ch_monitor *mon, const char *name,
+                struct ch_device *device, struct ch_dl **plugins,
+                size_t n_plugins)
+{
+    mon->fd = -1;
+    mon->block = NULL;
+    mon->owner = true;
+    mon->length = ch_monitor_length(n_plugins + 1);
+
+    if (name)
+        snprintf(mon->name, sizeof(mon->name), "%s", name);
+    else
+        snprintf(mon->name, sizeof(mon->name), CH_MON_PREFIX "%d",
+                 (int) getpid());
+
+    char path[sizeof(mon->name) + 1];
+    ch_monitor_path(mon, path, sizeof(path));
+
+    if ((mon->fd = shm_open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1) {
+        ch_error_no("Failed to create monitoring segment.", errno);
+        return (-1);
+    }
+
+    if (ftruncate(mon->fd, mon->length) == -1) {
+        ch_error_no("Failed to size monitoring segment.", errno);
+        goto clean;
+    }
+
+    mon->block = (struct ch_mon_block *) mmap(NULL, mon->length,
+                                              PROT_READ | PROT_WRITE,
+                                              MAP_SHARED, mon->fd, 0);
+
+    if (mon->block == MAP_FAILED) {
+        ch_error_no("Failed to map monitoring segment.", errno);
+        mon->block = NULL;
+        goto clean;
+    }
+
+    // The new object is zero filled, so only the header needs setting.
+    struct ch_mon_block *block = mon->block;
+    block->version = CH_MON_VERSION;
+    block->pid = getpid();
+    block->n_sources = n_plugins + 1;
+    block->started = ch_stats_now();
+    block->pixfmt = device->in_pixfmt;
+    block->framesize = device->framesize;
+
+    ch_monitor_name(&block->sources[0], device->name);
+    device->stats = block->sources[0].stages;
+    device->mon = &block->sources[0].counters;
+
+    size_t idx;
+    for (idx = 0; idx < n_plugins; idx++) {
+        struct ch_mon_source *source = &block->sources[idx + 1];
+
+        ch_monitor_name(source, (plugins[idx]->name) ? plugins[idx]->name
+                                                      : "plugin");
+        plugins[idx]->cx.stats = source->stages;
+        plugins[idx]->cx.mon = &source->counters;
+    }
+
+    // Readers only trust the segment once the magic is written.
+    __atomic_store_n(&block->magic, CH_MON_MAGIC, __ATOMIC_RELEASE);
+
+    return (0);
+
+clean:
+    close(mon->fd);
+    mon->fd = -1;
+    shm_unlink(path);
+
+    return (-1);
+}
+
+void
+ch_close_monitor(struct ch_monitor *mon, struct ch_device *device,
+                 struct ch_dl **plugins, size_t n_plugins)
+{
+    if (mon->block == NULL)
+        return;
+
+    device->stats = NULL;
+    device->mon = NULL;
+
+    size_t idx;
+    for (idx = 0; idx < n_plugins; idx++) {
+        plugins[idx]->cx.stats = NULL;
+        plugins[idx]->cx.mon = NULL;
+    }
+
+    char path[sizeof(mon->name) + 1];
+    ch_monitor_path(mon, path, sizeof(path));
+
+    if (mon->owner)
+        shm_unlink(path);
+
+    ch_detach_monitor(mon);
+}
+
+int
+ch_attach_monitor(struct ch_monitor *mon, const char *name)
+{
+    mon->block = NULL;
+    mon->owner = false;
+    snprintf(mon->name, sizeof(mon->name), "%s", name);
+
+    char path[sizeof(mon->name) + 1];
+    ch_monitor_path(mon, path, sizeof(path));
+
+    if ((mon->fd = shm_open(path, O_RDONLY, 0)) == -1) {
+        ch_error_no("Failed to open monitoring segment.", errno);
+        return (-1);
+    }
+
+    struct stat st;
+    if (fstat(mon->fd, &st) == -1) {
+        ch_error_no("Failed to stat monitoring segment.", errno);
+        goto clean;
+    }
+
+    if ((size_t) st.st_size < sizeof(struct ch_mon_block)) {
+        ch_error("Monitoring segment is not initialized.");
+        goto clean;
+    }
+
+    mon->length = st.st_size;
+    mon->block = (struct ch_mon_block *) mmap(NULL, mon->length, PROT_READ,
+                                              MAP_SHARED, mon->fd, 0);
+
+    if (mon->block == MAP_FAILED) {
+        ch_error_no("Failed to map monitoring segment.", errno);
+        mon->block = NULL;
+        goto clean;
+    }
+
+    struct ch_mon_block *block = mon->block;
+
+    if (__atomic_load_n(&block->magic, __ATOMIC_ACQUIRE) != CH_MON_MAGIC
+        || block->version != CH_MON_VERSION
+        || ch_monitor_length(block->n_sources) > mon->length) {
+        ch_error("Monitoring segment is not of this version.");
+        goto clean;
+    }
+
+    return (0);
+
+clean:
+    ch_detach_monitor(mon);
+    return (-1);
+}
+
+void
+ch_detach_monitor(struct ch_monitor *mon)
+{
+    if (mon->block)
+        munmap(mon->block, mon->length);
+
+    if (mon->fd != -1)
+        close(mon->fd);
+
+    mon->block = NULL;
+    mon->fd = -1;
+}
@@ -1,8 +1,18 @@
 #include <stdlib.h>
+#include <string.h>
 #include <dlfcn.h>
 
 #include <chiasm.h>
 
+#define CH_CONVERT_BATCH 8   // Plugins converted in parallel at a time.
+
+#define CH_SHED_RISK     0.8 // Fraction of the deadline at which a plugin
+                             // is at risk, and less urgent ones are shed.
+#define CH_SHED_CLEAR    0.5 // Fraction of the deadline below which a
+                             // plugin is no longer at risk.
+#define CH_SHED_KEEP     8   // Shed plugins still get one in this many
+                             // frames.
+
 
 struct ch_dl *
 ch_dl_load(const char *name)
@@ -11,6 +21,7 @@ ch_dl_load(const char *name)
     if (plugin == NULL)
 	return (NULL);
 
+    plugin->name = (char *) name;
     plugin->so = dlopen(name, RTLD_NOW);
 
     if (plugin->so == NULL) {
@@ -39,20 +50,51 @@ ch_dl_load(const char *name)
         plugin->cx.out_buffer[idx].start = NULL;
         plugin->cx.out_buffer[idx].length = 0;
         plugin->cx.nonce[idx] = 0;
+        plugin->cx.out_frmsize[idx] = (struct ch_rect) {0, 0};
     }
 
     plugin->cx.thread = 0;
-    pthread_mutex_init(&plugin->cx.mutex, NULL);
+
+    // The capture and plugin threads may run at different priorities.
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+    pthread_mutex_init(&plugin->cx.mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+
     pthread_cond_init(&plugin->cx.cond, NULL);
     plugin->cx.active = false;
 
     plugin->cx.select = 0;
+    plugin->cx.undist_buffer = NULL;
     plugin->cx.b_per_pix = 0;
     plugin->cx.out_pixfmt = CH_DEFAULT_OUTFMT;
     plugin->cx.out_stride = 0;
+    plugin->cx.out_size = (struct ch_rect) {0, 0};
+    plugin->cx.sws_size = (struct ch_rect) {0, 0};
     plugin->cx.sws_cx = NULL;
     plugin->cx.frame_out = NULL;
     plugin->cx.undistort = false;
+    plugin->cx.passthrough = false;
+    plugin->cx.stats = NULL;
+    plugin->cx.mon = NULL;
+    plugin->cx.rt = (struct ch_rt) {0, 0};
+    plugin->cx.options = NULL;
+
+    plugin->cx.taken = 0;
+    plugin->cx.pooled = false;
+    plugin->cx.queued = false;
+    plugin->cx.task.arg = NULL;
+    plugin->cx.group = (struct ch_task_group) {0, 0, false};
+
+    plugin->cx.priority = 0;
+    plugin->cx.deadline = 0.0;
+    plugin->cx.at_risk = false;
+    plugin->cx.shed_run = 0;
+    plugin->cx.late = 0;
+    plugin->cx.shed = 0;
+
+    plugin->cx.qos = (struct ch_qos) {1.0, 0, 0, 0, 1.0, 0, 0, 0, 0};
 
     return (plugin);
 }
@@ -69,6 +111,141 @@ struct ch_plugin_thread_args {
     struct ch_device *device;
 };
 
+/**
+ * @brief Take the newest frame for a plugin, if one arrived since the last
+ *        taken. Must be called with the plugin mutex held.
+ *
+ * @param cx Context of the plugin.
+ * @return The frame, or NULL if none is new.
+ */
+static struct ch_frmbuf *
+ch_plugin_take(struct ch_dl_cx *cx)
+{
+    uint32_t idx = (cx->select + 1) % CH_DL_NUMBUF;
+    if (cx->nonce[idx] <= cx->taken)
+        return (NULL);
+
+    // Frames overwritten since the last one taken were missed.
+    if (cx->mon) {
+        struct ch_mon_counters *mon = cx->mon;
+        __atomic_store_n(&mon->frames, mon->frames + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&mon->dropped,
+                         mon->dropped + (cx->nonce[idx] - cx->taken - 1),
+                         __ATOMIC_RELAXED);
+        __atomic_store_n(&mon->pending, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&mon->busy, 1, __ATOMIC_RELAXED);
+    }
+
+    cx->taken = cx->nonce[idx];
+    cx->select = idx;
+
+    return (&cx->out_buffer[idx]);
+}
+
+/**
+ * @brief Get the capture time of a frame.
+ *
+ * @param buf Frame to get the time of.
+ * @return Time on the ch_stats_now clock, 0 if not set.
+ */
+static inline uint64_t
+ch_frmbuf_ns(const struct ch_frmbuf *buf)
+{
+    return ((uint64_t) buf->timestamp.tv_sec * 1000000000ull
+            + (uint64_t) buf->timestamp.tv_usec * 1000ull);
+}
+
+/**
+ * @brief Track whether a plugin is keeping its deadline.
+ *
+ * @param cx Context of the plugin.
+ * @param latency Seconds from capture to the end of the last callback.
+ * @return None.
+ */
+static void
+ch_plugin_deadline(struct ch_dl_cx *cx, double latency)
+{
+    if (latency > cx->deadline) {
+        __atomic_store_n(&cx->late, cx->late + 1, __ATOMIC_RELAXED);
+
+        if (cx->mon)
+            __atomic_store_n(&cx->mon->late, cx->mon->late + 1,
+                             __ATOMIC_RELAXED);
+    }
+
+    // Hysteresis keeps shedding from toggling every frame.
+    bool at_risk = cx->at_risk;
+    if (latency > CH_SHED_RISK * cx->deadline)
+        at_risk = true;
+    else if (latency < CH_SHED_CLEAR * cx->deadline)
+        at_risk = false;
+
+    __atomic_store_n(&cx->at_risk, at_risk, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Undistort a taken frame if needed and perform the callback.
+ *
+ * @param device Device the plugin is associated with.
+ * @param plugin Plugin to call.
+ * @param buf Frame taken by ch_plugin_take.
+ * @return None.
+ */
+static void
+ch_plugin_process(struct ch_device *device, struct ch_dl *plugin,
+                  struct ch_frmbuf *buf)
+{
+    struct ch_dl_cx *cx = &plugin->cx;
+
+    bool timed = ch_stage_timed(cx->stats);
+    uint64_t t0 = (timed) ? ch_stats_now() : 0;
+
+    struct ch_cpu_sample cpu;
+    if (cx->stats)
+        ch_cpu_sample(&cpu);
+
+    if (device->calib && cx->undistort && !cx->passthrough) {
+        ch_undistort(device, cx, buf);
+        cx->out_frmsize[cx->select] = device->calib->outsize;
+
+        if (timed) {
+            uint64_t t1 = ch_stats_now();
+            ch_stage_record(cx->stats, CH_STAGE_UNDISTORT, buf->sequence,
+                            t0, t1);
+            t0 = t1;
+        }
+    }
+
+    if (plugin->callback(buf) == -1)
+        cx->active = false;
+
+    bool deadline = (cx->deadline > 0.0);
+    bool qos = (device->qos.target > 0.0);
+    uint64_t t1 = (timed || deadline || qos) ? ch_stats_now() : 0;
+    if (timed)
+        ch_stage_record(cx->stats, CH_STAGE_CALLBACK, buf->sequence, t0, t1);
+
+    if (cx->stats)
+        ch_cpu_record(cx->stats, cx->mon, &cpu);
+
+    if (cx->mon)
+        __atomic_store_n(&cx->mon->busy, 0, __ATOMIC_RELAXED);
+
+    // Latency runs from the capture timestamp, on the same clock.
+    uint64_t captured = ch_frmbuf_ns(buf);
+    if (captured == 0 || captured > t1)
+        return;
+
+    if (cx->stats)
+        ch_hist_record(&cx->stats[CH_STAGE_LATENCY], t1 - captured);
+
+    if (deadline)
+        ch_plugin_deadline(cx, (t1 - captured) / 1e9);
+
+    if (qos)
+        ch_qos_record(cx, (t1 - captured) / 1e9);
+}
+
 /**
  * @brief A plugin thread that waits for new frames to arrive and performs a
  *        callback.
@@ -86,35 +263,88 @@ ch_plugin_thread(void *arg)
 
     free(args);
 
-    uint32_t nonce = cx->nonce[cx->select];
+    ch_trace_name(plugin->name);
+    ch_rt_apply(&cx->rt);
 
     while (cx->active) {
         pthread_mutex_lock(&cx->mutex);
 
-        uint32_t idx = (cx->select + 1) % CH_DL_NUMBUF;
-        if (cx->nonce[idx] <= nonce)
+        struct ch_frmbuf *buf = ch_plugin_take(cx);
+        if (buf == NULL && cx->active) {
             pthread_cond_wait(&cx->cond, &cx->mutex);
+            buf = (cx->active) ? ch_plugin_take(cx) : NULL;
+        }
 
-        if (!cx->active)
-            break;
+        pthread_mutex_unlock(&cx->mutex);
 
-        nonce = cx->nonce[idx];
-        cx->select = idx;
+        if (buf)
+            ch_plugin_process(device, plugin, buf);
+    }
+
+    ch_cpu_release();
+
+    return (NULL);
+}
+
+/**
+ * @brief A plugin task on the worker pool. Performs callbacks until no new
+ *        frame is waiting, so at most one runs per plugin.
+ *
+ * @param arg The plugin and device stored inside a struct ch_plugin_thread_args.
+ * @return None.
+ */
+static void
+ch_plugin_task(void *arg)
+{
+    struct ch_plugin_thread_args *args = (struct ch_plugin_thread_args *) arg;
+    struct ch_dl_cx *cx = &args->plugin->cx;
+
+    while (true) {
+        pthread_mutex_lock(&cx->mutex);
+
+        struct ch_frmbuf *buf = (cx->active) ? ch_plugin_take(cx) : NULL;
+        if (buf == NULL)
+            cx->queued = false;
 
         pthread_mutex_unlock(&cx->mutex);
 
-        if (device->calib && cx->undistort)
-            ch_undistort(device, cx, &cx->out_buffer[cx->select]);
+        if (buf == NULL)
+            return;
 
-        if (plugin->callback(&cx->out_buffer[cx->select]) == -1)
-            cx->active = false;
+        ch_plugin_process(args->device, args->plugin, buf);
     }
+}
 
-    return (NULL);
+bool
+ch_plugin_option(const struct ch_dl_cx *cx, const char *name)
+{
+    size_t length = strlen(name);
+
+    const char *option = cx->options;
+    while (option != NULL && *option != '\0') {
+        const char *end = strchr(option, ',');
+        if (end == NULL)
+            end = option + strlen(option);
+
+        if ((size_t) (end - option) == length
+            && strncmp(option, name, length) == 0)
+            return (true);
+
+        option = (*end == ',') ? end + 1 : end;
+    }
+
+    return (false);
+}
+
+bool
+ch_plugin_pooled(const struct ch_dl_cx *cx)
+{
+    return (ch_pool_running() && cx->rt.cpus == 0 && cx->rt.priority == 0);
 }
 
 /**
- * @brief Create a plugin thread.
+ * @brief Create a plugin thread, or a task on the worker pool if it is
+ *        running and the plugin does not ask for its own scheduling.
  *
  * @param plugin The plugin to create the thread for.
  * @return 0 on success, -1 on failure.
@@ -124,6 +354,7 @@ ch_create_plugin_thread(struct ch_device *device, struct ch_dl *plugin)
 {
     struct ch_dl_cx *cx = &plugin->cx;
     cx->active = true;
+    cx->taken = cx->nonce[cx->select];
 
     struct ch_plugin_thread_args *args = (struct ch_plugin_thread_args *)
         ch_calloc(1, sizeof(struct ch_plugin_thread_args));
@@ -134,6 +365,16 @@ ch_create_plugin_thread(struct ch_device *device, struct ch_dl *plugin)
     args->device = device;
     args->plugin = plugin;
 
+    cx->pooled = ch_plugin_pooled(cx);
+
+    if (cx->pooled) {
+        cx->queued = false;
+        cx->group = (struct ch_task_group) {0, 0, false};
+        cx->task = (struct ch_task) {ch_plugin_task, args, &cx->group,
+                                     0, 0, NULL, NULL};
+        return (0);
+    }
+
     if (ch_start_thread(&cx->thread, NULL, ch_plugin_thread, args) == -1)
         return (-1);
 
@@ -149,10 +390,24 @@ ch_create_plugin_thread(struct ch_device *device, struct ch_dl *plugin)
 static int
 ch_join_plugin_thread(struct ch_dl *plugin)
 {
-    plugin->cx.active = false;
-    pthread_cond_signal(&plugin->cx.cond);
+    struct ch_dl_cx *cx = &plugin->cx;
+
+    if (cx->pooled) {
+        pthread_mutex_lock(&cx->mutex);
+        cx->active = false;
+        pthread_mutex_unlock(&cx->mutex);
+
+        ch_pool_wait(&cx->group);
+        free(cx->task.arg);
+        cx->task.arg = NULL;
+
+        return (0);
+    }
+
+    cx->active = false;
+    pthread_cond_signal(&cx->cond);
 
-    if (ch_join_thread(plugin->cx.thread, NULL) == -1)
+    if (ch_join_thread(cx->thread, NULL) == -1)
         return (-1);
 
     return (0);
@@ -180,10 +435,123 @@ ch_init_plugins(struct ch_device *device, struct ch_dl *plugins[], size_t n_plug
     return (0);
 }
 
+/**
+ * @brief Conversion of the current frame for one plugin.
+ */
+struct ch_convert {
+    struct ch_task       task;    /**< Task on the worker pool. */
+    struct ch_device     *device;
+    struct ch_decode_cx  *decode;
+    struct ch_dl         *plugin;
+    pthread_t            caller;  /**< Thread waiting on the conversion. */
+    int                  r;       /**< Result of the conversion. */
+};
+
+/**
+ * @brief Convert the current frame into the next output buffer of a plugin
+ *        and hand it over.
+ *
+ * @param arg The struct ch_convert to perform.
+ * @return None.
+ */
+static void
+ch_convert_task(void *arg)
+{
+    struct ch_convert *convert = (struct ch_convert *) arg;
+    struct ch_decode_cx *decode = convert->decode;
+    struct ch_dl_cx *cx = &convert->plugin->cx;
+
+    // Conversions run elsewhere are added to the CPU cost of the caller.
+    bool away = convert->device->stats
+        && !pthread_equal(pthread_self(), convert->caller);
+
+    struct ch_cpu_sample cpu;
+    if (away)
+        ch_cpu_sample(&cpu);
+
+    pthread_mutex_lock(&cx->mutex);
+
+    bool timed = ch_stage_timed(cx->stats);
+    uint64_t t0 = (timed) ? ch_stats_now() : 0;
+
+    // Should output into the next buffer (select + 1 % NUM)
+    if ((convert->r = ch_output(convert->device, decode, cx)) == -1) {
+        pthread_mutex_unlock(&cx->mutex);
+        return;
+    }
+
+    if (timed)
+        ch_stage_record(cx->stats, CH_STAGE_CONVERT,
+                        decode->in_buf->sequence, t0, ch_stats_now());
+
+    if (cx->mon)
+        __atomic_store_n(&cx->mon->pending, 1, __ATOMIC_RELAXED);
+
+    bool submit = cx->pooled && !cx->queued;
+    if (submit) {
+        cx->queued = true;
+        cx->task.priority = cx->priority;
+        cx->task.due = (cx->deadline > 0.0)
+            ? ch_frmbuf_ns(decode->in_buf) + (uint64_t) (cx->deadline * 1e9)
+            : 0;
+    }
+
+    pthread_mutex_unlock(&cx->mutex);
+
+    if (submit)
+        ch_pool_submit(&cx->task);
+    else if (!cx->pooled)
+        pthread_cond_signal(&cx->cond);
+
+    if (away) {
+        struct ch_cpu_sample end;
+        ch_cpu_sample(&end);
+        __atomic_add_fetch(&decode->cpu_ns, end.cpu_ns - cpu.cpu_ns,
+                           __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @brief Should a plugin be shed from the current frame? Plugins less
+ *        urgent than one at risk of missing its deadline are shed from all
+ *        but one in CH_SHED_KEEP frames.
+ *
+ * @param cx Context of the plugin.
+ * @param risk Priority of the most urgent plugin at risk.
+ * @param at_risk Is any plugin at risk?
+ * @return True if the frame is shed.
+ */
+static bool
+ch_plugin_shed(struct ch_dl_cx *cx, int risk, bool at_risk)
+{
+    if (!at_risk || cx->priority >= risk || ++cx->shed_run >= CH_SHED_KEEP) {
+        cx->shed_run = 0;
+        return (false);
+    }
+
+    __atomic_store_n(&cx->shed, cx->shed + 1, __ATOMIC_RELAXED);
+
+    if (cx->mon)
+        __atomic_store_n(&cx->mon->shed, cx->mon->shed + 1, __ATOMIC_RELAXED);
+
+    return (true);
+}
+
 int
 ch_update_plugins(struct ch_device *device, struct ch_decode_cx *decode,
                 struct ch_dl *plugins[], size_t n_plugins)
 {
+    struct ch_convert converts[CH_CONVERT_BATCH];
+    // Capture waits on the conversions, so they go ahead of callbacks.
+    struct ch_task_group group = {0, 0, true};
+
+    decode->cpu_ns = 0;
+
+    ch_qos_update(device, plugins, n_plugins);
+
+    int risk = 0;
+    bool at_risk = false;
+
     size_t idx;
     for (idx = 0; idx < n_plugins; idx++) {
         struct ch_dl_cx *cx = &plugins[idx]->cx;
@@ -191,14 +559,68 @@ ch_update_plugins(struct ch_device *device, struct ch_decode_cx *decode,
         if (!cx->active)
             return (-1);
 
-        pthread_mutex_lock(&cx->mutex);
+        if (__atomic_load_n(&cx->at_risk, __ATOMIC_RELAXED)
+            && (!at_risk || cx->priority > risk)) {
+            risk = cx->priority;
+            at_risk = true;
+        }
+    }
 
-        // Should output into the next buffer (select + 1 % NUM)
-        if (ch_output(device, decode, &plugins[idx]->cx) == -1)
-            return (-1);
+    // Plugins convert independently, so spread them over the pool.
+    size_t start;
+    for (start = 0; start < n_plugins; start += CH_CONVERT_BATCH) {
+        size_t end = start + CH_CONVERT_BATCH;
+        if (end > n_plugins)
+            end = n_plugins;
+
+        // Keep the batch ordered by urgency, the most urgent first.
+        size_t n = 0;
+        for (idx = start; idx < end; idx++) {
+            struct ch_dl_cx *cx = &plugins[idx]->cx;
+
+            if (ch_plugin_shed(cx, risk, at_risk) || ch_qos_skip(cx))
+                continue;
+
+            struct ch_convert *convert = &converts[n];
+
+            convert->device = device;
+            convert->decode = decode;
+            convert->plugin = plugins[idx];
+            convert->caller = pthread_self();
+            convert->r = 0;
+            convert->task = (struct ch_task) {ch_convert_task, NULL,
+                                              &group, cx->priority, 0,
+                                              NULL, NULL};
+
+            if (cx->deadline > 0.0)
+                convert->task.due = ch_frmbuf_ns(decode->in_buf)
+                    + (uint64_t) (cx->deadline * 1e9);
+
+            size_t jdx;
+            for (jdx = n++; jdx > 0 && ch_task_before(&converts[jdx].task,
+                                                      &converts[jdx - 1].task);
+                 jdx--) {
+                struct ch_convert tmp = converts[jdx];
+                converts[jdx] = converts[jdx - 1];
+                converts[jdx - 1] = tmp;
+            }
+        }
 
-        pthread_mutex_unlock(&cx->mutex);
-        pthread_cond_signal(&cx->cond);
+        if (n == 0)
+            continue;
+
+        // The most urgent runs here, as does a single plugin.
+        for (idx = 1; idx < n; idx++) {
+            converts[idx].task.arg = &converts[idx];
+            ch_pool_submit(&converts[idx].task);
+        }
+
+        ch_convert_task(&converts[0]);
+        ch_pool_wait(&group);
+
+        for (idx = 0; idx < n; idx++)
+            if (converts[idx].r == -1)
+                return (-1);
     }
 
     return (0);
@@ -1,5 +1,9 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
 #include <pthread.h>
 
 // Apriltag includes.
@@ -7,7 +11,7 @@
 #include <tag36h11.h>
 #include <common/zarray.h>
 #include <common/image_u8.h>
-#include <common/homography.h>
+#include <common/matd.h>
 
 #include <sns.h>
 #include <amino.h>
@@ -17,6 +21,25 @@
 #define MAX_TAG_ID 32
 #define TAG_SIZE_2 (41.0 / 2.0)
 
+#define TRACK_FULL_INTERVAL 30   // Frames inbetween full-frame searches.
+#define TRACK_PAD_SCALE     0.5  // Padding around a tag as a fraction of size.
+#define TRACK_PAD_MIN       16.0 // Minimum padding around a tag in pixels.
+
+#define BUDGET_SHARE        0.2  // Fraction of the deadline detection may take.
+#define BUDGET_EWMA         0.2  // Update rate of detection time average.
+#define BUDGET_HEADROOM     0.6  // Fraction of budget below which to refine.
+#define BUDGET_SETTLE       10   // Frames to wait after changing settings.
+#define BUDGET_STEP         1.25 // Multiplicative step of decimation.
+
+#define PIPE_SLOTS_PER_WORKER 2  // Frames that may be queued per worker.
+#define ALLOC_WARMUP        30   // Frames before counting allocations.
+
+#define PRIORITY            10   // Urgency against other plugins.
+#define QOS_LEVELS          3    // Decimation steps under a latency target.
+#define DEADLINE            0.05 // Seconds from capture to publish markers by.
+
+#define POLAR_ITERATIONS    8    // Newton iterations for rotation polar decomposition.
+
 apriltag_family_t *tag_family = NULL;
 apriltag_detector_t *tag_detector = NULL;
 
@@ -24,25 +47,879 @@ const char *marker_chan_name = "markers";
 ach_channel_t marker_chan;
 ach_channel_t *sns_chans[] = { &marker_chan, NULL };
 
+struct ch_dl_cx *dl_cx;
+
 uint32_t width, height, stride;
 
 bool calib = false;
 double f[2];
 double c[2];
 
+/**
+ * @brief Tracked state of a previously detected tag.
+ */
+struct tag_track {
+    bool   valid;   /**< Was the tag found in the previous frame? */
+    double p[4][2]; /**< Corners of the tag in the previous frame. */
+    double v[2];    /**< Motion of the tag center per frame. */
+};
+
+bool track = true;                        // Use tracking-guided detection.
+struct tag_track tracks[MAX_TAG_ID + 1];  // Tracks indexed by tag ID.
+uint32_t track_frames = 0;                // Frames since last full search.
+bool track_lost = true;                   // Was a track lost last frame?
+
+double budget;                 // Detection latency budget in seconds.
+double budget_time = 0.0;      // Average detection time in seconds.
+uint32_t budget_frames = 0;    // Frames since settings last changed.
+uint32_t budget_changes = 0;   // Times the settings were changed.
+double decimate_min = 1.0;     // Finest decimation allowed.
+double decimate_max;           // Coarsest decimation allowed.
+int threads_max;               // Largest detector thread pool allowed.
+
+uint32_t alloc_frames = 0;     // Frames seen while allocations are counted.
+uint64_t alloc_start;          // Allocations counted when warm-up ended.
+
+/**
+ * @brief State of a frame slot in the detection pipeline.
+ */
+enum pipe_state {
+    PIPE_FREE,   /**< Slot can accept a new frame. */
+    PIPE_QUEUED, /**< Frame is waiting for a worker. */
+    PIPE_BUSY,   /**< Frame is being detected. */
+    PIPE_DONE    /**< Detections are waiting to be published in order. */
+};
+
+/**
+ * @brief A frame in flight in the detection pipeline.
+ */
+struct pipe_slot {
+    enum pipe_state state;      /**< State of the slot. */
+    uint64_t        seq;        /**< Capture sequence of the frame. */
+    struct timespec time;       /**< Capture time of the frame. */
+    uint8_t         *buf;       /**< Copy of the frame. */
+    zarray_t        *detections; /**< Detections found in the frame. */
+};
+
+/**
+ * @brief A pipeline worker with its own detector, run as a task on the
+ *        library worker pool while frames are queued.
+ */
+struct pipe_worker {
+    struct ch_task      task;     /**< Task detecting queued frames. */
+    bool                idle;     /**< Is the task not submitted? */
+    apriltag_family_t   *family;  /**< Tag family owned by this detector. */
+    apriltag_detector_t *detector; /**< Single-threaded detector. */
+};
+
+uint32_t pipe_workers = 0;          // Throughput mode workers, 0 to disable.
+struct pipe_worker *pipe_pool = NULL;
+struct ch_task_group pipe_group;    // Worker tasks in flight.
+struct pipe_slot *pipe_slots = NULL;
+uint32_t pipe_n_slots = 0;
+bool pipe_stop = false;
+bool pipe_failed = false;           // Did publishing a frame fail?
+pthread_mutex_t pipe_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t pipe_free = PTHREAD_COND_INITIALIZER; // Signaled as slots free.
+
+struct sns_msg_wt_tf *marker_msg = NULL; // Reused marker message.
+zarray_t *tracked = NULL;                // Reused tracked detection array.
+
+/**
+ * @brief Recover the pose of a tag from its homography without allocating.
+ *        Follows homography_to_pose(), but orthogonalizes the rotation with a
+ *        Newton iteration for the polar decomposition instead of an SVD.
+ *
+ * @param H Homography of the detection.
+ * @param R Column-major rotation matrix to fill.
+ * @param t Translation to fill.
+ * @return None.
+ */
 static void
-pose_to_q(matd_t *p, double q[4])
+homography_pose(const matd_t *H, double R[9], double t[3])
 {
-    double R[9];
+    double r20 = MATD_EL(H, 2, 0);
+    double r21 = MATD_EL(H, 2, 1);
+    double tz  = MATD_EL(H, 2, 2);
+    double r00 = (MATD_EL(H, 0, 0) - c[0] * r20) / f[0];
+    double r01 = (MATD_EL(H, 0, 1) - c[0] * r21) / f[0];
+    double tx  = (MATD_EL(H, 0, 2) - c[0] * tz) / f[0];
+    double r10 = (MATD_EL(H, 1, 0) - c[1] * r20) / f[1];
+    double r11 = (MATD_EL(H, 1, 1) - c[1] * r21) / f[1];
+    double ty  = (MATD_EL(H, 1, 2) - c[1] * tz) / f[1];
+
+    // Scale so rotation columns are unit length, with the tag in front.
+    double l1 = sqrt(r00 * r00 + r10 * r10 + r20 * r20);
+    double l2 = sqrt(r01 * r01 + r11 * r11 + r21 * r21);
+    double s = 1.0 / sqrt(l1 * l2);
+
+    if (tz > 0)
+        s *= -1;
+
+    double M[3][3] = {
+        { r00 * s, r01 * s, 0 },
+        { r10 * s, r11 * s, 0 },
+        { r20 * s, r21 * s, 0 }
+    };
+
+    // Last column is the cross product of the first two.
+    M[0][2] = M[1][0] * M[2][1] - M[2][0] * M[1][1];
+    M[1][2] = M[2][0] * M[0][1] - M[0][0] * M[2][1];
+    M[2][2] = M[0][0] * M[1][1] - M[1][0] * M[0][1];
+
+    // Polar decomposition by M <- (M + M^-T) / 2, using M^-T = cof(M) / det(M).
+    int k;
+    for (k = 0; k < POLAR_ITERATIONS; k++) {
+        double C[3][3];
+
+        size_t idx;
+        for (idx = 0; idx < 3; idx++) {
+            size_t jdx;
+            for (jdx = 0; jdx < 3; jdx++) {
+                size_t i0 = (idx + 1) % 3, i1 = (idx + 2) % 3;
+                size_t j0 = (jdx + 1) % 3, j1 = (jdx + 2) % 3;
+
+                C[idx][jdx] = M[i0][j0] * M[i1][j1] - M[i0][j1] * M[i1][j0];
+            }
+        }
+
+        double det = M[0][0] * C[0][0] + M[0][1] * C[0][1] + M[0][2] * C[0][2];
+        if (fabs(det) < 1e-12)
+            break;
+
+        for (idx = 0; idx < 3; idx++) {
+            size_t jdx;
+            for (jdx = 0; jdx < 3; jdx++)
+                M[idx][jdx] = 0.5 * (M[idx][jdx] + C[idx][jdx] / det);
+        }
+    }
 
     size_t idx;
     for (idx = 0; idx < 3; idx++) {
         size_t jdx;
         for (jdx = 0; jdx < 3; jdx++)
-            AA_MATREF(R, 3, idx, jdx) = matd_get(p, idx, jdx);
+            AA_MATREF(R, 3, idx, jdx) = M[idx][jdx];
+    }
+
+    t[0] = tx * s;
+    t[1] = ty * s;
+    t[2] = tz * s;
+}
+
+/**
+ * @brief Release detections found for a frame. The reused tracked array is
+ *        cleared, arrays from the detector are destroyed.
+ *
+ * @param detections Detections to release.
+ * @return None.
+ */
+static void
+detections_release(zarray_t *detections)
+{
+    if (detections != tracked) {
+        apriltag_detections_destroy(detections);
+        return;
+    }
+
+    int i;
+    for (i = 0; i < zarray_size(detections); i++) {
+        apriltag_detection_t *det;
+        zarray_get(detections, i, &det);
+        apriltag_detection_destroy(det);
+    }
+
+    zarray_clear(detections);
+}
+
+/**
+ * @brief Predict the region a tracked tag will occupy in the next frame.
+ *
+ * @param t The track to predict.
+ * @param roi Region to fill in, clipped to the image.
+ * @return None.
+ */
+static void
+track_predict(struct tag_track *t, struct ch_roi *roi)
+{
+    double min[2] = { t->p[0][0], t->p[0][1] };
+    double max[2] = { t->p[0][0], t->p[0][1] };
+
+    size_t idx;
+    for (idx = 1; idx < 4; idx++) {
+        size_t jdx;
+        for (jdx = 0; jdx < 2; jdx++) {
+            min[jdx] = fmin(min[jdx], t->p[idx][jdx]);
+            max[jdx] = fmax(max[jdx], t->p[idx][jdx]);
+        }
+    }
+
+    uint32_t limit[2] = { width, height };
+    uint32_t lo[2], hi[2];
+
+    for (idx = 0; idx < 2; idx++) {
+        // Pad by tag size and expected motion.
+        double pad = fmax(TRACK_PAD_SCALE * (max[idx] - min[idx]), TRACK_PAD_MIN)
+            + fabs(t->v[idx]);
+
+        double l = min[idx] + t->v[idx] - pad;
+        double h = max[idx] + t->v[idx] + pad;
+
+        lo[idx] = (l < 0) ? 0 : (uint32_t) l;
+        hi[idx] = (h >= limit[idx]) ? limit[idx] : (uint32_t) h;
+
+        if (lo[idx] > hi[idx])
+            lo[idx] = hi[idx];
+    }
+
+    roi->x = lo[0];
+    roi->y = lo[1];
+    roi->size.width = hi[0] - lo[0];
+    roi->size.height = hi[1] - lo[1];
+}
+
+/**
+ * @brief Merge a region into another if they overlap.
+ *
+ * @param a Region to grow.
+ * @param b Region to merge into a.
+ * @return true if the regions overlapped and were merged.
+ */
+static bool
+roi_merge(struct ch_roi *a, const struct ch_roi *b)
+{
+    uint32_t ax2 = a->x + a->size.width, ay2 = a->y + a->size.height;
+    uint32_t bx2 = b->x + b->size.width, by2 = b->y + b->size.height;
+
+    if (b->x > ax2 || a->x > bx2 || b->y > ay2 || a->y > by2)
+        return (false);
+
+    a->x = (a->x < b->x) ? a->x : b->x;
+    a->y = (a->y < b->y) ? a->y : b->y;
+    a->size.width = ((ax2 > bx2) ? ax2 : bx2) - a->x;
+    a->size.height = ((ay2 > by2) ? ay2 : by2) - a->y;
+
+    return (true);
+}
+
+/**
+ * @brief Run the detector on a region of an image. Detections are translated
+ *        back into full image coordinates.
+ *
+ * @param image Full image.
+ * @param roi Region of the image to search.
+ * @param detections Array to append detections to.
+ * @return None.
+ */
+static void
+detect_roi(image_u8_t *image, struct ch_roi *roi, zarray_t *detections)
+{
+    image_u8_t sub = {
+        .width = roi->size.width,
+        .height = roi->size.height,
+        .stride = image->stride,
+        .buf = image->buf + roi->y * image->stride + roi->x
+    };
+
+    zarray_t *found = apriltag_detector_detect(tag_detector, &sub);
+
+    int i;
+    for (i = 0; i < zarray_size(found); i++) {
+        apriltag_detection_t *det;
+        zarray_get(found, i, &det);
+
+        // Offset homography by the region origin, H' = T * H.
+        int jdx;
+        for (jdx = 0; jdx < 3; jdx++) {
+            MATD_EL(det->H, 0, jdx) += roi->x * MATD_EL(det->H, 2, jdx);
+            MATD_EL(det->H, 1, jdx) += roi->y * MATD_EL(det->H, 2, jdx);
+        }
+
+        det->c[0] += roi->x;
+        det->c[1] += roi->y;
+
+        for (jdx = 0; jdx < 4; jdx++) {
+            det->p[jdx][0] += roi->x;
+            det->p[jdx][1] += roi->y;
+        }
+
+        // Regions may overlap the same tag, keep the strongest detection.
+        int kdx;
+        for (kdx = 0; kdx < zarray_size(detections); kdx++) {
+            apriltag_detection_t *other;
+            zarray_get(detections, kdx, &other);
+
+            if (other->id == det->id)
+                break;
+        }
+
+        if (kdx == zarray_size(detections))
+            zarray_add(detections, &det);
+
+        else {
+            apriltag_detection_t *other;
+            zarray_get(detections, kdx, &other);
+
+            if (det->decision_margin > other->decision_margin) {
+                zarray_set(detections, kdx, &det, NULL);
+                apriltag_detection_destroy(other);
+            } else
+                apriltag_detection_destroy(det);
+        }
+    }
+
+    // Detections are now owned by the output array.
+    zarray_destroy(found);
+}
+
+/**
+ * @brief Detect tags, searching only around tracked tags when possible.
+ *
+ * @param image Image to search.
+ * @return Array of detections.
+ */
+static zarray_t *
+detect_tracked(image_u8_t *image)
+{
+    struct ch_roi rois[MAX_TAG_ID + 1];
+    size_t n_rois = 0;
+
+    // Build regions around predicted tag locations, merging overlaps.
+    size_t idx;
+    for (idx = 0; idx <= MAX_TAG_ID; idx++) {
+        if (!tracks[idx].valid)
+            continue;
+
+        struct ch_roi roi;
+        track_predict(&tracks[idx], &roi);
+
+        if (roi.size.width == 0 || roi.size.height == 0)
+            continue;
+
+        size_t jdx;
+        for (jdx = 0; jdx < n_rois; jdx++)
+            if (roi_merge(&rois[jdx], &roi))
+                break;
+
+        if (jdx == n_rois)
+            rois[n_rois++] = roi;
+    }
+
+    // Fall back to a full search periodically, when lost, or with no tracks.
+    if (track_lost || n_rois == 0 || ++track_frames >= TRACK_FULL_INTERVAL) {
+        track_frames = 0;
+        return (apriltag_detector_detect(tag_detector, image));
+    }
+
+    for (idx = 0; idx < n_rois; idx++)
+        detect_roi(image, &rois[idx], tracked);
+
+    return (tracked);
+}
+
+/**
+ * @brief Update tag tracks from a frame's detections.
+ *
+ * @param detections Detections found in the frame.
+ * @return None. Sets track_lost if a tracked tag was not found.
+ */
+static void
+track_update(zarray_t *detections)
+{
+    bool found[MAX_TAG_ID + 1] = { false };
+
+    int i;
+    for (i = 0; i < zarray_size(detections); i++) {
+        apriltag_detection_t *det;
+        zarray_get(detections, i, &det);
+
+        if (det->id > MAX_TAG_ID)
+            continue;
+
+        struct tag_track *t = &tracks[det->id];
+
+        double cx = 0, cy = 0, px = 0, py = 0;
+
+        size_t idx;
+        for (idx = 0; idx < 4; idx++) {
+            cx += det->p[idx][0] / 4;
+            cy += det->p[idx][1] / 4;
+            px += t->p[idx][0] / 4;
+            py += t->p[idx][1] / 4;
+        }
+
+        if (t->valid) {
+            t->v[0] = cx - px;
+            t->v[1] = cy - py;
+        } else {
+            t->v[0] = 0;
+            t->v[1] = 0;
+        }
+
+        memcpy(t->p, det->p, sizeof(t->p));
+        t->valid = true;
+        found[det->id] = true;
+    }
+
+    track_lost = false;
+
+    size_t idx;
+    for (idx = 0; idx <= MAX_TAG_ID; idx++)
+        if (tracks[idx].valid && !found[idx]) {
+            tracks[idx].valid = false;
+            track_lost = true;
+        }
+}
+
+/**
+ * @brief Decimation a detector starts from, a quarter of VGA-sized frames.
+ *
+ * @return Starting decimation.
+ */
+static double
+decimate_start(void)
+{
+    return (fmax(width / 320.0, decimate_min));
+}
+
+/**
+ * @brief Finest decimation allowed under the latency target. Each level the
+ *        target has stepped the plugin down by moves it a share of the way
+ *        towards the coarsest.
+ *
+ * @return Decimation floor.
+ */
+static double
+decimate_floor(void)
+{
+    uint32_t own = __atomic_load_n(&dl_cx->qos.own, __ATOMIC_RELAXED);
+
+    return (decimate_min * pow(decimate_max / decimate_min,
+                               (double) own / QOS_LEVELS));
+}
+
+/**
+ * @brief Adjust detector decimation and threads to hold detection time within
+ *        the budget. Under load, threads are added before precision is
+ *        reduced; with headroom, precision is restored before threads are
+ *        released, never finer than the latency target allows.
+ *
+ * @param dt Time taken by the last detection in seconds.
+ * @return None.
+ */
+static void
+budget_update(double dt)
+{
+    budget_time = (budget_time > 0)
+        ? (1.0 - BUDGET_EWMA) * budget_time + BUDGET_EWMA * dt : dt;
+
+    // The latency target stepped the floor up, follow it right away.
+    float finest = decimate_floor();
+    if (tag_detector->quad_decimate < finest) {
+        tag_detector->quad_decimate = finest;
+        budget_frames = 0;
+        budget_changes++;
+        return;
+    }
+
+    if (++budget_frames < BUDGET_SETTLE)
+        return;
+
+    float decimate = tag_detector->quad_decimate;
+    int threads = tag_detector->nthreads;
+    bool change = true;
+
+    if (budget_time > budget && threads < threads_max)
+        threads++;
+
+    else if (budget_time > budget && decimate < decimate_max)
+        decimate = fmin(decimate * BUDGET_STEP, decimate_max);
+
+    else if (budget_time < BUDGET_HEADROOM * budget && decimate > finest)
+        decimate = fmax(decimate / BUDGET_STEP, finest);
+
+    else if (budget_time < BUDGET_HEADROOM * budget && threads > 1)
+        threads--;
+
+    else
+        change = false;
+
+    if (!change)
+        return;
+
+    tag_detector->quad_decimate = decimate;
+    tag_detector->nthreads = threads;
+    budget_frames = 0;
+    budget_changes++;
+}
+
+/**
+ * @brief Create a detector for a tag family with default settings.
+ *
+ * @param family Tag family to detect.
+ * @param threads Number of threads the detector uses.
+ * @return Allocated detector.
+ */
+static apriltag_detector_t *
+detector_create(apriltag_family_t *family, int threads)
+{
+    apriltag_detector_t *detector = apriltag_detector_create();
+    apriltag_detector_add_family(detector, family);
+
+    detector->quad_decimate = decimate_start();
+    detector->quad_sigma = 0.0;
+    detector->nthreads = threads;
+    detector->debug = 0;
+
+    detector->refine_edges = 1;
+    detector->refine_decode = 0;
+    detector->refine_pose = 0;
+
+    return (detector);
+}
+
+/**
+ * @brief Get the capture time of a frame on the clock of sns messages.
+ *        Frames are stamped on the monotonic clock, so the age of the frame
+ *        is taken from the current time.
+ *
+ * @param in_buf Frame to get the time of.
+ * @return Capture time of the frame.
+ */
+static struct timespec
+frame_time(const struct ch_frmbuf *in_buf)
+{
+    struct timespec now = sns_now();
+
+    uint64_t captured = (uint64_t) in_buf->timestamp.tv_sec * 1000000000ull
+        + (uint64_t) in_buf->timestamp.tv_usec * 1000ull;
+    uint64_t mono = ch_stats_now();
+
+    if (captured == 0 || captured > mono)
+        return (now);
+
+    return (ch_sec_to_timespec(ch_timespec_to_sec(now)
+                               - (mono - captured) / 1e9));
+}
+
+/**
+ * @brief Publish a frame's detections over the marker channel.
+ *
+ * @param detections Detections to publish.
+ * @param time Timestamp of the frame.
+ * @return 0 on success, -1 on failure.
+ */
+static int
+publish(zarray_t *detections, struct timespec *time)
+{
+    struct sns_msg_wt_tf *msg = marker_msg;
+    sns_msg_set_time(&msg->header, time, 0);
+
+    // Tags not seen this frame have no weight.
+    memset(msg->wt_tf, 0, MAX_TAG_ID * sizeof(sns_wt_tf));
+
+    int i;
+    for (i = 0; i < zarray_size(detections); i++) {
+        apriltag_detection_t *det;
+        zarray_get(detections, i, &det);
+
+        if (det->id >= MAX_TAG_ID) {
+            ch_error("Tag ID greater than maximum allowed ID");
+            return (-1);
+        }
+
+        double R[9], t[3], q[4];
+        homography_pose(det->H, R, t);
+        aa_tf_rotmat2quat(R, q);
+
+        sns_wt_tf *wt_tf = &(msg->wt_tf[det->id]);
+
+        size_t idx;
+        for (idx = 0; idx < 3; idx++)
+            wt_tf->tf.v.data[idx] = t[idx] * TAG_SIZE_2;
+
+        for (idx = 0; idx < 4; idx++)
+            wt_tf->tf.r.data[idx] = q[idx];
+
+        wt_tf->weight = det->decision_margin;
+    }
+
+    enum ach_status r = sns_msg_wt_tf_put(&marker_chan, msg);
+    if (ACH_OK != r)
+        ch_error("Failed to put marker message in ach channel.");
+
+    return (0);
+}
+
+/**
+ * @brief Publish finished frames in capture order. A frame is published once
+ *        no earlier frame is still in flight, so gaps in the sequence left
+ *        by dropped or shed frames do not hold it back. Must be called with
+ *        the pipeline mutex held.
+ *
+ * @return None. Sets pipe_failed if publishing fails.
+ */
+static void
+pipe_flush(void)
+{
+    while (true) {
+        struct pipe_slot *slot = NULL;
+
+        uint32_t idx;
+        for (idx = 0; idx < pipe_n_slots; idx++)
+            if (pipe_slots[idx].state != PIPE_FREE
+                && (slot == NULL || pipe_slots[idx].seq < slot->seq))
+                slot = &pipe_slots[idx];
+
+        if (slot == NULL || slot->state != PIPE_DONE)
+            return;
+
+        if (publish(slot->detections, &slot->time) == -1)
+            pipe_failed = true;
+
+        apriltag_detections_destroy(slot->detections);
+
+        slot->detections = NULL;
+        slot->state = PIPE_FREE;
+
+        pthread_cond_signal(&pipe_free);
+    }
+}
+
+/**
+ * @brief Take the oldest queued frame for detection. Must be called with the
+ *        pipeline mutex held.
+ *
+ * @return The slot of the frame, now busy, or NULL if none is queued.
+ */
+static struct pipe_slot *
+pipe_take(void)
+{
+    struct pipe_slot *slot = NULL;
+
+    uint32_t idx;
+    for (idx = 0; idx < pipe_n_slots; idx++)
+        if (pipe_slots[idx].state == PIPE_QUEUED
+            && (slot == NULL || pipe_slots[idx].seq < slot->seq))
+            slot = &pipe_slots[idx];
+
+    if (slot)
+        slot->state = PIPE_BUSY;
+
+    return (slot);
+}
+
+/**
+ * @brief Detect tags in a taken frame and publish finished frames in order.
+ *        Must be called with the pipeline mutex held, which is released
+ *        while detecting.
+ *
+ * @param slot Slot taken by pipe_take.
+ * @param detector Detector to use, owned by the caller.
+ * @return None.
+ */
+static void
+pipe_detect(struct pipe_slot *slot, apriltag_detector_t *detector)
+{
+    pthread_mutex_unlock(&pipe_mutex);
+
+    image_u8_t image = {
+        .width = width,
+        .height = height,
+        .stride = stride,
+        .buf = slot->buf
+    };
+
+    // Without a budget, only the latency target coarsens decimation.
+    detector->quad_decimate = fmax(decimate_start(), decimate_floor());
+
+    zarray_t *detections = apriltag_detector_detect(detector, &image);
+
+    pthread_mutex_lock(&pipe_mutex);
+
+    slot->detections = detections;
+    slot->state = PIPE_DONE;
+    pipe_flush();
+}
+
+/**
+ * @brief Pipeline worker task. Detects the oldest queued frame with its own
+ *        detector until none is queued, then goes idle.
+ *
+ * @param arg The struct pipe_worker for this task.
+ * @return None.
+ */
+static void
+pipe_worker_task(void *arg)
+{
+    struct pipe_worker *worker = (struct pipe_worker *) arg;
+
+    pthread_mutex_lock(&pipe_mutex);
+
+    struct pipe_slot *slot;
+    while ((slot = pipe_take()))
+        pipe_detect(slot, worker->detector);
+
+    worker->idle = true;
+
+    pthread_mutex_unlock(&pipe_mutex);
+}
+
+/**
+ * @brief Start the detection pipeline workers.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int
+pipe_start(void)
+{
+    pipe_n_slots = pipe_workers * PIPE_SLOTS_PER_WORKER;
+
+    pipe_slots = (struct pipe_slot *)
+        ch_calloc(pipe_n_slots, sizeof(struct pipe_slot));
+    if (pipe_slots == NULL)
+        return (-1);
+
+    uint32_t idx;
+    for (idx = 0; idx < pipe_n_slots; idx++) {
+        pipe_slots[idx].buf = (uint8_t *) ch_calloc(stride * height, 1);
+        if (pipe_slots[idx].buf == NULL)
+            return (-1);
+    }
+
+    pipe_pool = (struct pipe_worker *)
+        ch_calloc(pipe_workers, sizeof(struct pipe_worker));
+    if (pipe_pool == NULL)
+        return (-1);
+
+    pipe_stop = false;
+    pipe_failed = false;
+    pipe_group = (struct ch_task_group) {0, 0, false};
+
+    for (idx = 0; idx < pipe_workers; idx++) {
+        struct pipe_worker *worker = &pipe_pool[idx];
+
+        worker->family = tag36h11_create();
+        worker->family->black_border = 1;
+        worker->detector = detector_create(worker->family, 1);
+
+        worker->task = (struct ch_task) {pipe_worker_task, worker,
+                                         &pipe_group, 0, 0, NULL, NULL};
+        worker->idle = true;
     }
 
-    aa_tf_rotmat2quat(R, q);
+    return (0);
+}
+
+/**
+ * @brief Drain and stop the detection pipeline workers.
+ *
+ * @return None.
+ */
+static void
+pipe_quit(void)
+{
+    pthread_mutex_lock(&pipe_mutex);
+    pipe_stop = true;
+    pthread_cond_broadcast(&pipe_free);
+    pthread_mutex_unlock(&pipe_mutex);
+
+    // Tasks in flight drain the queued frames before going idle.
+    ch_pool_wait(&pipe_group);
+
+    uint32_t idx;
+    if (pipe_pool) {
+        for (idx = 0; idx < pipe_workers; idx++) {
+            struct pipe_worker *worker = &pipe_pool[idx];
+
+            if (worker->detector)
+                apriltag_detector_destroy(worker->detector);
+
+            if (worker->family)
+                tag36h11_destroy(worker->family);
+        }
+
+        free(pipe_pool);
+        pipe_pool = NULL;
+    }
+
+    if (pipe_slots) {
+        for (idx = 0; idx < pipe_n_slots; idx++) {
+            if (pipe_slots[idx].detections)
+                apriltag_detections_destroy(pipe_slots[idx].detections);
+
+            free(pipe_slots[idx].buf);
+        }
+
+        free(pipe_slots);
+        pipe_slots = NULL;
+    }
+}
+
+/**
+ * @brief Queue a frame for detection in throughput mode. While every slot is
+ *        in flight, detects a queued frame here, or waits for a single slot
+ *        to be published if every frame is already being detected.
+ *
+ * @param in_buf Frame to queue.
+ * @return 0 on success, -1 on failure, including of an earlier frame.
+ */
+static int
+pipe_submit(struct ch_frmbuf *in_buf)
+{
+    struct timespec time = frame_time(in_buf);
+
+    pthread_mutex_lock(&pipe_mutex);
+
+    struct pipe_slot *slot = NULL;
+    while (!pipe_stop && !pipe_failed) {
+        uint32_t idx;
+        for (idx = 0; idx < pipe_n_slots; idx++)
+            if (pipe_slots[idx].state == PIPE_FREE) {
+                slot = &pipe_slots[idx];
+                break;
+            }
+
+        if (slot)
+            break;
+
+        // Every slot is in flight. Waiting on queued frames could hold the
+        // pool thread a worker needs, so detect one here. Busy frames are
+        // being detected elsewhere, so waiting on them is safe.
+        struct pipe_slot *queued = pipe_take();
+        if (queued)
+            pipe_detect(queued, tag_detector);
+        else
+            pthread_cond_wait(&pipe_free, &pipe_mutex);
+    }
+
+    if (slot == NULL) {
+        pthread_mutex_unlock(&pipe_mutex);
+        return (-1);
+    }
+
+    // The input buffer is reused after the callback, so take a copy.
+    memcpy(slot->buf, in_buf->start, stride * height);
+
+    slot->seq = in_buf->sequence;
+    slot->time = time;
+    slot->state = PIPE_QUEUED;
+
+    // Wake an idle worker, busy ones pick the frame up when done.
+    struct pipe_worker *worker = NULL;
+    uint32_t idx;
+    for (idx = 0; idx < pipe_workers && worker == NULL; idx++)
+        if (pipe_pool[idx].idle)
+            worker = &pipe_pool[idx];
+
+    if (worker)
+        worker->idle = false;
+
+    pthread_mutex_unlock(&pipe_mutex);
+
+    if (worker)
+        ch_pool_submit(&worker->task);
+
+    return (0);
 }
 
 int
@@ -55,18 +932,39 @@ CH_DL_INIT(struct ch_device *device, struct ch_dl_cx *cx)
     calib = true;
     cx->undistort = true;
 
-    // Grab calibration parameters
+    // Grab calibration parameters of the rectified image.
     size_t idx;
     for (idx = 0; idx < 2; idx++) {
-        f[idx] = device->calib->camera_mat[idx][idx];
-        c[idx] = device->calib->camera_mat[idx][2];
+        f[idx] = device->calib->rect_mat[idx][idx];
+        c[idx] = device->calib->rect_mat[idx][2];
     }
 
-    width = device->framesize.width;
-    height = device->framesize.height;
+    width = device->calib->outsize.width;
+    height = device->calib->outsize.height;
+
+    // Markers feed control, so run before and shed less critical plugins.
+    // A deadline given on the command line is kept.
+    cx->priority = PRIORITY;
+    if (cx->deadline <= 0.0)
+        cx->deadline = DEADLINE;
+
+    // Under a latency target, coarsen decimation rather than skip frames.
+    dl_cx = cx;
+    cx->qos.levels = QOS_LEVELS;
+
+    // Detection gets a share of the deadline, the rest is left for capture,
+    // conversion and publishing.
+    budget = BUDGET_SHARE * cx->deadline;
 
     cx->out_pixfmt = AV_PIX_FMT_GRAY8;
-    stride = cx->out_stride = ch_calc_stride(cx, width, 96);
+    stride = cx->out_stride = ch_calc_stride(cx, device->framesize.width, 96);
+
+    // Start from the previous fixed settings and adapt to the budget.
+    decimate_max = fmax(width / 160.0, decimate_min);
+    // On the pool, the pool provides the parallelism and the detector runs
+    // single-threaded. Otherwise the detector starts its own threads, within
+    // the size of the pool if given or the number of CPUs.
+    threads_max = (ch_plugin_pooled(cx)) ? 1 : (int) ch_pool_size();
 
     // Initialize AprilTag tag family.
     tag_family = tag36h11_create();
@@ -74,17 +972,32 @@ CH_DL_INIT(struct ch_device *device, struct ch_dl_cx *cx)
     tag_family->black_border = 1;
 
     // Initialize AprilTag detector.
-    tag_detector = apriltag_detector_create();
-    apriltag_detector_add_family(tag_detector, tag_family);
+    tag_detector = detector_create(tag_family, (threads_max < 4) ? threads_max : 4);
+
+    // Storage reused by every frame, so publishing and tracking do not
+    // allocate. The detector itself still allocates while detecting, as
+    // ch_stream -M reports on exit.
+    marker_msg = sns_msg_wt_tf_heap_alloc(MAX_TAG_ID);
+    tracked = zarray_create(sizeof(apriltag_detection_t *));
+    zarray_ensure_capacity(tracked, MAX_TAG_ID + 1);
+
+    // In throughput mode, frames are detected concurrently on the pool,
+    // without tracking. Otherwise detection is one frame at a time, tracking
+    // tags between frames.
+    if (ch_plugin_option(cx, "throughput")) {
+        if (!ch_plugin_pooled(cx)) {
+            ch_error("AprilTag throughput mode needs the worker pool.");
+            return (-1);
+        }
 
-    tag_detector->quad_decimate = width / 320.0;
-    tag_detector->quad_sigma = 0.0;
-    tag_detector->nthreads = 4;
-    tag_detector->debug = 0;
+        pipe_workers = (uint32_t) ch_pool_size();
+        track = false;
+    }
 
-    tag_detector->refine_edges = 1;
-    tag_detector->refine_decode = 0;
-    tag_detector->refine_pose = 0;
+    if (pipe_workers > 0 && pipe_start() == -1) {
+        pipe_quit();
+        return (-1);
+    }
 
     // Set up channel to publish marker information over.
     sns_init();
@@ -107,6 +1020,14 @@ CH_DL_CALL(struct ch_frmbuf *in_buf)
     if (sns_cx.shutdown)
         return (-1);
 
+    // Start counting once the detector's buffers have grown to size.
+    uint64_t allocs;
+    if (ch_get_alloc_count(&allocs) && alloc_frames++ == ALLOC_WARMUP)
+        alloc_start = allocs;
+
+    if (pipe_workers > 0)
+        return (pipe_submit(in_buf));
+
     image_u8_t image = {
         .width = width,
         .height = height,
@@ -114,51 +1035,53 @@ CH_DL_CALL(struct ch_frmbuf *in_buf)
         .buf = in_buf->start
     };
 
-    zarray_t *detections = apriltag_detector_detect(tag_detector, &image);
-
-    struct timespec now = sns_now();
-    struct sns_msg_wt_tf *msg = sns_msg_wt_tf_local_alloc(MAX_TAG_ID);
-    sns_msg_set_time(&msg->header, &now, 0);
-
-    int i;
-    for (i = 0; i < zarray_size(detections); i++) {
-        apriltag_detection_t *det;
-        zarray_get(detections, i, &det);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-        if (det->id > MAX_TAG_ID) {
-            ch_error("Tag ID greater than maximum allowed ID");
-            return (-1);
-        }
+    zarray_t *detections;
+    if (track) {
+        detections = detect_tracked(&image);
+        track_update(detections);
+    } else
+        detections = apriltag_detector_detect(tag_detector, &image);
 
-        matd_t *pose = homography_to_pose(det->H,
-                                          f[0], f[1], c[0], c[1]);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    budget_update(ch_timespec_to_sec(end) - ch_timespec_to_sec(start));
 
-        double q[4];
-        pose_to_q(pose, q);
+    struct timespec time = frame_time(in_buf);
+    int r = publish(detections, &time);
 
-        sns_wt_tf *wt_tf = &(msg->wt_tf[det->id]);
+    detections_release(detections);
+    return (r);
+}
 
-        size_t idx;
-        for (idx = 0; idx < 3; idx++)
-            wt_tf->tf.v.data[idx] = matd_get(pose, idx, 3) * TAG_SIZE_2;
+int
+CH_DL_QUIT(void)
+{
+    if (pipe_workers > 0)
+        pipe_quit();
+    else
+        fprintf(stderr, "AprilTag: %.2f ms / %.2f ms budget, decimate %.2f, "
+                "%d threads after %u changes.\n", budget_time * 1e3,
+                budget * 1e3, tag_detector->quad_decimate,
+                tag_detector->nthreads, budget_changes);
 
-        for (idx = 0; idx < 4; idx++)
-            wt_tf->tf.r.data[idx] = q[idx];
+    // The count covers the whole process, so it bounds our own from above.
+    uint64_t allocs;
+    if (ch_get_alloc_count(&allocs) && alloc_frames > ALLOC_WARMUP)
+        fprintf(stderr, "AprilTag: %.1f heap allocations per frame in the "
+                "process after %d frames of warm-up.\n",
+                (double) (allocs - alloc_start) / (alloc_frames - ALLOC_WARMUP),
+                ALLOC_WARMUP);
 
-        wt_tf->weight = det->decision_margin;
-    }
+    if (tracked)
+        zarray_destroy(tracked);
 
-    enum ach_status r = sns_msg_wt_tf_put(&marker_chan, msg);
-    if (ACH_OK != r)
-        ch_error("Failed to put marker message in ach channel.");
+    free(marker_msg);
 
-    apriltag_detections_destroy(detections);
-    return (0);
-}
+    tracked = NULL;
+    marker_msg = NULL;
 
-int
-CH_DL_QUIT(void)
-{
     apriltag_detector_destroy(tag_detector);
     tag36h11_destroy(tag_family);
 
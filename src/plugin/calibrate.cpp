@@ -1,5 +1,8 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
 
 #include <iostream>
 
@@ -14,129 +17,440 @@
 
 using namespace std;
 
-int    calib_flag = 0; // Calibration flags.
-int    chess_flag = 0; // Calibration board finding flags.
 string out_filename = "calibration.xml";
 
 cv::Size image_size;          // Size of the image.
 cv::Size board_size(4, 4);    // Size of the calibration board.
 double   square_size = 29.0;  // Size of a square on the calibration board in mm.
 
-cv::Size search_size(11, 11); // Subpixel refinement search window.
-int      search_iter = 30;    // Subpixel refinement maximum iteration count.
-double   search_eps  = 0.05;  // Subpixel refinement delta episilon criteria.
-
-// Subpixel refinement criteria.
-cv::TermCriteria criteria(CV_TERMCRIT_EPS | CV_TERMCRIT_ITER,
-                          search_iter, search_eps);
-
 vector< vector< cv::Point2f > > image_points; // Found calibration board points.
 
 double wait_time = 2.0;     // Time in seconds to wait inbetween shots.
 double previous_time = 0.0; // Previous timestamp for found board.
+double full_wait = 5.0;     // Time in seconds without views before a full solve.
+
+size_t min_views = 3;       // Views needed before the first calibration.
+int    refine_iter = 10;    // Maximum iterations when refining a calibration.
+size_t refine_views = 20;   // Most views a refinement solves over.
+size_t full_views = 0;      // Views in the last full, saved solve.
+
+bool    calibrated = false;  // Is there a running calibration?
+cv::Mat camera_mat;          // Running intrinsic camera matrix.
+cv::Mat distortion_coeffs;   // Running distortion coefficients.
+
+pthread_t       worker;                                  // Detection worker.
+pthread_mutex_t worker_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t  worker_cond = PTHREAD_COND_INITIALIZER;
+bool            worker_active = false;  // Should the worker keep running?
+bool            frame_ready = false;    // Is a frame waiting for the worker?
+cv::Mat         frame;                  // Frame handed to the worker.
+
+int     search_width = 640;  // Width of the downscaled image searched for boards.
+double  blur_min = 100.0;    // Minimum Laplacian variance of a sharp view.
+double  motion_max = 4.0;    // Maximum mean pixel change from the last view.
+double  search_scale = 1.0;  // Scale of the downscaled image.
+cv::Mat small;               // Downscaled frame.
+cv::Mat small_prev;          // Downscaled previous frame, for motion.
+
+int    cover_grid = 4;        // Image regions per side tracked for coverage.
+int    cover_tilt = 3;        // Board tilt bins per axis.
+int    cover_scale = 3;       // Board size bins.
+double cover_tilt_min = 0.1;  // Log edge ratio counted as tilted.
+vector< bool > cover_cells;   // Image regions covered by corners.
+vector< bool > cover_poses;   // Tilt and size combinations covered.
+
+/**
+ * @brief Reject blurred or moving views with cheap metrics on the downscaled
+ *        frame before searching for a board.
+ *
+ * @return true if the view is worth searching.
+ */
+static bool
+view_usable(void)
+{
+    bool usable = true;
 
-int
-CH_DL_INIT(struct ch_device *device, struct ch_dl_cx *cx)
+    // Focus and motion blur both flatten the Laplacian.
+    cv::Mat lap;
+    cv::Laplacian(small, lap, CV_64F);
+
+    cv::Mat mean, stddev;
+    cv::meanStdDev(lap, mean, stddev);
+
+    double sharpness = stddev.at< double >(0) * stddev.at< double >(0);
+    if (sharpness < blur_min)
+        usable = false;
+
+    // A board moving between views smears corners even if each looks sharp.
+    if (usable && !small_prev.empty()) {
+        cv::Mat diff;
+        cv::absdiff(small, small_prev, diff);
+
+        if (cv::mean(diff)[0] > motion_max)
+            usable = false;
+    }
+
+    small.copyTo(small_prev);
+    return (usable);
+}
+
+/**
+ * @brief Find calibration board corners, searching a downscaled frame first
+ *        and refining the corners at full resolution.
+ *
+ * @param image_point Corner locations to fill in.
+ * @return true if a board was found.
+ */
+static bool
+find_board(vector< cv::Point2f > &image_point)
 {
-    cx->out_pixfmt = AV_PIX_FMT_GRAY8;
+    if (search_scale < 1.0)
+        cv::resize(frame, small, cv::Size(), search_scale, search_scale,
+                   cv::INTER_AREA);
+    else
+        small = frame;
 
-    // Set flags for calibration.
-    calib_flag |= CV_CALIB_FIX_PRINCIPAL_POINT;
-    calib_flag |= CV_CALIB_FIX_ASPECT_RATIO;
-    calib_flag |= CV_CALIB_FIX_K4;
-    calib_flag |= CV_CALIB_FIX_K5;
+    if (!view_usable())
+        return (false);
 
-    // Set flags for finding calibration board.
-    chess_flag |= CV_CALIB_CB_ADAPTIVE_THRESH;
-    chess_flag |= CV_CALIB_CB_FAST_CHECK;
-    chess_flag |= CV_CALIB_CB_NORMALIZE_IMAGE;
+    return (ch_find_board(frame, small, search_scale, board_size, image_point));
+}
 
-    image_size = cv::Size(device->framesize.width,
-                          device->framesize.height);
+/**
+ * @brief Bin a board tilt from the log ratio of opposite edge lengths.
+ */
+static int
+tilt_bin(double a, double b)
+{
+    double r = log(a / b);
 
-    return (0);
+    if (r < -cover_tilt_min)
+        return (0);
+
+    if (r > cover_tilt_min)
+        return (cover_tilt - 1);
+
+    return (cover_tilt / 2);
 }
 
-int
-CH_DL_CALL(struct ch_frmbuf *in_buf)
+/**
+ * @brief Decide whether a view improves coverage of image regions, board tilts
+ *        and board sizes. Coverage is updated with the view if it is kept.
+ *
+ * @param image_point Corners of the board in the view.
+ * @return true if the view should be used for calibration.
+ */
+static bool
+view_select(const vector< cv::Point2f > &image_point)
 {
+    bool keep = false;
+
+    // Regions of the image touched by corners.
+    vector< int > cells;
+
+    size_t idx;
+    for (idx = 0; idx < image_point.size(); idx++) {
+        int cx = (int) (image_point[idx].x * cover_grid / image_size.width);
+        int cy = (int) (image_point[idx].y * cover_grid / image_size.height);
+
+        cx = min(max(cx, 0), cover_grid - 1);
+        cy = min(max(cy, 0), cover_grid - 1);
+
+        cells.push_back(cy * cover_grid + cx);
+        if (!cover_cells[cells.back()])
+            keep = true;
+    }
+
+    // Outer corners of the board.
+    int w = board_size.width, h = board_size.height;
+    const cv::Point2f &p0 = image_point[0];
+    const cv::Point2f &p1 = image_point[w - 1];
+    const cv::Point2f &p2 = image_point[w * h - 1];
+    const cv::Point2f &p3 = image_point[w * (h - 1)];
+
+    double top = hypot(p1.x - p0.x, p1.y - p0.y);
+    double bottom = hypot(p2.x - p3.x, p2.y - p3.y);
+    double left = hypot(p3.x - p0.x, p3.y - p0.y);
+    double right = hypot(p2.x - p1.x, p2.y - p1.y);
+
+    // Foreshortening of opposite edges gives tilt about each axis.
+    int tx = tilt_bin(left, right);
+    int ty = tilt_bin(top, bottom);
+
+    // Linear size of the board relative to the image, from its area.
+    double area = 0.5 * fabs((p0.x - p2.x) * (p1.y - p3.y)
+                             - (p1.x - p3.x) * (p0.y - p2.y));
+    int sc = (int) (sqrt(area / image_size.area()) * cover_scale);
+    sc = min(max(sc, 0), cover_scale - 1);
+
+    int pose = (sc * cover_tilt + ty) * cover_tilt + tx;
+    if (!cover_poses[pose])
+        keep = true;
+
+    if (!keep)
+        return (false);
+
+    for (idx = 0; idx < cells.size(); idx++)
+        cover_cells[cells[idx]] = true;
+
+    cover_poses[pose] = true;
+
+    size_t n_cells = 0, n_poses = 0;
+    for (idx = 0; idx < cover_cells.size(); idx++)
+        n_cells += cover_cells[idx];
+
+    for (idx = 0; idx < cover_poses.size(); idx++)
+        n_poses += cover_poses[idx];
+
+    cerr << "Coverage: " << (100 * n_cells / cover_cells.size())
+         << "% of image regions, " << (100 * n_poses / cover_poses.size())
+         << "% of tilts and sizes." << endl;
+
+    return (true);
+}
+
+/**
+ * @brief Refine the running calibration with the views found so far. The first
+ *        calibration starts from scratch, later ones start from the running
+ *        estimate and only take a few iterations. Each solves over at most
+ *        refine_views views, so a refinement costs the same however many
+ *        views have been found. Refinements are not saved, calibrate_full()
+ *        saves a solve over every view.
+ *
+ * @return None.
+ */
+static void
+calibrate_update(void)
+{
+    if (image_points.size() < min_views)
+        return;
+
+    // Spread the subset over all views to keep their coverage, always
+    // including the newest.
+    vector< vector< cv::Point2f > > views;
+    size_t n_views = image_points.size();
+
+    if (n_views <= refine_views || refine_views < 2)
+        views = image_points;
+    else {
+        size_t idx;
+        for (idx = 0; idx < refine_views; idx++)
+            views.push_back(image_points[(n_views - 1)
+                                         - idx * (n_views - 1)
+                                         / (refine_views - 1)]);
+    }
+
+    double error = ch_calibrate_camera(
+        views, image_size, board_size, square_size, calibrated,
+        (calibrated) ? refine_iter : CH_CALIB_ITER, camera_mat,
+        distortion_coeffs);
+
+    calibrated = true;
+
+    cerr << "Camera calibrated with " << views.size() << " of "
+         << n_views << " views. Reprojection error: " << error << endl;
+}
+
+/**
+ * @brief Solve over every view found so far, starting from the running
+ *        estimate, and save the result.
+ *
+ * @return None.
+ */
+static void
+calibrate_full(void)
+{
+    if (image_points.size() < min_views || image_points.size() == full_views)
+        return;
+
+    full_views = image_points.size();
+
+    double error = ch_calibrate_camera(
+        image_points, image_size, board_size, square_size, calibrated,
+        CH_CALIB_ITER, camera_mat, distortion_coeffs);
+
+    calibrated = true;
+
+    cerr << "Camera calibrated with all " << full_views
+         << " views. Reprojection error: " << error << endl;
+
+    ch_save_calibration(out_filename, image_size, board_size, square_size,
+                        error, camera_mat, distortion_coeffs);
+}
+
+/**
+ * @brief Time left until views count as having stopped arriving, so that a
+ *        full solve is due.
+ *
+ * @return Seconds left, 0 or less once due, infinity with nothing to solve.
+ */
+static double
+full_due(void)
+{
+    if (image_points.size() < min_views || image_points.size() == full_views)
+        return (INFINITY);
+
     struct timespec ts;
     clock_gettime(CLOCK_MONOTONIC, &ts);
-    double current_time = ch_timespec_to_sec(ts);
 
-    // Check if enough time has passed.
-    if (current_time - previous_time <= wait_time)
-        return (0);
+    return (previous_time + full_wait - ch_timespec_to_sec(ts));
+}
 
-    cv::Mat image(image_size, CV_8UC1, in_buf->start);
-    vector< cv::Point2f > image_point;
+/**
+ * @brief Worker thread that finds calibration boards in frames handed over by
+ *        the callback and refines the running calibration. Once views stop
+ *        arriving, or the worker is stopped, it solves over every view.
+ *
+ * @return Always NULL.
+ */
+static void *
+calibrate_worker(void *arg)
+{
+    arg = (void *) arg;
+
+    pthread_mutex_lock(&worker_mutex);
+
+    while (worker_active) {
+        if (!frame_ready) {
+            double due = full_due();
+
+            if (due <= 0.0) {
+                pthread_mutex_unlock(&worker_mutex);
+                calibrate_full();
+                pthread_mutex_lock(&worker_mutex);
+            } else if (isinf(due))
+                pthread_cond_wait(&worker_cond, &worker_mutex);
+            else {
+                // Condition variables time out on the realtime clock.
+                struct timespec now;
+                clock_gettime(CLOCK_REALTIME, &now);
+
+                struct timespec ts = ch_sec_to_timespec(
+                    ch_timespec_to_sec(now) + due);
+                pthread_cond_timedwait(&worker_cond, &worker_mutex, &ts);
+            }
+
+            continue;
+        }
 
-    // Find chessboard corners.
-    bool found =
-        cv::findChessboardCorners(image, board_size, image_point, chess_flag);
+        pthread_mutex_unlock(&worker_mutex);
 
-    if (!found)
-        return (0);
+        vector< cv::Point2f > image_point;
+        bool found = find_board(image_point);
+
+        if (found) {
+            cerr << "Found calibration board!" << endl;
+
+            // Redundant views only add cost, wait for a better one.
+            if (!view_select(image_point)) {
+                cerr << "View does not improve coverage, skipping." << endl;
+                found = false;
+            }
+
+            cerr.flush();
+        }
+
+        pthread_mutex_lock(&worker_mutex);
+
+        if (found) {
+            // Set time.
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            previous_time = ch_timespec_to_sec(ts);
+        }
+
+        frame_ready = false;
+
+        if (found) {
+            // Once quitting, keep the view but do not start a refinement.
+            bool refine = worker_active;
+            pthread_mutex_unlock(&worker_mutex);
+
+            // Add corner points to current set.
+            image_points.push_back(image_point);
+            if (refine)
+                calibrate_update();
+
+            pthread_mutex_lock(&worker_mutex);
+        }
+    }
+
+    pthread_mutex_unlock(&worker_mutex);
+
+    // Solve over any views found since the last full solve.
+    calibrate_full();
+
+    return (NULL);
+}
 
-    cerr << "Found calibration board!" << endl;
-    cerr.flush();
+int
+CH_DL_INIT(struct ch_device *device, struct ch_dl_cx *cx)
+{
+    cx->out_pixfmt = AV_PIX_FMT_GRAY8;
+
+    image_size = cv::Size(device->framesize.width,
+                          device->framesize.height);
 
-    // Set time.
-    previous_time = current_time;
+    frame = cv::Mat(image_size, CV_8UC1);
 
-    // Refine pixel locations of corners.
-    cv::cornerSubPix(image, image_point,
-                    search_size, cv::Size(-1, -1), criteria);
+    cover_cells.assign(cover_grid * cover_grid, false);
+    cover_poses.assign(cover_tilt * cover_tilt * cover_scale, false);
+
+    // Search for boards at no more than search_width.
+    search_scale = ch_board_scale(image_size, search_width);
+
+    // Start board detection worker.
+    worker_active = true;
+    if (ch_start_thread(&worker, NULL, calibrate_worker, NULL) == -1) {
+        worker_active = false;
+        return (-1);
+    }
 
-    // Add corner points to current set.
-    image_points.push_back(image_point);
     return (0);
 }
 
 int
-CH_DL_QUIT(void)
+CH_DL_CALL(struct ch_frmbuf *in_buf)
 {
-    // If no chessboards have been found, don't bother calibrating.
-    if (image_points.size() == 0)
-        return (0);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    double current_time = ch_timespec_to_sec(ts);
 
-    // Create reference object points.
-    vector< cv::Point3f > corners;
-    {
-        int idx;
-        for (idx = 0; idx < board_size.width; idx++) {
-            int jdx;
-            for (jdx = 0; jdx < board_size.height; jdx++)
-                corners.push_back(
-                    cv::Point3f(square_size * idx, square_size * jdx, 0));
-        }
+    pthread_mutex_lock(&worker_mutex);
+
+    // Hand the frame over only if enough time has passed and the worker is idle.
+    if (current_time - previous_time > wait_time && !frame_ready) {
+        memcpy(frame.data, in_buf->start, image_size.area());
+        frame_ready = true;
+
+        pthread_cond_signal(&worker_cond);
     }
 
-    vector< vector < cv::Point3f > > object_points;
-    object_points.resize(image_points.size(), corners);
+    pthread_mutex_unlock(&worker_mutex);
 
-    // Create camera project matrix.
-    cv::Mat camera_mat = cv::Mat::eye(3, 3, CV_64F);
+    return (0);
+}
 
-    // If fixed aspect ratio, set F_x to 0.
-    if (calib_flag & CV_CALIB_FIX_ASPECT_RATIO)
-        camera_mat.at< double >(0, 0) = 1.0;
+int
+CH_DL_QUIT(void)
+{
+    // Stop the worker. It solves over every view unless the last full solve
+    // already did, so the saved calibration never leaves views out.
+    pthread_mutex_lock(&worker_mutex);
+    worker_active = false;
+    pthread_cond_signal(&worker_cond);
+    pthread_mutex_unlock(&worker_mutex);
 
-    cv::Mat distortion_coeffs = cv::Mat::zeros(8, 1, CV_64F);
-    vector< cv::Mat > rotation_vec, translation_vec;
+    if (ch_join_thread(worker, NULL) == -1)
+        return (-1);
 
-    double error = cv::calibrateCamera(
-        object_points, image_points, image_size, camera_mat,
-        distortion_coeffs, rotation_vec, translation_vec, calib_flag);
+    if (!calibrated)
+        return (0);
 
-    cerr << "Camera calibrated. Reprojection error: " << error << endl;
     cerr << "Intrisic Matrix:" << endl;
     cerr << camera_mat << endl;
     cerr << "Distortion Coefficients:" << endl;
     cerr << distortion_coeffs << endl;
 
-    ch_save_calibration(out_filename, image_size, board_size, square_size,
-                        error, camera_mat, distortion_coeffs);
-
     return (0);
 }
@@ -13,43 +13,40 @@ pthread_t gui_thread;
 struct ch_frmbuf outbuf;
 struct ch_dl_cx *dl_cx;
 
+pthread_mutex_t outbuf_mutex = PTHREAD_MUTEX_INITIALIZER;
+struct ch_rect outbuf_size;      // Size of the image in outbuf.
+GtkWidget *draw_area = NULL;     // Widget displaying frames.
+volatile gint redraw_pending = 0; // Is a redraw already queued?
+
 /**
- * @brief Callback function that occurs on a timer. Used for repaint.
+ * @brief Idle callback queued by new frames. Used for repaint.
  */
 static gboolean
-timer_callback(GtkWidget *widget)
+redraw_callback(gpointer data)
 {
-    gtk_widget_queue_draw(widget);
+    data = (gpointer) data;
+
+    g_atomic_int_set(&redraw_pending, 0);
 
-    return (TRUE);
+    if (draw_area)
+        gtk_widget_queue_draw(draw_area);
+
+    return (FALSE);
 }
 
 /**
- * @brief Resize a cairo surface.
+ * @brief Request the pipeline to output images sized to fit the widget, so
+ *        frames are scaled once during conversion instead of on every draw.
  */
-static cairo_surface_t *
-scale_surface(cairo_surface_t *old_surface, int old_width, int old_height,
-               int new_width, int new_height)
+static void
+request_size(uint32_t w, uint32_t h)
 {
-    cairo_surface_t *new_surface =
-        cairo_surface_create_similar(old_surface, CAIRO_CONTENT_COLOR,
-                                     new_width, new_height);
-
-    cairo_t *cr = cairo_create(new_surface);
+    pthread_mutex_lock(&dl_cx->mutex);
 
-    cairo_scale(cr, (double) new_width / old_width,
-                (double) new_height / old_height);
+    if (dl_cx->out_size.width != w || dl_cx->out_size.height != h)
+        dl_cx->out_size = (struct ch_rect) {w, h};
 
-    cairo_set_source_surface(cr, old_surface, 0, 0);
-
-    cairo_pattern_set_extend(cairo_get_source(cr), CAIRO_EXTEND_REFLECT);
-
-    cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
-
-    cairo_paint(cr);
-    cairo_destroy(cr);
-
-    return (new_surface);
+    pthread_mutex_unlock(&dl_cx->mutex);
 }
 
 /**
@@ -63,38 +60,58 @@ on_draw_event(GtkWidget *widget, cairo_t *cr, gpointer data)
     if (!device->stream)
 	return (FALSE);
 
-    int stride = cairo_format_stride_for_width(CAIRO_FORMAT_RGB24,
-                                               device->framesize.width);
-
-    uint32_t dw = device->framesize.width;
-    uint32_t dh = device->framesize.height;
-
-    cairo_surface_t *image = cairo_image_surface_create_for_data(
-        outbuf.start,
-        CAIRO_FORMAT_RGB24,
-        dw, dh,
-        stride
-    );
-
     int w = gtk_widget_get_allocated_width(widget);
     int h = gtk_widget_get_allocated_height(widget);
 
-    double ar = fmin(w / (double) dw, h / (double) dh);
+    // Full size of the image the pipeline would produce.
+    uint32_t fw = device->framesize.width;
+    uint32_t fh = device->framesize.height;
 
-    uint32_t sw = dw * ar;
-    uint32_t sh = dh * ar;
+    // Rectified frames may be smaller, but keep the full frame stride.
+    if (device->calib && dl_cx->undistort) {
+        fw = device->calib->outsize.width;
+        fh = device->calib->outsize.height;
+    }
 
-    cairo_surface_t *simage =
-        scale_surface(image, dw, dh, sw, sh);
+    double ar = fmin(w / (double) fw, h / (double) fh);
+
+    uint32_t sw = fw * ar;
+    uint32_t sh = fh * ar;
 
     uint32_t ow = (w - sw) / 2;
     uint32_t oh = (h - sh) / 2;
 
-    cairo_set_source_surface(cr, simage, ow, oh);
-    cairo_paint(cr);
+    request_size(sw, sh);
+
+    pthread_mutex_lock(&outbuf_mutex);
 
-    cairo_surface_destroy(image);
-    cairo_surface_destroy(simage);
+    uint32_t dw = outbuf_size.width;
+    uint32_t dh = outbuf_size.height;
+
+    if (dw > 0 && dh > 0) {
+        cairo_surface_t *image = cairo_image_surface_create_for_data(
+            outbuf.start,
+            CAIRO_FORMAT_RGB24,
+            dw, dh,
+            dl_cx->out_stride
+        );
+
+        // Only scale here if the pipeline could not, e.g. when enlarging.
+        cairo_save(cr);
+        cairo_translate(cr, ow, oh);
+
+        if (dw != sw || dh != sh)
+            cairo_scale(cr, (double) sw / dw, (double) sh / dh);
+
+        cairo_set_source_surface(cr, image, 0, 0);
+        cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+        cairo_paint(cr);
+        cairo_restore(cr);
+
+        cairo_surface_destroy(image);
+    }
+
+    pthread_mutex_unlock(&outbuf_mutex);
 
     cairo_select_font_face(cr, "Sans",
                            CAIRO_FONT_SLANT_NORMAL,
@@ -144,20 +161,13 @@ setup_gui(void *arg)
 {
     struct ch_device *device = (struct ch_device *) arg;
 
-    // Create output buffer for Cairo graphics.
-    outbuf.length = 4 * device->framesize.width * device->framesize.height;
-    outbuf.start = (uint8_t *)
-        ch_calloc(1, outbuf.length);
-
-    if (outbuf.start == NULL)
-        goto clean;
-
     gtk_init(0, NULL);
 
     GtkWidget *window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
 
     // Set up drawing area.
     GtkWidget *drawRGB = gtk_drawing_area_new();
+    draw_area = drawRGB;
     gtk_container_add(GTK_CONTAINER(window), drawRGB);
 
     gtk_window_set_default_size(GTK_WINDOW(window),
@@ -174,17 +184,13 @@ setup_gui(void *arg)
     g_signal_connect(G_OBJECT(window), "key_press_event",
                      G_CALLBACK(on_key_press), NULL);
 
-    // Register timer event.
-    g_timeout_add(ch_get_fps(device), (GSourceFunc) timer_callback, (gpointer) drawRGB);
-    timer_callback(drawRGB);
-
-    // Show window and begin mainloop.
+    // Show window and begin mainloop. Redraws are queued by new frames.
     gtk_widget_set_app_paintable(window, TRUE);
     gtk_widget_show_all(window);
 
     gtk_main();
 
-clean:
+    draw_area = NULL;
     return (NULL);
 }
 
@@ -197,6 +203,16 @@ CH_DL_INIT(struct ch_device *device, struct ch_dl_cx *cx)
 
     dl_cx = cx;
 
+    // Create output buffer for Cairo graphics. Matches the plugin output
+    // buffers so the two can be swapped.
+    outbuf.length = 4 * device->framesize.width * device->framesize.height;
+    outbuf.start = (uint8_t *) ch_calloc(1, outbuf.length);
+
+    if (outbuf.start == NULL)
+        return (-1);
+
+    outbuf_size = (struct ch_rect) {0, 0};
+
     // Create display thread.
     int r;
     if ((r = pthread_create(&gui_thread, NULL, setup_gui, device)) != 0) {
@@ -210,7 +226,21 @@ CH_DL_INIT(struct ch_device *device, struct ch_dl_cx *cx)
 int
 CH_DL_CALL(struct ch_frmbuf *in_buf)
 {
-    memcpy(outbuf.start, in_buf->start, outbuf.length);
+    // Swap buffers instead of copying, the pipeline reuses ours.
+    pthread_mutex_lock(&outbuf_mutex);
+
+    uint8_t *temp = outbuf.start;
+    outbuf.start = in_buf->start;
+    in_buf->start = temp;
+
+    outbuf_size = dl_cx->out_frmsize[dl_cx->select];
+
+    pthread_mutex_unlock(&outbuf_mutex);
+
+    // Coalesce redraws if the GUI is behind.
+    if (g_atomic_int_compare_and_exchange(&redraw_pending, 0, 1))
+        g_idle_add(redraw_callback, NULL);
+
     return (0);
 }
 
@@ -219,7 +249,6 @@ CH_DL_QUIT(void)
 {
     // Close display thread and join.
     gtk_main_quit();
-    free(outbuf.start);
 
     int r;
     if ((r = pthread_join(gui_thread, NULL)) != 0) {
@@ -227,6 +256,8 @@ CH_DL_QUIT(void)
 	return (-1);
     }
 
+    free(outbuf.start);
+
     gui_thread = 0;
     return (0);
 }
@@ -0,0 +1,42 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+
+#include <chiasm.h>
+
+const char *journal_file = "journal.chj";      // Filename of the journal.
+uint64_t journal_size = (uint64_t) 1 << 30;    // Bytes of frames kept.
+
+struct ch_journal journal;
+uint64_t frames = 0;
+
+int
+CH_DL_INIT(struct ch_device *device, struct ch_dl_cx *cx)
+{
+    // Journal the payload as captured, so replay takes the same decode path.
+    cx->passthrough = true;
+    cx->undistort = false;
+
+    return (ch_create_journal(&journal, journal_file, journal_size, device));
+}
+
+int
+CH_DL_CALL(struct ch_frmbuf *in_buf)
+{
+    if (ch_append_journal(&journal, in_buf) == -1)
+        return (-1);
+
+    frames++;
+    return (0);
+}
+
+int
+CH_DL_QUIT(void)
+{
+    ch_close_journal(&journal);
+
+    fprintf(stderr, "Journaled %" PRIu64 " frames to %s.\n",
+            frames, journal_file);
+
+    return (0);
+}
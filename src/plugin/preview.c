@@ -0,0 +1,608 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+
+#include <chiasm.h>
+
+#define MAX_CLIENTS 16
+#define BOUNDARY    "chiasmframe"
+
+#define QOS_SCALE_MIN 0.25 // Smallest output scale under a latency target.
+#define QOS_LEVELS    3    // Quantizer steps under a latency target.
+#define QOS_QUANT     6    // Quantizer increase per step.
+#define QOS_SKIP_MAX  2    // Most frames skipped between encoded ones.
+
+const char *preview_addr = "127.0.0.1"; // TCP address to listen on.
+uint16_t preview_port = 8080;           // TCP port to listen on.
+const char *preview_unix = NULL;        // Unix socket path, used instead of TCP if set.
+double preview_rate = 10.0;             // Most frames encoded per second.
+uint32_t preview_width = 640;           // Widest frame encoded, 0 for full size.
+int preview_quality = 5;                // JPEG quantizer, 2 (best) to 31.
+
+/**
+ * @brief An encoded frame, shared by all clients sending it.
+ */
+struct preview_frame {
+    uint8_t *data;  /**< JPEG image. */
+    size_t length;  /**< Length of the JPEG image. */
+    uint64_t seq;   /**< Sequence number of the frame. */
+    uint32_t refs;  /**< References held, by clients and as latest frame. */
+};
+
+/**
+ * @brief State of a connected client.
+ */
+struct preview_client {
+    int fd;                       /**< Client socket, -1 if unused. */
+    bool started;                 /**< Has the response header been sent? */
+    struct preview_frame *frame;  /**< Frame being sent, NULL if idle. */
+    uint64_t seq;                 /**< Last frame sent. */
+    char head[256];               /**< Headers preceding the frame. */
+    size_t head_length;           /**< Length of the headers. */
+    size_t offset;                /**< Bytes of headers, frame and trailer sent. */
+};
+
+struct ch_device *dev;
+struct ch_dl_cx *dl_cx;
+
+AVCodecContext *encode_cx = NULL;
+AVFrame *encode_frame = NULL;
+struct ch_rect encode_size;    // Size the encoder was opened with.
+struct timespec encode_last;   // Time of the last encoded frame.
+
+pthread_t server_thread;
+volatile bool active = false;
+int listen_fd = -1;
+int wake_fd[2] = { -1, -1 };   // Pipe waking the server on new frames.
+
+pthread_mutex_t frame_mutex = PTHREAD_MUTEX_INITIALIZER;
+struct preview_frame *latest = NULL; // Most recent encoded frame.
+uint64_t frame_seq = 0;
+
+struct preview_client clients[MAX_CLIENTS];
+
+/**
+ * @brief Drop a reference to a frame, freeing it when unused.
+ *        Frame mutex must be held.
+ */
+static void
+frame_release(struct preview_frame *frame)
+{
+    if (frame == NULL || --frame->refs > 0)
+        return;
+
+    free(frame->data);
+    free(frame);
+}
+
+/**
+ * @brief Open the JPEG encoder for a frame size.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int
+encoder_open(struct ch_rect size)
+{
+    if (encode_cx) {
+        avcodec_close(encode_cx);
+        av_free(encode_cx);
+        encode_cx = NULL;
+    }
+
+    AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
+    if (codec == NULL) {
+        ch_error("Failed to find JPEG encoder.");
+        return (-1);
+    }
+
+    if ((encode_cx = avcodec_alloc_context3(codec)) == NULL) {
+        ch_error("Failed to allocate JPEG encoder context.");
+        return (-1);
+    }
+
+    encode_cx->width = size.width;
+    encode_cx->height = size.height;
+    encode_cx->pix_fmt = AV_PIX_FMT_YUVJ420P;
+    encode_cx->time_base = (AVRational) {1, 30};
+    encode_cx->flags |= CODEC_FLAG_QSCALE;
+    encode_cx->global_quality = FF_QP2LAMBDA * preview_quality;
+
+    if (avcodec_open2(encode_cx, codec, NULL) < 0) {
+        ch_error("Failed to open JPEG encoder.");
+        av_free(encode_cx);
+        encode_cx = NULL;
+        return (-1);
+    }
+
+    encode_size = size;
+    return (0);
+}
+
+/**
+ * @brief Start sending the newest frame to a client if it has not seen it.
+ */
+static void
+client_next(struct preview_client *client)
+{
+    pthread_mutex_lock(&frame_mutex);
+
+    struct preview_frame *frame = latest;
+    if (frame && frame->seq != client->seq) {
+        frame->refs++;
+        client->frame = frame;
+        client->seq = frame->seq;
+    }
+
+    pthread_mutex_unlock(&frame_mutex);
+
+    if (client->frame == NULL)
+        return;
+
+    int length = 0;
+    if (!client->started) {
+        length = snprintf(client->head, sizeof(client->head),
+                          "HTTP/1.0 200 OK\r\n"
+                          "Cache-Control: no-cache\r\n"
+                          "Connection: close\r\n"
+                          "Content-Type: multipart/x-mixed-replace; "
+                          "boundary=" BOUNDARY "\r\n\r\n");
+        client->started = true;
+    }
+
+    length += snprintf(client->head + length, sizeof(client->head) - length,
+                       "--" BOUNDARY "\r\n"
+                       "Content-Type: image/jpeg\r\n"
+                       "Content-Length: %zu\r\n\r\n",
+                       client->frame->length);
+
+    client->head_length = length;
+    client->offset = 0;
+}
+
+/**
+ * @brief Disconnect a client and drop its frame.
+ */
+static void
+client_close(struct preview_client *client)
+{
+    close(client->fd);
+    client->fd = -1;
+
+    pthread_mutex_lock(&frame_mutex);
+    frame_release(client->frame);
+    pthread_mutex_unlock(&frame_mutex);
+
+    client->frame = NULL;
+}
+
+/**
+ * @brief Send as much as the socket accepts without blocking. Frames that
+ *        arrive while a client is still sending are skipped for that client.
+ *
+ * @return 0 on success, -1 if the client should be closed.
+ */
+static int
+client_send(struct preview_client *client)
+{
+    static const char trailer[] = "\r\n";
+
+    for (;;) {
+        if (client->frame == NULL) {
+            client_next(client);
+            if (client->frame == NULL)
+                return (0);
+        }
+
+        size_t total = client->head_length + client->frame->length
+                       + sizeof(trailer) - 1;
+        size_t frame_end = client->head_length + client->frame->length;
+
+        const void *data;
+        size_t length;
+        if (client->offset < client->head_length) {
+            data = client->head + client->offset;
+            length = client->head_length - client->offset;
+        } else if (client->offset < frame_end) {
+            data = client->frame->data + (client->offset - client->head_length);
+            length = frame_end - client->offset;
+        } else {
+            data = trailer + (client->offset - frame_end);
+            length = total - client->offset;
+        }
+
+        ssize_t r = send(client->fd, data, length, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (r == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return (0);
+
+            return (-1);
+        }
+
+        client->offset += r;
+
+        if (client->offset == total) {
+            pthread_mutex_lock(&frame_mutex);
+            frame_release(client->frame);
+            pthread_mutex_unlock(&frame_mutex);
+
+            client->frame = NULL;
+        }
+    }
+}
+
+/**
+ * @brief Accept a pending connection if there is room for it.
+ */
+static void
+client_accept(void)
+{
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd == -1)
+        return;
+
+    size_t idx;
+    for (idx = 0; idx < MAX_CLIENTS; idx++)
+        if (clients[idx].fd == -1)
+            break;
+
+    if (idx == MAX_CLIENTS || fcntl(fd, F_SETFL, O_NONBLOCK) == -1) {
+        close(fd);
+        return;
+    }
+
+    clients[idx].fd = fd;
+    clients[idx].started = false;
+    clients[idx].frame = NULL;
+    clients[idx].seq = 0;
+}
+
+/**
+ * @brief Server thread. Accepts clients and sends each the newest frame
+ *        whenever its socket is writable.
+ */
+static void *
+server_loop(void *arg)
+{
+    arg = (void *) arg;
+
+    struct pollfd fds[MAX_CLIENTS + 2];
+    size_t map[MAX_CLIENTS];
+
+    while (active) {
+        fds[0] = (struct pollfd) { wake_fd[0], POLLIN, 0 };
+        fds[1] = (struct pollfd) { listen_fd, POLLIN, 0 };
+
+        // Only wait for writable sockets with something left to send.
+        pthread_mutex_lock(&frame_mutex);
+        uint64_t seq = (latest) ? latest->seq : 0;
+        pthread_mutex_unlock(&frame_mutex);
+
+        size_t n = 2;
+        size_t idx;
+        for (idx = 0; idx < MAX_CLIENTS; idx++) {
+            struct preview_client *client = &clients[idx];
+            if (client->fd == -1)
+                continue;
+
+            short events = POLLIN;
+            if (client->frame || client->seq != seq)
+                events |= POLLOUT;
+
+            fds[n] = (struct pollfd) { client->fd, events, 0 };
+            map[n - 2] = idx;
+            n++;
+        }
+
+        if (poll(fds, n, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+
+            ch_error_no("Failed to poll preview sockets.", errno);
+            break;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            char drain[64];
+            while (read(wake_fd[0], drain, sizeof(drain)) > 0);
+        }
+
+        if (fds[1].revents & POLLIN)
+            client_accept();
+
+        for (idx = 2; idx < n; idx++) {
+            struct preview_client *client = &clients[map[idx - 2]];
+            bool failed = (fds[idx].revents & (POLLERR | POLLHUP)) != 0;
+
+            // Requests are not parsed, every client gets the stream.
+            if (!failed && (fds[idx].revents & POLLIN)) {
+                char discard[512];
+                ssize_t r = recv(client->fd, discard, sizeof(discard),
+                                 MSG_DONTWAIT);
+                if (r == 0 || (r == -1 && errno != EAGAIN && errno != EINTR))
+                    failed = true;
+            }
+
+            if (!failed && (fds[idx].revents & POLLOUT))
+                failed = (client_send(client) == -1);
+
+            if (failed)
+                client_close(client);
+        }
+    }
+
+    return (NULL);
+}
+
+/**
+ * @brief Open the listening socket.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int
+server_open(void)
+{
+    if (preview_unix) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+
+        if (strlen(preview_unix) >= sizeof(addr.sun_path)) {
+            ch_error("Preview socket path is too long.");
+            return (-1);
+        }
+
+        strcpy(addr.sun_path, preview_unix);
+        unlink(preview_unix);
+
+        if ((listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1
+            || bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+            goto error;
+
+    } else {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(preview_port);
+
+        if (inet_pton(AF_INET, preview_addr, &addr.sin_addr) != 1) {
+            ch_error("Failed to parse preview address.");
+            return (-1);
+        }
+
+        int one = 1;
+        if ((listen_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1
+            || setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR,
+                          &one, sizeof(one)) == -1
+            || bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+            goto error;
+    }
+
+    if (listen(listen_fd, MAX_CLIENTS) == -1
+        || fcntl(listen_fd, F_SETFL, O_NONBLOCK) == -1)
+        goto error;
+
+    return (0);
+
+error:
+    ch_error_no("Failed to open preview socket.", errno);
+
+    if (listen_fd != -1)
+        close(listen_fd);
+
+    listen_fd = -1;
+    return (-1);
+}
+
+int
+CH_DL_INIT(struct ch_device *device, struct ch_dl_cx *cx)
+{
+    // Encode straight from the plugin output, which is laid out as planes.
+    cx->out_pixfmt = AV_PIX_FMT_YUVJ420P;
+    cx->undistort = false;
+
+    dev = device;
+    dl_cx = cx;
+
+    // Let the pipeline scale frames down while converting. JPEG wants even
+    // dimensions.
+    if (preview_width > 0 && preview_width < device->framesize.width) {
+        uint32_t h = (uint64_t) device->framesize.height * preview_width
+                     / device->framesize.width;
+        cx->out_size = (struct ch_rect) {preview_width & ~1u, h & ~1u};
+    }
+
+    // Under a latency target, shrink frames, then lower their quality, then
+    // skip some.
+    cx->qos.scale_min = QOS_SCALE_MIN;
+    cx->qos.levels = QOS_LEVELS;
+    cx->qos.skip_max = QOS_SKIP_MAX;
+
+    size_t idx;
+    for (idx = 0; idx < MAX_CLIENTS; idx++)
+        clients[idx].fd = -1;
+
+    if ((encode_frame = av_frame_alloc()) == NULL) {
+        ch_error("Failed to allocate JPEG encoder frame.");
+        return (-1);
+    }
+
+    if (pipe(wake_fd) == -1) {
+        ch_error_no("Failed to create preview wake pipe.", errno);
+        goto clean;
+    }
+
+    if (fcntl(wake_fd[0], F_SETFL, O_NONBLOCK) == -1
+        || fcntl(wake_fd[1], F_SETFL, O_NONBLOCK) == -1) {
+        ch_error_no("Failed to set preview wake pipe flags.", errno);
+        goto clean;
+    }
+
+    if (server_open() == -1)
+        goto clean;
+
+    encode_last = (struct timespec) {0, 0};
+
+    active = true;
+    if (ch_start_thread(&server_thread, NULL, server_loop, NULL) == -1) {
+        active = false;
+        goto clean;
+    }
+
+    if (preview_unix)
+        fprintf(stderr, "Serving preview on %s.\n", preview_unix);
+    else
+        fprintf(stderr, "Serving preview on http://%s:%u/.\n",
+                preview_addr, preview_port);
+
+    return (0);
+
+clean:
+    if (listen_fd != -1)
+        close(listen_fd);
+
+    if (wake_fd[0] != -1) {
+        close(wake_fd[0]);
+        close(wake_fd[1]);
+    }
+
+    listen_fd = wake_fd[0] = wake_fd[1] = -1;
+    av_frame_free(&encode_frame);
+    return (-1);
+}
+
+int
+CH_DL_CALL(struct ch_frmbuf *in_buf)
+{
+    // Cap the encode rate, later frames replace skipped ones anyway.
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    double elapsed = ch_timespec_to_sec(now) - ch_timespec_to_sec(encode_last);
+    if (preview_rate > 0.0 && elapsed < 1.0 / preview_rate)
+        return (0);
+
+    encode_last = now;
+
+    // Output frames are scaled into buffers laid out for the full frame.
+    struct ch_rect size = dl_cx->out_frmsize[dl_cx->select];
+
+    if (encode_cx == NULL
+        || encode_size.width != size.width
+        || encode_size.height != size.height)
+        if (encoder_open(size) == -1)
+            return (-1);
+
+    if (avpicture_fill((AVPicture *) encode_frame, in_buf->start,
+                       AV_PIX_FMT_YUVJ420P, dev->framesize.width,
+                       dev->framesize.height) < 0) {
+        ch_error("Failed to setup JPEG encoder frame.");
+        return (-1);
+    }
+
+    encode_frame->width = size.width;
+    encode_frame->height = size.height;
+    encode_frame->format = AV_PIX_FMT_YUVJ420P;
+
+    int quality = preview_quality
+        + (int) __atomic_load_n(&dl_cx->qos.own, __ATOMIC_RELAXED) * QOS_QUANT;
+    encode_frame->quality = FF_QP2LAMBDA * ((quality > 31) ? 31 : quality);
+    encode_frame->pts = frame_seq;
+
+    AVPacket packet;
+    av_init_packet(&packet);
+    packet.data = NULL;
+    packet.size = 0;
+
+    int got = 0;
+    if (avcodec_encode_video2(encode_cx, &packet, encode_frame, &got) < 0) {
+        ch_error("Failed encoding preview frame.");
+        return (-1);
+    }
+
+    if (!got)
+        return (0);
+
+    // Encode once, every client sends the same copy.
+    struct preview_frame *frame =
+        (struct preview_frame *) malloc(sizeof(*frame));
+    if (frame == NULL || (frame->data = (uint8_t *) malloc(packet.size)) == NULL) {
+        ch_error("Failed to allocate preview frame.");
+        free(frame);
+        av_free_packet(&packet);
+        return (-1);
+    }
+
+    memcpy(frame->data, packet.data, packet.size);
+    frame->length = packet.size;
+    frame->refs = 1;
+
+    av_free_packet(&packet);
+
+    pthread_mutex_lock(&frame_mutex);
+
+    frame->seq = ++frame_seq;
+    frame_release(latest);
+    latest = frame;
+
+    pthread_mutex_unlock(&frame_mutex);
+
+    // Wake the server. A full pipe already has a wakeup pending.
+    char wake = 0;
+    if (write(wake_fd[1], &wake, 1) == -1 && errno != EAGAIN)
+        ch_error_no("Failed to wake preview server.", errno);
+
+    return (0);
+}
+
+int
+CH_DL_QUIT(void)
+{
+    active = false;
+
+    char wake = 0;
+    if (write(wake_fd[1], &wake, 1) == -1 && errno != EAGAIN)
+        ch_error_no("Failed to wake preview server.", errno);
+
+    ch_join_thread(server_thread, NULL);
+
+    size_t idx;
+    for (idx = 0; idx < MAX_CLIENTS; idx++)
+        if (clients[idx].fd != -1)
+            client_close(&clients[idx]);
+
+    close(listen_fd);
+    close(wake_fd[0]);
+    close(wake_fd[1]);
+
+    if (preview_unix)
+        unlink(preview_unix);
+
+    pthread_mutex_lock(&frame_mutex);
+    frame_release(latest);
+    latest = NULL;
+    pthread_mutex_unlock(&frame_mutex);
+
+    if (encode_cx) {
+        avcodec_close(encode_cx);
+        av_free(encode_cx);
+        encode_cx = NULL;
+    }
+
+    av_frame_free(&encode_frame);
+
+    return (0);
+}
@@ -0,0 +1,376 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include <linux/videodev2.h>
+
+#include <chiasm.h>
+
+#define RECORD_BLOCK        (4 << 20) // Smallest write to disk in bytes.
+#define RECORD_BLOCKS       8         // Blocks buffered for the writer.
+#define RECORD_BLOCK_FRAMES 512       // Most frames indexed in one block.
+#define RECORD_ALIGN        4096      // Alignment of block buffers.
+
+const char *record_prefix = "record";     // Path prefix of recorded files.
+uint64_t segment_size = (uint64_t) 1 << 30; // Bytes before starting a new segment.
+
+/**
+ * @brief Index entry of a recorded frame.
+ */
+struct record_entry {
+    uint64_t offset;          /**< Offset of the frame in its segment. */
+    uint32_t length;          /**< Length of the frame. */
+    struct timeval timestamp; /**< Capture time of the frame. */
+};
+
+/**
+ * @brief Block of frames waiting to be written.
+ */
+struct record_block {
+    uint8_t *data;        /**< Aligned frame data. */
+    size_t used;          /**< Bytes of frame data in the block. */
+    uint32_t segment;     /**< Segment the block belongs to. */
+    struct record_entry entries[RECORD_BLOCK_FRAMES]; /**< Frames in block. */
+    uint32_t n_entries;   /**< Number of frames in the block. */
+};
+
+const char *extension;    // Extension of segment files for the stream format.
+bool h264 = false;        // Segments may only start on H.264 parameter sets.
+
+struct record_block blocks[RECORD_BLOCKS];
+size_t block_size;        // Capacity of each block in bytes.
+uint32_t head = 0;        // Next block to write to disk.
+uint32_t tail = 0;        // Block being filled with frames.
+uint32_t full = 0;        // Blocks waiting for the writer.
+
+uint32_t segment = 0;         // Current segment being filled.
+uint64_t segment_bytes = 0;   // Bytes in the current segment.
+uint64_t frames = 0;          // Frames recorded.
+uint64_t dropped = 0;         // Frames dropped because the writer fell behind.
+
+pthread_t writer_thread;
+pthread_mutex_t writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
+volatile bool active = false;
+
+int seg_fd = -1;          // Open segment file.
+FILE *index_file = NULL;  // Open index of the segment.
+uint32_t seg_open = 0;    // Number of the open segment.
+
+/**
+ * @brief Check if an H.264 access unit carries a sequence parameter set, so a
+ *        segment starting with it is decodable on its own.
+ */
+static bool
+h264_keyframe(const uint8_t *data, size_t length)
+{
+    size_t idx;
+    for (idx = 0; idx + 3 < length; idx++) {
+        if (data[idx] != 0 || data[idx + 1] != 0 || data[idx + 2] != 1)
+            continue;
+
+        uint8_t type = data[idx + 3] & 0x1f;
+        if (type == 7 || type == 5)
+            return (true);
+    }
+
+    return (false);
+}
+
+/**
+ * @brief Open the files of a new segment, closing the previous ones.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int
+segment_open(uint32_t number)
+{
+    if (seg_fd != -1)
+        close(seg_fd);
+
+    if (index_file)
+        fclose(index_file);
+
+    seg_fd = -1;
+    index_file = NULL;
+
+    char name[512];
+    snprintf(name, sizeof(name), "%s-%04u.%s", record_prefix, number, extension);
+
+    if ((seg_fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+        ch_error_no("Failed to open recording segment.", errno);
+        return (-1);
+    }
+
+    snprintf(name, sizeof(name), "%s-%04u.idx", record_prefix, number);
+
+    if ((index_file = fopen(name, "w")) == NULL) {
+        ch_error_no("Failed to open recording index.", errno);
+        return (-1);
+    }
+
+    fprintf(index_file, "# frame seconds offset length\n");
+
+    seg_open = number;
+    return (0);
+}
+
+/**
+ * @brief Write a block and its index entries to the open segment.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int
+block_write(struct record_block *block)
+{
+    if (seg_fd == -1 || block->segment != seg_open)
+        if (segment_open(block->segment) == -1)
+            return (-1);
+
+    size_t done = 0;
+    while (done < block->used) {
+        ssize_t r = write(seg_fd, block->data + done, block->used - done);
+        if (r == -1) {
+            if (errno == EINTR)
+                continue;
+
+            ch_error_no("Failed to write recording segment.", errno);
+            return (-1);
+        }
+
+        done += r;
+    }
+
+    static uint64_t frame = 0;
+
+    uint32_t idx;
+    for (idx = 0; idx < block->n_entries; idx++) {
+        struct record_entry *entry = &block->entries[idx];
+        fprintf(index_file, "%" PRIu64 " %ld.%06ld %" PRIu64 " %" PRIu32 "\n",
+                frame++, (long) entry->timestamp.tv_sec,
+                (long) entry->timestamp.tv_usec, entry->offset, entry->length);
+    }
+
+    return (0);
+}
+
+/**
+ * @brief Writer thread. Writes full blocks to disk in order.
+ */
+static void *
+writer_loop(void *arg)
+{
+    arg = (void *) arg;
+
+    bool failed = false;
+
+    pthread_mutex_lock(&writer_mutex);
+
+    while (active || full > 0) {
+        if (full == 0) {
+            pthread_cond_wait(&writer_cond, &writer_mutex);
+            continue;
+        }
+
+        struct record_block *block = &blocks[head];
+        pthread_mutex_unlock(&writer_mutex);
+
+        // Keep draining after a failure so the pipeline keeps running.
+        if (!failed && block_write(block) == -1)
+            failed = true;
+
+        block->used = 0;
+        block->n_entries = 0;
+
+        pthread_mutex_lock(&writer_mutex);
+        head = (head + 1) % RECORD_BLOCKS;
+        full--;
+    }
+
+    pthread_mutex_unlock(&writer_mutex);
+
+    return (NULL);
+}
+
+/**
+ * @brief Hand the block being filled to the writer and move to the next one.
+ *
+ * @return 0 on success, -1 if the writer has no free block.
+ */
+static int
+block_submit(void)
+{
+    pthread_mutex_lock(&writer_mutex);
+
+    if (full + 1 >= RECORD_BLOCKS) {
+        pthread_mutex_unlock(&writer_mutex);
+        return (-1);
+    }
+
+    full++;
+    tail = (tail + 1) % RECORD_BLOCKS;
+
+    pthread_mutex_unlock(&writer_mutex);
+    pthread_cond_signal(&writer_cond);
+
+    return (0);
+}
+
+int
+CH_DL_INIT(struct ch_device *device, struct ch_dl_cx *cx)
+{
+    // Receive the compressed payload straight from the device.
+    cx->passthrough = true;
+    cx->undistort = false;
+
+    switch (device->in_pixfmt) {
+    case V4L2_PIX_FMT_MJPEG:
+        extension = "mjpeg";
+        break;
+
+    case V4L2_PIX_FMT_H264:
+        extension = "h264";
+        h264 = true;
+        break;
+
+    case V4L2_PIX_FMT_YUYV:
+        extension = "yuyv";
+        break;
+
+    default:
+        ch_error("Unsupported format for recording.");
+        return (-1);
+    }
+
+    // Blocks must hold at least one uncompressed frame.
+    block_size = 2 * device->framesize.width * device->framesize.height;
+    if (block_size < RECORD_BLOCK)
+        block_size = RECORD_BLOCK;
+
+    block_size += RECORD_ALIGN - 1;
+    block_size -= block_size % RECORD_ALIGN;
+
+    size_t idx;
+    for (idx = 0; idx < RECORD_BLOCKS; idx++) {
+        void *data;
+        int r;
+        if ((r = posix_memalign(&data, RECORD_ALIGN, block_size)) != 0) {
+            ch_error_no("Failed to allocate recording block.", r);
+            goto clean;
+        }
+
+        blocks[idx].data = (uint8_t *) data;
+        blocks[idx].used = 0;
+        blocks[idx].n_entries = 0;
+        blocks[idx].segment = 0;
+    }
+
+    active = true;
+    if (ch_start_thread(&writer_thread, NULL, writer_loop, NULL) == -1) {
+        active = false;
+        goto clean;
+    }
+
+    return (0);
+
+clean:
+    for (idx = 0; idx < RECORD_BLOCKS; idx++) {
+        free(blocks[idx].data);
+        blocks[idx].data = NULL;
+    }
+
+    return (-1);
+}
+
+int
+CH_DL_CALL(struct ch_frmbuf *in_buf)
+{
+    uint32_t length = in_buf->bytesused;
+
+    if (length == 0)
+        return (0);
+
+    if (length > block_size) {
+        ch_error("Frame is too large to record.");
+        dropped++;
+        return (0);
+    }
+
+    // Start a new segment once full, on a decodable frame for H.264.
+    bool rotate = (segment_bytes > 0 && segment_bytes + length > segment_size
+                   && (!h264 || h264_keyframe(in_buf->start, length)));
+    uint32_t seg = (rotate) ? segment + 1 : segment;
+
+    struct record_block *block = &blocks[tail];
+
+    // Hand off the block if the frame does not fit or it starts a segment.
+    if (block->used > 0
+        && (block->used + length > block_size
+            || block->n_entries == RECORD_BLOCK_FRAMES
+            || block->segment != seg)) {
+        if (block_submit() == -1) {
+            // Writer is behind. Drop the frame rather than stall.
+            dropped++;
+            return (0);
+        }
+
+        block = &blocks[tail];
+    }
+
+    if (rotate) {
+        segment = seg;
+        segment_bytes = 0;
+    }
+
+    if (block->used == 0)
+        block->segment = segment;
+
+    struct record_entry *entry = &block->entries[block->n_entries++];
+    entry->offset = segment_bytes;
+    entry->length = length;
+    entry->timestamp = in_buf->timestamp;
+
+    memcpy(block->data + block->used, in_buf->start, length);
+    block->used += length;
+
+    segment_bytes += length;
+    frames++;
+
+    return (0);
+}
+
+int
+CH_DL_QUIT(void)
+{
+    // Flush the partially filled block.
+    if (blocks[tail].used > 0)
+        while (block_submit() == -1)
+            usleep(1000);
+
+    pthread_mutex_lock(&writer_mutex);
+    active = false;
+    pthread_mutex_unlock(&writer_mutex);
+    pthread_cond_signal(&writer_cond);
+
+    ch_join_thread(writer_thread, NULL);
+
+    if (seg_fd != -1)
+        close(seg_fd);
+
+    if (index_file)
+        fclose(index_file);
+
+    size_t idx;
+    for (idx = 0; idx < RECORD_BLOCKS; idx++)
+        free(blocks[idx].data);
+
+    fprintf(stderr, "Recorded %" PRIu64 " frames in %u segments, "
+            "dropped %" PRIu64 ".\n", frames, segment + 1, dropped);
+
+    return (0);
+}
@@ -0,0 +1,339 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <chiasm.h>
+
+/**
+ * @brief Tasks queued by one worker. The worker runs its newest task, while
+ *        others steal its oldest.
+ */
+struct ch_pool_queue {
+    pthread_mutex_t mutex;
+    struct ch_task  *oldest;
+    struct ch_task  *newest;
+};
+
+static struct ch_pool_queue ch_pool_queues[CH_POOL_MAX];
+static pthread_t ch_pool_threads[CH_POOL_MAX];
+static size_t ch_pool_n = 0;                // Number of workers started.
+static bool ch_pool_active = false;         // Are workers taking tasks?
+
+static uint32_t ch_pool_queued = 0;         // Tasks in every queue.
+static uint32_t ch_pool_sleepers = 0;       // Workers waiting for tasks.
+static uint32_t ch_pool_waiters = 0;        // Threads waiting on groups.
+static uint32_t ch_pool_next = 0;           // Queue for outside submitters.
+
+static pthread_mutex_t ch_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ch_pool_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t ch_pool_done = PTHREAD_COND_INITIALIZER;
+
+static __thread int ch_pool_self = -1;      // Queue of the calling worker.
+
+/**
+ * @brief Should a queued task be taken before another? Tasks holding up a
+ *        thread go first, so a more urgent callback never delays the
+ *        conversions capture is waiting on. Then the more urgent task goes.
+ *
+ * @param a Task to compare.
+ * @param b Task to compare against.
+ * @return True if a should be taken before b.
+ */
+static bool
+ch_pool_before(const struct ch_task *a, const struct ch_task *b)
+{
+    bool a_blocking = a->group && a->group->blocking;
+    bool b_blocking = b->group && b->group->blocking;
+
+    if (a_blocking != b_blocking)
+        return (a_blocking);
+
+    return (ch_task_before(a, b));
+}
+
+/**
+ * @brief Take the most urgent task from a queue.
+ *
+ * @param queue Queue to take from.
+ * @param newest Among equally urgent tasks, take the newest instead of the
+ *               oldest?
+ * @param group Only take tasks of this group, or NULL for any.
+ * @return The task, or NULL if the queue has none to take.
+ */
+static struct ch_task *
+ch_pool_pop(struct ch_pool_queue *queue, bool newest,
+            const struct ch_task_group *group)
+{
+    pthread_mutex_lock(&queue->mutex);
+
+    struct ch_task *task = NULL;
+
+    // Queues are short, so scan rather than keep them ordered.
+    struct ch_task *other;
+    for (other = (newest) ? queue->newest : queue->oldest; other != NULL;
+         other = (newest) ? other->prev : other->next)
+        if ((group == NULL || other->group == group)
+            && (task == NULL || ch_pool_before(other, task)))
+            task = other;
+
+    if (task) {
+        if (task->prev)
+            task->prev->next = task->next;
+        else
+            queue->oldest = task->next;
+
+        if (task->next)
+            task->next->prev = task->prev;
+        else
+            queue->newest = task->prev;
+
+        if (task->group)
+            __atomic_sub_fetch(&task->group->queued, 1, __ATOMIC_SEQ_CST);
+
+        __atomic_sub_fetch(&ch_pool_queued, 1, __ATOMIC_SEQ_CST);
+    }
+
+    pthread_mutex_unlock(&queue->mutex);
+
+    return (task);
+}
+
+/**
+ * @brief Take a task for the calling thread, stealing if its own queue is
+ *        empty.
+ *
+ * @param group Only take tasks of this group, or NULL for any.
+ * @return The task, or NULL if every queue is empty.
+ */
+static struct ch_task *
+ch_pool_take(const struct ch_task_group *group)
+{
+    if (__atomic_load_n((group) ? &group->queued : &ch_pool_queued,
+                        __ATOMIC_SEQ_CST) == 0)
+        return (NULL);
+
+    size_t self = (ch_pool_self >= 0) ? (size_t) ch_pool_self : 0;
+    struct ch_task *task;
+
+    if (ch_pool_self >= 0
+        && (task = ch_pool_pop(&ch_pool_queues[self], true, group)))
+        return (task);
+
+    size_t idx;
+    for (idx = 1; idx <= ch_pool_n; idx++)
+        if ((task = ch_pool_pop(&ch_pool_queues[(self + idx) % ch_pool_n],
+                                false, group)))
+            return (task);
+
+    return (NULL);
+}
+
+/**
+ * @brief Run a task and finish it in its group.
+ *
+ * @param task Task to run.
+ * @return None.
+ */
+static void
+ch_pool_run(struct ch_task *task)
+{
+    // The task may be reused once its group is finished.
+    struct ch_task_group *group = task->group;
+
+    task->fn(task->arg);
+
+    if (group && __atomic_sub_fetch(&group->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+        pthread_mutex_lock(&ch_pool_mutex);
+        pthread_cond_broadcast(&ch_pool_done);
+        pthread_mutex_unlock(&ch_pool_mutex);
+    }
+}
+
+/**
+ * @brief Worker thread. Runs tasks until the pool is stopped and drained.
+ *
+ * @param arg Index of the worker's queue.
+ * @return Always NULL.
+ */
+static void *
+ch_pool_worker(void *arg)
+{
+    ch_pool_self = (int) (size_t) arg;
+
+    char name[16];
+    snprintf(name, sizeof(name), "pool %d", ch_pool_self);
+    ch_trace_name(name);
+
+    while (true) {
+        struct ch_task *task = ch_pool_take(NULL);
+        if (task) {
+            ch_pool_run(task);
+            continue;
+        }
+
+        pthread_mutex_lock(&ch_pool_mutex);
+
+        // Submitters check for sleepers after queueing, so recheck after
+        // announcing to not miss a task.
+        __atomic_add_fetch(&ch_pool_sleepers, 1, __ATOMIC_SEQ_CST);
+
+        while (__atomic_load_n(&ch_pool_queued, __ATOMIC_SEQ_CST) == 0
+               && ch_pool_active)
+            pthread_cond_wait(&ch_pool_work, &ch_pool_mutex);
+
+        __atomic_sub_fetch(&ch_pool_sleepers, 1, __ATOMIC_SEQ_CST);
+
+        bool stop = !ch_pool_active
+            && __atomic_load_n(&ch_pool_queued, __ATOMIC_SEQ_CST) == 0;
+
+        pthread_mutex_unlock(&ch_pool_mutex);
+
+        if (stop)
+            break;
+    }
+
+    ch_cpu_release();
+
+    return (NULL);
+}
+
+int
+ch_start_pool(size_t n_workers)
+{
+    if (ch_pool_n > 0)
+        return (0);
+
+    if (n_workers == 0)
+        n_workers = ch_pool_size();
+
+    if (n_workers > CH_POOL_MAX)
+        n_workers = CH_POOL_MAX;
+
+    size_t idx;
+    for (idx = 0; idx < n_workers; idx++) {
+        pthread_mutex_init(&ch_pool_queues[idx].mutex, NULL);
+        ch_pool_queues[idx].oldest = ch_pool_queues[idx].newest = NULL;
+    }
+
+    ch_pool_active = true;
+
+    for (idx = 0; idx < n_workers; idx++) {
+        if (ch_start_thread(&ch_pool_threads[idx], NULL, ch_pool_worker,
+                            (void *) idx) == -1) {
+            ch_stop_pool();
+            return (-1);
+        }
+
+        ch_pool_n = idx + 1;
+    }
+
+    return (0);
+}
+
+void
+ch_stop_pool(void)
+{
+    pthread_mutex_lock(&ch_pool_mutex);
+    ch_pool_active = false;
+    pthread_cond_broadcast(&ch_pool_work);
+    pthread_mutex_unlock(&ch_pool_mutex);
+
+    size_t idx;
+    for (idx = 0; idx < ch_pool_n; idx++)
+        ch_join_thread(ch_pool_threads[idx], NULL);
+
+    for (idx = 0; idx < ch_pool_n; idx++)
+        pthread_mutex_destroy(&ch_pool_queues[idx].mutex);
+
+    ch_pool_n = 0;
+}
+
+bool
+ch_pool_running(void)
+{
+    return (ch_pool_n > 0);
+}
+
+size_t
+ch_pool_size(void)
+{
+    if (ch_pool_n > 0)
+        return (ch_pool_n);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return ((cpus < 1) ? 1 : (size_t) cpus);
+}
+
+void
+ch_pool_submit(struct ch_task *task)
+{
+    if (task->group)
+        __atomic_add_fetch(&task->group->pending, 1, __ATOMIC_SEQ_CST);
+
+    if (ch_pool_n == 0) {
+        ch_pool_run(task);
+        return;
+    }
+
+    // Workers keep their own tasks, others spread theirs.
+    size_t idx = (ch_pool_self >= 0) ? (size_t) ch_pool_self
+        : __atomic_fetch_add(&ch_pool_next, 1, __ATOMIC_RELAXED) % ch_pool_n;
+
+    struct ch_pool_queue *queue = &ch_pool_queues[idx];
+
+    pthread_mutex_lock(&queue->mutex);
+
+    task->next = NULL;
+    task->prev = queue->newest;
+
+    if (queue->newest)
+        queue->newest->next = task;
+    else
+        queue->oldest = task;
+
+    queue->newest = task;
+
+    if (task->group)
+        __atomic_add_fetch(&task->group->queued, 1, __ATOMIC_SEQ_CST);
+
+    __atomic_add_fetch(&ch_pool_queued, 1, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_unlock(&queue->mutex);
+
+    // Threads waiting on groups help too, in case every worker is waiting.
+    if (__atomic_load_n(&ch_pool_sleepers, __ATOMIC_SEQ_CST) > 0
+        || __atomic_load_n(&ch_pool_waiters, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&ch_pool_mutex);
+        pthread_cond_signal(&ch_pool_work);
+        pthread_cond_broadcast(&ch_pool_done);
+        pthread_mutex_unlock(&ch_pool_mutex);
+    }
+}
+
+void
+ch_pool_wait(struct ch_task_group *group)
+{
+    while (__atomic_load_n(&group->pending, __ATOMIC_SEQ_CST) > 0) {
+        // Help with the group rather than block while it has work queued.
+        // Other tasks are left to the workers, so a waiter is never held up
+        // by unrelated work, such as a plugin callback.
+        struct ch_task *task = ch_pool_take(group);
+        if (task) {
+            ch_pool_run(task);
+            continue;
+        }
+
+        // Every task of the group is running, so wait for one to finish.
+        pthread_mutex_lock(&ch_pool_mutex);
+        __atomic_add_fetch(&ch_pool_waiters, 1, __ATOMIC_SEQ_CST);
+
+        while (__atomic_load_n(&group->pending, __ATOMIC_SEQ_CST) > 0
+               && __atomic_load_n(&group->queued, __ATOMIC_SEQ_CST) == 0)
+            pthread_cond_wait(&ch_pool_done, &ch_pool_mutex);
+
+        __atomic_sub_fetch(&ch_pool_waiters, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&ch_pool_mutex);
+    }
+}
@@ -0,0 +1,149 @@
+#include <stdlib.h>
+#include <math.h>
+#include <pthread.h>
+
+#include <chiasm.h>
+
+/**
+ * @brief Get the number of output scale steps a plugin allows.
+ *
+ * @param device Device the plugin is associated with.
+ * @param cx Context of the plugin.
+ * @return Number of steps.
+ */
+static uint32_t
+ch_qos_scales(const struct ch_device *device, const struct ch_dl_cx *cx)
+{
+    // Undistorted and passed through frames are not scaled.
+    if (cx->passthrough || (cx->undistort && device->calib)
+        || cx->qos.scale_min <= 0.0)
+        return (0);
+
+    uint32_t steps = 0;
+    double scale = CH_QOS_SCALE_STEP;
+
+    for (; scale >= cx->qos.scale_min; scale *= CH_QOS_SCALE_STEP)
+        steps++;
+
+    return (steps);
+}
+
+/**
+ * @brief Get the lowest quality step of a plugin.
+ */
+static uint32_t
+ch_qos_max(const struct ch_device *device, const struct ch_dl_cx *cx)
+{
+    return (ch_qos_scales(device, cx) + cx->qos.levels + cx->qos.skip_max);
+}
+
+/**
+ * @brief Set the quality of a plugin from its step.
+ *
+ * @param device Device the plugin is associated with.
+ * @param cx Context of the plugin.
+ * @return None.
+ */
+static void
+ch_qos_apply(const struct ch_device *device, struct ch_dl_cx *cx)
+{
+    uint32_t level = cx->qos.level;
+
+    uint32_t scales = ch_qos_scales(device, cx);
+    if (scales > level)
+        scales = level;
+
+    level -= scales;
+
+    uint32_t own = cx->qos.levels;
+    if (own > level)
+        own = level;
+
+    level -= own;
+
+    pthread_mutex_lock(&cx->mutex);
+    cx->qos.scale = pow(CH_QOS_SCALE_STEP, scales);
+    pthread_mutex_unlock(&cx->mutex);
+
+    __atomic_store_n(&cx->qos.own, own, __ATOMIC_RELAXED);
+    cx->qos.skip = level;
+}
+
+void
+ch_qos_update(struct ch_device *device, struct ch_dl **plugins,
+              size_t n_plugins)
+{
+    if (device->qos.target <= 0.0 || ++device->qos.settle < CH_QOS_SETTLE)
+        return;
+
+    // End-to-end latency is that of the slowest plugin.
+    double latency = 0.0;
+
+    size_t idx;
+    for (idx = 0; idx < n_plugins; idx++) {
+        double plugin_latency = __atomic_load_n(&plugins[idx]->cx.qos.latency_ns,
+                                                __ATOMIC_RELAXED) / 1e9;
+        if (plugin_latency > latency)
+            latency = plugin_latency;
+    }
+
+    struct ch_dl_cx *step = NULL;
+
+    if (latency > device->qos.target) {
+        // Step down the least urgent plugin with room left.
+        for (idx = 0; idx < n_plugins; idx++) {
+            struct ch_dl_cx *cx = &plugins[idx]->cx;
+
+            if (cx->qos.level < ch_qos_max(device, cx)
+                && (step == NULL || cx->priority < step->priority))
+                step = cx;
+        }
+
+        if (step)
+            step->qos.level++;
+
+    } else if (latency < CH_QOS_HEADROOM * device->qos.target) {
+        // Step up the most urgent degraded plugin.
+        for (idx = 0; idx < n_plugins; idx++) {
+            struct ch_dl_cx *cx = &plugins[idx]->cx;
+
+            if (cx->qos.level > 0
+                && (step == NULL || cx->priority > step->priority))
+                step = cx;
+        }
+
+        if (step)
+            step->qos.level--;
+    }
+
+    if (step == NULL)
+        return;
+
+    ch_qos_apply(device, step);
+    device->qos.settle = 0;
+}
+
+void
+ch_qos_record(struct ch_dl_cx *cx, double latency)
+{
+    double average = __atomic_load_n(&cx->qos.latency_ns,
+                                     __ATOMIC_RELAXED) / 1e9;
+
+    average = (average > 0.0)
+        ? (1.0 - CH_QOS_EWMA) * average + CH_QOS_EWMA * latency : latency;
+
+    __atomic_store_n(&cx->qos.latency_ns, (uint64_t) (average * 1e9),
+                     __ATOMIC_RELAXED);
+}
+
+bool
+ch_qos_skip(struct ch_dl_cx *cx)
+{
+    if (cx->qos.skip == 0 || cx->qos.skipped >= cx->qos.skip) {
+        cx->qos.skipped = 0;
+        return (false);
+    }
+
+    cx->qos.skipped++;
+    return (true);
+}
@@ -0,0 +1,153 @@
+#define _GNU_SOURCE // CPU affinity.
+
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <malloc.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+
+#include <chiasm.h>
+
+/**
+ * @brief Parse a list of CPUs and ranges into a mask.
+ *
+ * @param str String to parse, ending at ':' or the end.
+ * @param cpus Mask to fill in.
+ * @return Pointer past the list, or NULL on failure.
+ */
+static const char *
+ch_parse_cpus(const char *str, uint64_t *cpus)
+{
+    *cpus = 0;
+
+    while (*str != '\0' && *str != ':') {
+        char *end;
+        unsigned long first = strtoul(str, &end, 10);
+        unsigned long last = first;
+
+        if (end == str)
+            return (NULL);
+
+        if (*end == '-') {
+            str = end + 1;
+            last = strtoul(str, &end, 10);
+
+            if (end == str)
+                return (NULL);
+        }
+
+        if (first > last || last >= 64)
+            return (NULL);
+
+        for (; first <= last; first++)
+            *cpus |= 1ull << first;
+
+        str = end;
+        if (*str == ',')
+            str++;
+        else if (*str != '\0' && *str != ':')
+            return (NULL);
+    }
+
+    return (str);
+}
+
+int
+ch_parse_rt(const char *str, struct ch_rt *rt)
+{
+    const char *end = ch_parse_cpus(str, &rt->cpus);
+    if (end == NULL) {
+        ch_error("Failed to parse CPU list.");
+        return (-1);
+    }
+
+    rt->priority = 0;
+    if (*end == '\0')
+        return (0);
+
+    char *prio_end;
+    long priority = strtol(end + 1, &prio_end, 10);
+
+    if (prio_end == end + 1 || *prio_end != '\0'
+        || priority < sched_get_priority_min(SCHED_FIFO)
+        || priority > sched_get_priority_max(SCHED_FIFO)) {
+        ch_error("Invalid SCHED_FIFO priority.");
+        return (-1);
+    }
+
+    rt->priority = (int) priority;
+
+    return (0);
+}
+
+int
+ch_rt_apply(const struct ch_rt *rt)
+{
+    int r;
+
+    if (rt->cpus) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+
+        size_t cpu;
+        for (cpu = 0; cpu < 64; cpu++)
+            if (rt->cpus & (1ull << cpu))
+                CPU_SET(cpu, &set);
+
+        if ((r = pthread_setaffinity_np(pthread_self(), sizeof(set),
+                                        &set)) != 0) {
+            ch_error_no("Failed to set CPU affinity.", r);
+            return (-1);
+        }
+    }
+
+    if (rt->priority > 0) {
+        struct sched_param param;
+        param.sched_priority = rt->priority;
+
+        if ((r = pthread_setschedparam(pthread_self(), SCHED_FIFO,
+                                       &param)) != 0) {
+            ch_error_no("Failed to set SCHED_FIFO priority.", r);
+            return (-1);
+        }
+    }
+
+    return (0);
+}
+
+/**
+ * @brief Touch the stack of the calling thread, so it is mapped before it
+ *        is needed.
+ */
+static void
+ch_rt_prefault_stack(void)
+{
+    volatile uint8_t stack[CH_RT_STACK];
+    long page = sysconf(_SC_PAGESIZE);
+
+    size_t idx;
+    for (idx = 0; idx < CH_RT_STACK; idx += (size_t) page)
+        stack[idx] = 0;
+
+    (void) stack[0];
+}
+
+int
+ch_rt_lock_memory(void)
+{
+    // Keep freed memory in the heap, and the heap out of separate mappings.
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+        ch_error_no("Failed to lock memory.", errno);
+        return (-1);
+    }
+
+    ch_rt_prefault_stack();
+
+    return (0);
+}
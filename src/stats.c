@@ -0,0 +1,280 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <chiasm.h>
+
+#define CH_HIST_SUB (1ull << CH_HIST_SUB_BITS)
+
+// Names of stages, indexed by enum ch_stage.
+static const char *ch_stage_names[CH_STAGE_NUM] = {
+    "wait", "dequeue", "decode", "convert", "undistort", "callback", "latency",
+    "cpu"
+};
+
+const char *
+ch_stage_name(enum ch_stage stage)
+{
+    return ((stage < CH_STAGE_NUM) ? ch_stage_names[stage] : "unknown");
+}
+
+uint64_t
+ch_stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ((uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec);
+}
+
+/**
+ * @brief Get the bucket of a value. Values below CH_HIST_SUB have a bucket
+ *        each, larger values share CH_HIST_SUB buckets per power of two.
+ */
+static inline size_t
+ch_hist_bin(uint64_t ns)
+{
+    if (ns < CH_HIST_SUB)
+        return (ns);
+
+    if (ns >= (1ull << CH_HIST_MAX_BITS))
+        ns = (1ull << CH_HIST_MAX_BITS) - 1;
+
+    uint32_t shift = 63 - __builtin_clzll(ns) - CH_HIST_SUB_BITS;
+    return (((shift + 1) << CH_HIST_SUB_BITS) + (ns >> shift) - CH_HIST_SUB);
+}
+
+/**
+ * @brief Get the largest value of a bucket.
+ */
+static inline uint64_t
+ch_hist_value(size_t bin)
+{
+    if (bin < CH_HIST_SUB)
+        return (bin);
+
+    uint32_t shift = (bin >> CH_HIST_SUB_BITS) - 1;
+    uint64_t low = (CH_HIST_SUB + (bin & (CH_HIST_SUB - 1))) << shift;
+
+    return (low + (1ull << shift) - 1);
+}
+
+void
+ch_hist_record(struct ch_hist *hist, uint64_t ns)
+{
+    // Single writer, so relaxed stores keep concurrent readers consistent
+    // enough without locked instructions.
+    size_t bin = ch_hist_bin(ns);
+
+    __atomic_store_n(&hist->bins[bin], hist->bins[bin] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&hist->count, hist->count + 1, __ATOMIC_RELAXED);
+
+    if (ns > hist->max)
+        __atomic_store_n(&hist->max, ns, __ATOMIC_RELAXED);
+}
+
+void
+ch_stage_record(struct ch_hist *stats, enum ch_stage stage, uint64_t frame,
+                uint64_t t0, uint64_t t1)
+{
+    if (stats)
+        ch_hist_record(&stats[stage], t1 - t0);
+
+    ch_trace_event(stage, frame, t0, t1);
+}
+
+uint64_t
+ch_hist_percentile(const struct ch_hist *hist, double p)
+{
+    uint64_t count = __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+
+    if (count == 0)
+        return (0);
+
+    uint64_t rank = (uint64_t) (p / 100.0 * count + 0.5);
+    if (rank < 1)
+        rank = 1;
+
+    uint64_t seen = 0;
+
+    size_t bin;
+    for (bin = 0; bin < CH_HIST_BINS; bin++) {
+        seen += __atomic_load_n(&hist->bins[bin], __ATOMIC_RELAXED);
+        if (seen >= rank)
+            break;
+    }
+
+    uint64_t value = ch_hist_value(bin);
+    return ((value < max) ? value : max);
+}
+
+int
+ch_init_stats(struct ch_device *device, struct ch_dl **plugins,
+              size_t n_plugins)
+{
+    device->stats = (struct ch_hist *)
+        ch_calloc(CH_STAGE_NUM, sizeof(struct ch_hist));
+    device->mon = (struct ch_mon_counters *)
+        ch_calloc(1, sizeof(struct ch_mon_counters));
+
+    if (device->stats == NULL || device->mon == NULL) {
+        ch_destroy_stats(device, plugins, 0);
+        return (-1);
+    }
+
+    size_t idx;
+    for (idx = 0; idx < n_plugins; idx++) {
+        plugins[idx]->cx.stats = (struct ch_hist *)
+            ch_calloc(CH_STAGE_NUM, sizeof(struct ch_hist));
+        plugins[idx]->cx.mon = (struct ch_mon_counters *)
+            ch_calloc(1, sizeof(struct ch_mon_counters));
+
+        if (plugins[idx]->cx.stats == NULL || plugins[idx]->cx.mon == NULL) {
+            ch_destroy_stats(device, plugins, idx + 1);
+            return (-1);
+        }
+    }
+
+    return (0);
+}
+
+/**
+ * @brief Print a line for each stage timed in an array of histograms.
+ */
+static void
+ch_print_hists(FILE *file, const char *name, const struct ch_hist *hists)
+{
+    size_t idx;
+    for (idx = 0; idx < CH_STAGE_NUM; idx++) {
+        const struct ch_hist *hist = &hists[idx];
+        uint64_t count = __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+
+        if (count == 0)
+            continue;
+
+        fprintf(file, "%-20s %-10s %10llu %10.1f %10.1f %10.1f\n",
+                name, ch_stage_names[idx], (unsigned long long) count,
+                ch_hist_percentile(hist, 50.0) / 1e3,
+                ch_hist_percentile(hist, 99.0) / 1e3,
+                __atomic_load_n(&hist->max, __ATOMIC_RELAXED) / 1e3);
+    }
+}
+
+/**
+ * @brief Print a line with the average CPU cost per frame from counters.
+ */
+static void
+ch_print_cpu(FILE *file, const char *name, const struct ch_hist *hists,
+             const struct ch_mon_counters *mon)
+{
+    uint64_t frames = __atomic_load_n(&hists[CH_STAGE_CPU].count,
+                                      __ATOMIC_RELAXED);
+    if (mon == NULL || frames == 0)
+        return;
+
+    double cpu = __atomic_load_n(&mon->cpu_ns, __ATOMIC_RELAXED) / 1e3 / frames;
+    fprintf(file, "%-20s %12.1f", name, cpu);
+
+    uint64_t samples = __atomic_load_n(&mon->perf_samples, __ATOMIC_RELAXED);
+    if (samples > 0) {
+        double cycles = __atomic_load_n(&mon->cycles, __ATOMIC_RELAXED);
+        double instructions = __atomic_load_n(&mon->instructions,
+                                              __ATOMIC_RELAXED);
+        double misses = __atomic_load_n(&mon->cache_misses, __ATOMIC_RELAXED);
+
+        fprintf(file, " %12.0f %12.0f %6.2f %12.0f",
+                cycles / samples, instructions / samples,
+                (cycles > 0) ? instructions / cycles : 0.0, misses / samples);
+    }
+
+    fprintf(file, "\n");
+}
+
+/**
+ * @brief Get the name of a plugin for reports, its filename.
+ */
+static const char *
+ch_stats_plugin_name(const struct ch_dl *plugin)
+{
+    const char *name = (plugin->name) ? plugin->name : "plugin";
+    const char *base = strrchr(name, '/');
+
+    return ((base) ? base + 1 : name);
+}
+
+void
+ch_print_stats(FILE *file, struct ch_device *device,
+               struct ch_dl **plugins, size_t n_plugins)
+{
+    fprintf(file, "%-20s %-10s %10s %10s %10s %10s\n",
+            "source", "stage", "count", "p50 (us)", "p99 (us)", "max (us)");
+
+    if (device->stats)
+        ch_print_hists(file, "device", device->stats);
+
+    size_t idx;
+    for (idx = 0; idx < n_plugins; idx++)
+        if (plugins[idx]->cx.stats)
+            ch_print_hists(file, ch_stats_plugin_name(plugins[idx]),
+                           plugins[idx]->cx.stats);
+
+    // Average cost per frame, with hardware events if counted.
+    fprintf(file, "%-20s %12s %12s %12s %6s %12s\n", "source", "cpu (us)",
+            "cycles", "instructions", "ipc", "cache misses");
+
+    if (device->stats)
+        ch_print_cpu(file, "device", device->stats, device->mon);
+
+    for (idx = 0; idx < n_plugins; idx++)
+        if (plugins[idx]->cx.stats)
+            ch_print_cpu(file, ch_stats_plugin_name(plugins[idx]),
+                         plugins[idx]->cx.stats, plugins[idx]->cx.mon);
+
+    // Deadlines kept, frames shed and quality steps, for plugins that are
+    // scheduled.
+    bool scheduled = false;
+    for (idx = 0; idx < n_plugins; idx++) {
+        const struct ch_dl_cx *cx = &plugins[idx]->cx;
+
+        if (cx->priority == 0 && cx->deadline <= 0.0 && cx->shed == 0
+            && device->qos.target <= 0.0)
+            continue;
+
+        if (!scheduled)
+            fprintf(file, "%-20s %8s %13s %10s %10s %6s\n", "source",
+                    "priority", "deadline (ms)", "late", "shed", "qos");
+
+        scheduled = true;
+
+        fprintf(file, "%-20s %8d %13.1f %10llu %10llu %6u\n",
+                ch_stats_plugin_name(plugins[idx]), cx->priority,
+                cx->deadline * 1e3,
+                (unsigned long long) __atomic_load_n(&cx->late,
+                                                     __ATOMIC_RELAXED),
+                (unsigned long long) __atomic_load_n(&cx->shed,
+                                                     __ATOMIC_RELAXED),
+                cx->qos.level);
+    }
+
+    fflush(file);
+}
+
+void
+ch_destroy_stats(struct ch_device *device, struct ch_dl **plugins,
+                 size_t n_plugins)
+{
+    free(device->stats);
+    free(device->mon);
+    device->stats = NULL;
+    device->mon = NULL;
+
+    size_t idx;
+    for (idx = 0; idx < n_plugins; idx++) {
+        free(plugins[idx]->cx.stats);
+        free(plugins[idx]->cx.mon);
+        plugins[idx]->cx.stats = NULL;
+        plugins[idx]->cx.mon = NULL;
+    }
+}
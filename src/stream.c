@@ -5,6 +5,7 @@
 #include <errno.h>
 #include <string.h>
 #include <signal.h>
+#include <pthread.h>
 
 #include <linux/videodev2.h>
 #include <chiasm.h>
@@ -15,6 +16,71 @@ struct ch_device device;
 struct ch_dl *plugins[MAX_PLUGINS];
 size_t plugin_max = 0;
 
+bool stats = false;              // Time pipeline stages?
+double stats_interval = 0.0;     // Seconds between stats reports, 0 for exit only.
+pthread_t stats_thread;
+pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t stats_cond = PTHREAD_COND_INITIALIZER;
+bool stats_running = false;
+
+bool perf = false;               // Count hardware events per frame?
+char *trace_file = NULL;         // Filename of Chrome trace to write, if any.
+
+struct ch_monitor monitor;       // Counters published for ch_top.
+char *monitor_name = NULL;       // Name of the segment, NULL for the default.
+
+bool lock_memory = false;        // Lock the process in memory?
+long pool_workers = 0;           // Size of the worker pool, 0 for none.
+
+bool count_allocs = false;       // Count heap allocations for plugins?
+uint64_t allocs = 0;             // Allocations counted, from every thread.
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+void *
+malloc(size_t size)
+{
+    if (count_allocs)
+        __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+
+    return (__libc_malloc(size));
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+    if (count_allocs)
+        __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+
+    return (__libc_calloc(nmemb, size));
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+    if (count_allocs)
+        __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+
+    return (__libc_realloc(ptr, size));
+}
+
+int
+posix_memalign(void **ptr, size_t alignment, size_t size)
+{
+    if (count_allocs)
+        __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+
+    void *p = __libc_memalign(alignment, size);
+    if (p == NULL)
+        return (ENOMEM);
+
+    *ptr = p;
+    return (0);
+}
+
 /**
  * @brief Signal handler to gracefully shutdown in the case of an interrupt.
  *
@@ -30,6 +96,35 @@ signal_handler(int signal)
     device.stream = false;
 }
 
+/**
+ * @brief Thread printing stage statistics periodically while streaming.
+ *
+ * @return Always NULL.
+ */
+static void *
+stats_loop(void *arg)
+{
+    arg = (void *) arg;
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    double due = ch_timespec_to_sec(now);
+
+    pthread_mutex_lock(&stats_mutex);
+
+    while (stats_running) {
+        due += stats_interval;
+        struct timespec ts = ch_sec_to_timespec(due);
+
+        if (pthread_cond_timedwait(&stats_cond, &stats_mutex, &ts) == ETIMEDOUT)
+            ch_print_stats(stderr, &device, plugins, plugin_max);
+    }
+
+    pthread_mutex_unlock(&stats_mutex);
+
+    return (NULL);
+}
+
 /**
  * @brief List the available formats and their resolutions for a device.
  *
@@ -87,6 +182,11 @@ main(int argc, char *argv[])
 {
     bool list = false;
     char *calibration_file = NULL;
+    char *journal_file = NULL;
+    bool realtime = true;
+    struct ch_journal journal;
+    struct ch_rect rect_size, *rect_size_p = NULL;
+    struct ch_roi rect_roi, *rect_roi_p = NULL;
 
     // Enable error output to stderr.
     ch_set_stderr(true);
@@ -94,7 +194,7 @@ main(int argc, char *argv[])
     ch_init_device(&device);
 
     int opt;
-    while ((opt = getopt(argc, argv, CH_OPTS "c:i:n:lh?")) != -1) {
+    while ((opt = getopt(argc, argv, CH_OPTS "c:r:R:j:J:S:PT:m:A:a:D:o:LMW:Q:i:n:lh?")) != -1) {
         switch (opt) {
         case 'd':
         case 't':
@@ -110,6 +210,116 @@ main(int argc, char *argv[])
             calibration_file = optarg;
             break;
 
+        case 'r':
+            if (sscanf(optarg, "%ux%u",
+                       &rect_size.width, &rect_size.height) != 2) {
+                fprintf(stderr, "Error parsing rectified geometry string.\n");
+                return (-1);
+            }
+
+            rect_size_p = &rect_size;
+            break;
+
+        case 'R':
+            if (sscanf(optarg, "%u,%u,%ux%u", &rect_roi.x, &rect_roi.y,
+                       &rect_roi.size.width, &rect_roi.size.height) != 4) {
+                fprintf(stderr, "Error parsing rectified region string.\n");
+                return (-1);
+            }
+
+            rect_roi_p = &rect_roi;
+            break;
+
+        case 'j':
+        case 'J':
+            journal_file = optarg;
+            realtime = (opt == 'j');
+            break;
+
+        case 'S':
+            stats = true;
+            stats_interval = atof(optarg);
+            break;
+
+        case 'P':
+            perf = true;
+            break;
+
+        case 'T':
+            trace_file = optarg;
+            break;
+
+        case 'm':
+            monitor_name = optarg;
+            break;
+
+        case 'A':
+            if (ch_parse_rt(optarg, &device.rt) == -1)
+                return (-1);
+
+            break;
+
+        case 'a':
+            if (plugin_max == 0) {
+                fprintf(stderr, "-a must follow the -i it applies to.\n");
+                return (-1);
+            }
+
+            if (ch_parse_rt(optarg, &plugins[plugin_max - 1]->cx.rt) == -1)
+                return (-1);
+
+            break;
+
+        case 'D':
+            if (plugin_max == 0) {
+                fprintf(stderr, "-D must follow the -i it applies to.\n");
+                return (-1);
+            }
+
+            plugins[plugin_max - 1]->cx.deadline = atof(optarg) / 1e3;
+            if (plugins[plugin_max - 1]->cx.deadline <= 0.0) {
+                fprintf(stderr, "Invalid deadline.\n");
+                return (-1);
+            }
+
+            break;
+
+        case 'o':
+            if (plugin_max == 0) {
+                fprintf(stderr, "-o must follow the -i it applies to.\n");
+                return (-1);
+            }
+
+            plugins[plugin_max - 1]->cx.options = optarg;
+            break;
+
+        case 'L':
+            lock_memory = true;
+            break;
+
+        case 'M':
+            count_allocs = true;
+            ch_set_alloc_counter(&allocs);
+            break;
+
+        case 'Q':
+            device.qos.target = atof(optarg) / 1e3;
+            if (device.qos.target <= 0.0) {
+                fprintf(stderr, "Invalid latency target.\n");
+                return (-1);
+            }
+
+            break;
+
+        case 'W':
+            pool_workers = atol(optarg);
+            if (pool_workers < 0) {
+                fprintf(stderr, "Invalid number of pool workers.\n");
+                return (-1);
+            }
+
+            break;
+
         case 'l':
             list = true;
             break;
@@ -133,6 +343,31 @@ main(int argc, char *argv[])
 		CH_HELP_G
 		CH_HELP_B
 		CH_HELP_T
+		" -c   Filename of camera calibration to load.\n"
+		" -r   Rectified output geometry in <w>x<h> format. Region size by default.\n"
+		" -R   Rectified region in <x>,<y>,<w>x<h> format. Full frame by default.\n"
+		" -j   Filename of frame journal to replay instead of the device.\n"
+		" -J   Same as -j, but replay as fast as possible.\n"
+		" -S   Print stage latencies every <s> seconds, 0 for only on exit.\n"
+		" -P   Count cycles, instructions and cache misses per frame.\n"
+		" -T   Filename to write a Chrome trace of stage events to on exit.\n"
+		" -m   Name of the shared-memory segment watched by ch_top.\n"
+		"      " CH_MON_PREFIX "<pid> by default.\n"
+		" -A   Scheduling of the capture thread in <cpus>[:<priority>] format,\n"
+		"      e.g. 2 or 2-3:80. A priority runs it under SCHED_FIFO.\n"
+		" -a   Scheduling of the plugin loaded by the preceding -i, as for -A.\n"
+		" -D   Deadline in milliseconds from capture for the plugin loaded by\n"
+		"      the preceding -i. Plugins may pick their own by default.\n"
+		" -o   Comma-separated options for the plugin loaded by the preceding\n"
+		"      -i. throughput makes apriltag detect frames concurrently on the\n"
+		"      pool, without tracking.\n"
+		" -L   Lock memory and fault in buffers before streaming.\n"
+		" -M   Count heap allocations, reported per frame on exit by plugins\n"
+		"      that support it, e.g. apriltag.\n"
+		" -Q   Latency target in milliseconds from capture to the end of every\n"
+		"      callback. Plugins are scaled down within their bounds to hold it.\n"
+		" -W   Threads in a pool running plugins and conversions. By default,\n"
+		"      each plugin runs in its own thread.\n"
 		" -i   Filename of chiasm plugin to load. Required.\n"
                 " -l   List formats, resolutions, framerates and exit.\n"
                 " -?,h Show this help.\n",
@@ -146,25 +381,106 @@ main(int argc, char *argv[])
     // Install signal handlers to clean up and exit nicely.
     signal(SIGINT, signal_handler);
 
+    // Keep errors raised while streaming off the capture and plugin threads.
+    if (ch_start_logger() == -1)
+        fprintf(stderr, "Writing errors synchronously.\n");
+
     int r = 0;
-    if ((r = ch_open_device(&device)) == -1)
-        goto cleanup;
+    journal.fd = -1;
+    journal.map = NULL;
+    monitor.fd = -1;
+    monitor.block = NULL;
+
+    // A journal replaces the device and sets its format.
+    if (journal_file) {
+        if ((r = ch_open_journal(&journal, journal_file, &device)) == -1)
+            goto cleanup;
 
-    if (list) {
-        r = list_formats();
-        goto cleanup;
-    }
+    } else {
+        if ((r = ch_open_device(&device)) == -1)
+            goto cleanup;
 
-    if ((r = ch_set_fmt(&device)) == -1)
-        goto cleanup;
+        if (list) {
+            r = list_formats();
+            goto cleanup;
+        }
+
+        if ((r = ch_set_fmt(&device)) == -1)
+            goto cleanup;
+    }
 
     if (calibration_file)
-        if (ch_load_calibration(&device, calibration_file) == -1)
+        if (ch_load_calibration(&device, calibration_file,
+                                rect_size_p, rect_roi_p) == -1)
+            goto cleanup;
+
+    // Monitoring is best effort, and times stages into the segment.
+    if (ch_open_monitor(&monitor, monitor_name, &device,
+                        plugins, plugin_max) == -1)
+        fprintf(stderr, "Continuing without monitoring.\n");
+
+    if (stats) {
+        if (device.stats == NULL
+            && (r = ch_init_stats(&device, plugins, plugin_max)) == -1)
+            goto cleanup;
+
+        if (stats_interval > 0.0) {
+            stats_running = true;
+            if ((r = ch_start_thread(&stats_thread, NULL,
+                                     stats_loop, NULL)) == -1) {
+                stats_running = false;
+                goto cleanup;
+            }
+        }
+    }
+
+    // Counters are reported with stage latencies and in ch_top.
+    if (perf && ch_cpu_enable_perf() == -1)
+        fprintf(stderr, "Continuing without hardware counters.\n");
+
+    if (trace_file)
+        if ((r = ch_trace_start(CH_TRACE_EVENTS)) == -1)
+            goto cleanup;
+
+    // A journal is mapped whole, so locking would pull in the entire file.
+    if (lock_memory) {
+        if (journal_file) {
+            fprintf(stderr, "Memory is not locked when replaying a journal.\n");
+        } else if ((r = ch_rt_lock_memory()) == -1) {
             goto cleanup;
+        }
+    }
 
-    r = ch_stream(&device, plugins, plugin_max);
+    // Plugins share the pool rather than each starting a thread.
+    if (pool_workers > 0 && (r = ch_start_pool(pool_workers)) == -1)
+        goto cleanup;
+
+    if (journal_file)
+        r = ch_replay_journal(&device, &journal, realtime, plugins, plugin_max);
+    else
+        r = ch_stream(&device, plugins, plugin_max);
+
+    if (stats_running) {
+        pthread_mutex_lock(&stats_mutex);
+        stats_running = false;
+        pthread_cond_signal(&stats_cond);
+        pthread_mutex_unlock(&stats_mutex);
+
+        ch_join_thread(stats_thread, NULL);
+    }
+
+    if (stats)
+        ch_print_stats(stderr, &device, plugins, plugin_max);
+
+    if (trace_file && ch_trace_dump(trace_file) == -1)
+        r = -1;
 
 cleanup:
+    ch_stop_pool();
+    ch_trace_stop();
+    ch_close_monitor(&monitor, &device, plugins, plugin_max);
+    ch_destroy_stats(&device, plugins, plugin_max);
+    ch_close_journal(&journal);
     ch_close_calibration(&device);
     ch_close_device(&device);
 
@@ -172,5 +488,8 @@ cleanup:
     for (idx = 0; idx < plugin_max; idx++)
         ch_dl_close(plugins[idx]);
 
+    // Plugin threads are joined, so nothing posts anymore.
+    ch_stop_logger();
+
     return (r);
 }
@@ -0,0 +1,370 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libswscale/swscale.h>
+
+#include <linux/videodev2.h>
+
+#include <chiasm.h>
+
+#define CH_SYNTH_FRAMES 16 // Distinct frames generated and cycled through.
+#define CH_SYNTH_BARS   8  // Number of color bars in the pattern.
+
+/**
+ * @brief State of a synthetic source.
+ */
+struct ch_synth_cx {
+    struct ch_frmbuf frames[CH_SYNTH_FRAMES]; /**< Generated frames. */
+    uint32_t         n_frames; /**< Number of generated frames. */
+    uint32_t         next;     /**< Next frame to return. */
+    struct timespec  due;      /**< Time the next frame is due. */
+};
+
+// Color bars in YUV: white, yellow, cyan, green, magenta, red, blue, black.
+static const uint8_t ch_synth_bars[CH_SYNTH_BARS][3] = {
+    {235, 128, 128}, {210,  16, 146}, {170, 166,  16}, {145,  54,  34},
+    {106, 202, 222}, { 81,  90, 240}, { 41, 240, 110}, { 16, 128, 128}
+};
+
+/**
+ * @brief Render a frame of the pattern in YUYV: color bars with a white box
+ *        moving diagonally, so each frame differs.
+ *
+ * @param device Device with the framesize.
+ * @param frame Index of the frame in the cycle.
+ * @param buf Buffer of 2 * width * height bytes to fill.
+ * @return None.
+ */
+static void
+ch_synth_render(struct ch_device *device, uint32_t frame, uint8_t *buf)
+{
+    uint32_t w = device->framesize.width;
+    uint32_t h = device->framesize.height;
+
+    uint32_t box = h / 4;
+    uint32_t bx = (w - box) * frame / CH_SYNTH_FRAMES;
+    uint32_t by = (h - box) * frame / CH_SYNTH_FRAMES;
+
+    uint32_t y;
+    for (y = 0; y < h; y++) {
+        uint8_t *row = buf + 2 * w * y;
+
+        uint32_t x;
+        for (x = 0; x + 1 < w; x += 2) {
+            const uint8_t *c = ch_synth_bars[x * CH_SYNTH_BARS / w];
+            uint8_t luma = c[0];
+            uint8_t u = c[1], v = c[2];
+
+            if (x >= bx && x < bx + box && y >= by && y < by + box) {
+                luma = 235;
+                u = v = 128;
+            }
+
+            row[2 * x + 0] = luma;
+            row[2 * x + 1] = u;
+            row[2 * x + 2] = luma;
+            row[2 * x + 3] = v;
+        }
+    }
+}
+
+/**
+ * @brief Add a generated frame to the cycle.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int
+ch_synth_add(struct ch_synth_cx *cx, const uint8_t *data, uint32_t length)
+{
+    struct ch_frmbuf *buf = &cx->frames[cx->n_frames];
+
+    buf->start = (uint8_t *) ch_calloc(length, sizeof(uint8_t));
+    if (buf->start == NULL)
+        return (-1);
+
+    memcpy(buf->start, data, length);
+    buf->length = buf->bytesused = length;
+
+    cx->n_frames++;
+    return (0);
+}
+
+/**
+ * @brief Encode the rendered pattern frames into the device's compressed
+ *        format. H.264 frames form a single group of pictures, so the cycle
+ *        restarts on a keyframe.
+ *
+ * @param device Device to encode for.
+ * @param cx Synthetic source to fill with encoded frames.
+ * @param raw Rendered YUYV frames.
+ * @return 0 on success, -1 on failure.
+ */
+static int
+ch_synth_encode(struct ch_device *device, struct ch_synth_cx *cx,
+                uint8_t *raw[CH_SYNTH_FRAMES])
+{
+    enum AVCodecID codec_id = AV_CODEC_ID_MJPEG;
+    enum AVPixelFormat pixfmt = AV_PIX_FMT_YUVJ422P;
+
+    if (device->in_pixfmt == V4L2_PIX_FMT_H264) {
+        codec_id = AV_CODEC_ID_H264;
+        pixfmt = AV_PIX_FMT_YUV420P;
+    }
+
+    uint32_t w = device->framesize.width;
+    uint32_t h = device->framesize.height;
+
+    int r = -1;
+    AVCodecContext *codec_cx = NULL;
+    AVFrame *frame = NULL;
+    uint8_t *planes = NULL;
+    struct SwsContext *sws_cx = NULL;
+
+    AVCodec *codec = avcodec_find_encoder(codec_id);
+    if (codec == NULL) {
+        ch_error("Failed to find encoder for synthetic source.");
+        return (-1);
+    }
+
+    if ((codec_cx = avcodec_alloc_context3(codec)) == NULL) {
+        ch_error("Failed to allocate encoder context.");
+        return (-1);
+    }
+
+    codec_cx->width = w;
+    codec_cx->height = h;
+    codec_cx->pix_fmt = pixfmt;
+    codec_cx->time_base = (AVRational) {1, 30};
+    codec_cx->gop_size = CH_SYNTH_FRAMES;
+    codec_cx->max_b_frames = 0;
+
+    if (avcodec_open2(codec_cx, codec, NULL) < 0) {
+        ch_error("Failed to open encoder for synthetic source.");
+        goto clean;
+    }
+
+    frame = av_frame_alloc();
+    planes = (uint8_t *) ch_calloc(avpicture_get_size(pixfmt, w, h), 1);
+    sws_cx = sws_getContext(w, h, AV_PIX_FMT_YUYV422, w, h, pixfmt,
+                            SWS_BILINEAR, NULL, NULL, NULL);
+
+    if (frame == NULL || planes == NULL || sws_cx == NULL) {
+        ch_error("Failed to set up synthetic source conversion.");
+        goto clean;
+    }
+
+    avpicture_fill((AVPicture *) frame, planes, pixfmt, w, h);
+    frame->width = w;
+    frame->height = h;
+    frame->format = pixfmt;
+
+    // Encode every frame, then flush frames the encoder held back.
+    uint32_t idx;
+    for (idx = 0; idx <= CH_SYNTH_FRAMES; idx++) {
+        const AVFrame *in = NULL;
+
+        if (idx < CH_SYNTH_FRAMES) {
+            AVPicture src;
+            avpicture_fill(&src, raw[idx], AV_PIX_FMT_YUYV422, w, h);
+
+            sws_scale(sws_cx, (uint8_t const * const *) src.data, src.linesize,
+                      0, h, frame->data, frame->linesize);
+
+            frame->pts = idx;
+            in = frame;
+        }
+
+        int got;
+        do {
+            AVPacket packet;
+            av_init_packet(&packet);
+            packet.data = NULL;
+            packet.size = 0;
+
+            got = 0;
+            if (avcodec_encode_video2(codec_cx, &packet, in, &got) < 0) {
+                ch_error("Failed encoding synthetic frame.");
+                goto clean;
+            }
+
+            if (got) {
+                int added = (cx->n_frames < CH_SYNTH_FRAMES)
+                    ? ch_synth_add(cx, packet.data, packet.size) : 0;
+
+                av_free_packet(&packet);
+
+                if (added == -1)
+                    goto clean;
+            }
+        } while (got && in == NULL);
+    }
+
+    if (cx->n_frames == 0) {
+        ch_error("Encoder produced no synthetic frames.");
+        goto clean;
+    }
+
+    r = 0;
+
+clean:
+    if (sws_cx)
+        sws_freeContext(sws_cx);
+
+    free(planes);
+
+    if (frame)
+        av_frame_free(&frame);
+
+    avcodec_close(codec_cx);
+    av_free(codec_cx);
+
+    return (r);
+}
+
+/**
+ * @brief Open a synthetic source.
+ */
+static int
+ch_synth_open(struct ch_device *device)
+{
+    device->backend_cx = ch_calloc(1, sizeof(struct ch_synth_cx));
+    if (device->backend_cx == NULL)
+        return (-1);
+
+    return (0);
+}
+
+/**
+ * @brief Close a synthetic source.
+ */
+static int
+ch_synth_close(struct ch_device *device)
+{
+    free(device->backend_cx);
+    device->backend_cx = NULL;
+
+    return (0);
+}
+
+/**
+ * @brief Validate the requested format of a synthetic source.
+ */
+static int
+ch_synth_set_fmt(struct ch_device *device)
+{
+    switch (device->in_pixfmt) {
+    case V4L2_PIX_FMT_YUYV:
+    case V4L2_PIX_FMT_MJPEG:
+    case V4L2_PIX_FMT_H264:
+        break;
+
+    default:
+        ch_error("Unsupported format for synthetic source.");
+        return (-1);
+    }
+
+    // Chroma is subsampled horizontally, and vertically for H.264.
+    if (device->framesize.width < 16 || device->framesize.height < 16
+        || device->framesize.width % 2 != 0
+        || device->framesize.height % 2 != 0) {
+        ch_error("Synthetic framesize must be even and at least 16x16.");
+        return (-1);
+    }
+
+    return (0);
+}
+
+/**
+ * @brief Stop a synthetic source, freeing its frames.
+ */
+static int
+ch_synth_stop(struct ch_device *device)
+{
+    struct ch_synth_cx *cx = (struct ch_synth_cx *) device->backend_cx;
+
+    uint32_t idx;
+    for (idx = 0; idx < cx->n_frames; idx++)
+        free(cx->frames[idx].start);
+
+    cx->n_frames = 0;
+    return (0);
+}
+
+/**
+ * @brief Generate all frames of a synthetic source ahead of streaming.
+ */
+static int
+ch_synth_start(struct ch_device *device)
+{
+    struct ch_synth_cx *cx = (struct ch_synth_cx *) device->backend_cx;
+
+    cx->n_frames = 0;
+    cx->next = 0;
+    cx->due = (struct timespec) {0, 0};
+
+    uint32_t length = 2 * device->framesize.width * device->framesize.height;
+    uint8_t *raw[CH_SYNTH_FRAMES];
+
+    int r = 0;
+    uint32_t idx;
+    for (idx = 0; idx < CH_SYNTH_FRAMES; idx++)
+        raw[idx] = NULL;
+
+    for (idx = 0; idx < CH_SYNTH_FRAMES; idx++) {
+        raw[idx] = (uint8_t *) ch_calloc(length, sizeof(uint8_t));
+        if (raw[idx] == NULL) {
+            r = -1;
+            goto clean;
+        }
+
+        ch_synth_render(device, idx, raw[idx]);
+    }
+
+    if (device->in_pixfmt == V4L2_PIX_FMT_YUYV) {
+        for (idx = 0; idx < CH_SYNTH_FRAMES && r == 0; idx++)
+            r = ch_synth_add(cx, raw[idx], length);
+
+    } else
+        r = ch_synth_encode(device, cx, raw);
+
+clean:
+    for (idx = 0; idx < CH_SYNTH_FRAMES; idx++)
+        free(raw[idx]);
+
+    if (r == -1)
+        ch_synth_stop(device);
+
+    return (r);
+}
+
+/**
+ * @brief Return the next frame of the cycle once it is due.
+ */
+static int
+ch_synth_next(struct ch_device *device, struct ch_frmbuf **buf)
+{
+    struct ch_synth_cx *cx = (struct ch_synth_cx *) device->backend_cx;
+
+    ch_backend_pace(device, &cx->due);
+
+    *buf = &cx->frames[cx->next];
+    cx->next = (cx->next + 1) % cx->n_frames;
+
+    ch_backend_timestamp(*buf);
+    return (1);
+}
+
+const struct ch_backend ch_synth_backend = {
+    "synth",
+    ch_synth_open,
+    ch_synth_close,
+    ch_synth_set_fmt,
+    ch_synth_start,
+    ch_synth_stop,
+    ch_synth_next,
+    NULL
+};
@@ -0,0 +1,366 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <dirent.h>
+
+#include <chiasm.h>
+
+#define MAX_SEGMENTS 16
+#define SHM_DIR      "/dev/shm"
+
+/**
+ * @brief A watched monitoring segment and its state at the last refresh.
+ */
+struct top_segment {
+    struct ch_monitor    mon;  /**< Attached segment. */
+    struct ch_mon_block *prev; /**< Copy of the segment at the last refresh. */
+    uint64_t             t;    /**< Time of the last refresh. */
+    bool                 seen; /**< Found in the latest scan? */
+};
+
+struct top_segment segments[MAX_SEGMENTS];
+size_t n_segments = 0;
+
+const char *only = NULL;      // Name of the only segment to watch, if any.
+double interval = 1.0;        // Seconds between refreshes.
+bool once = false;            // Print a single refresh and exit?
+volatile bool running = true;
+
+struct ch_hist window;        // Stage histogram over the last interval.
+
+/**
+ * @brief Signal handler to stop refreshing.
+ */
+void
+signal_handler(int signal)
+{
+    signal = (int) signal;
+    running = false;
+}
+
+/**
+ * @brief Find a watched segment, or attach to it.
+ *
+ * @param name Name of the segment.
+ * @return The segment, or NULL if it could not be attached.
+ */
+static struct top_segment *
+segment_get(const char *name)
+{
+    size_t idx;
+    for (idx = 0; idx < n_segments; idx++)
+        if (strcmp(segments[idx].mon.name, name) == 0)
+            return (&segments[idx]);
+
+    if (n_segments == MAX_SEGMENTS)
+        return (NULL);
+
+    struct top_segment *segment = &segments[n_segments];
+    if (ch_attach_monitor(&segment->mon, name) == -1)
+        return (NULL);
+
+    segment->prev = NULL;
+    segment->t = 0;
+    n_segments++;
+
+    return (segment);
+}
+
+/**
+ * @brief Find the published segments, attaching to new ones and dropping
+ *        removed ones.
+ */
+static void
+segments_scan(void)
+{
+    size_t idx;
+    for (idx = 0; idx < n_segments; idx++)
+        segments[idx].seen = false;
+
+    if (only) {
+        struct top_segment *segment = segment_get(only);
+        if (segment)
+            segment->seen = true;
+
+    } else {
+        DIR *dir = opendir(SHM_DIR);
+        struct dirent *entry;
+
+        while (dir && (entry = readdir(dir)) != NULL) {
+            if (strncmp(entry->d_name, CH_MON_PREFIX,
+                        strlen(CH_MON_PREFIX)) != 0)
+                continue;
+
+            struct top_segment *segment = segment_get(entry->d_name);
+            if (segment)
+                segment->seen = true;
+        }
+
+        if (dir)
+            closedir(dir);
+    }
+
+    // Keep the remaining segments contiguous.
+    size_t kept = 0;
+    for (idx = 0; idx < n_segments; idx++) {
+        if (!segments[idx].seen) {
+            ch_detach_monitor(&segments[idx].mon);
+            free(segments[idx].prev);
+            continue;
+        }
+
+        segments[kept++] = segments[idx];
+    }
+
+    n_segments = kept;
+}
+
+/**
+ * @brief Print the stages of a source timed since the last refresh.
+ */
+static void
+print_stages(const struct ch_mon_source *source,
+             const struct ch_mon_source *prev)
+{
+    size_t idx;
+    for (idx = 0; idx < CH_STAGE_NUM; idx++) {
+        const struct ch_hist *hist = &source->stages[idx];
+
+        window.count = __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+        window.max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+
+        size_t bin;
+        for (bin = 0; bin < CH_HIST_BINS; bin++)
+            window.bins[bin] = __atomic_load_n(&hist->bins[bin],
+                                               __ATOMIC_RELAXED);
+
+        if (prev) {
+            window.count -= prev->stages[idx].count;
+            for (bin = 0; bin < CH_HIST_BINS; bin++)
+                window.bins[bin] -= prev->stages[idx].bins[bin];
+        }
+
+        if (window.count == 0)
+            continue;
+
+        printf("%83s %-10s %10.1f %10.1f\n", "",
+               ch_stage_name((enum ch_stage) idx),
+               ch_hist_percentile(&window, 50.0) / 1e3,
+               ch_hist_percentile(&window, 99.0) / 1e3);
+    }
+}
+
+/**
+ * @brief Read the counters of a source.
+ */
+static void
+counters_load(const struct ch_mon_counters *counters,
+              struct ch_mon_counters *out)
+{
+    out->frames = __atomic_load_n(&counters->frames, __ATOMIC_RELAXED);
+    out->cpu_ns = __atomic_load_n(&counters->cpu_ns, __ATOMIC_RELAXED);
+    out->cycles = __atomic_load_n(&counters->cycles, __ATOMIC_RELAXED);
+    out->instructions = __atomic_load_n(&counters->instructions,
+                                        __ATOMIC_RELAXED);
+    out->cache_misses = __atomic_load_n(&counters->cache_misses,
+                                        __ATOMIC_RELAXED);
+    out->perf_samples = __atomic_load_n(&counters->perf_samples,
+                                        __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Print hardware events per frame of a source over the last
+ *        interval, if counted.
+ */
+static void
+print_perf(const struct ch_mon_counters *now,
+           const struct ch_mon_counters *then)
+{
+    uint64_t samples = now->perf_samples - ((then) ? then->perf_samples : 0);
+    if (samples == 0)
+        return;
+
+    double cycles = now->cycles - ((then) ? then->cycles : 0);
+    double instructions = now->instructions - ((then) ? then->instructions : 0);
+    double misses = now->cache_misses - ((then) ? then->cache_misses : 0);
+
+    printf("%83s %.0f cycles, %.0f instructions (ipc %.2f), "
+           "%.0f cache misses per frame\n", "", cycles / samples,
+           instructions / samples, (cycles > 0) ? instructions / cycles : 0.0,
+           misses / samples);
+}
+
+/**
+ * @brief Print the sources of a segment.
+ */
+static void
+print_segment(struct top_segment *segment)
+{
+    const struct ch_mon_block *block = segment->mon.block;
+    uint64_t now = ch_stats_now();
+
+    // Rates run over the last interval, or the whole run at first.
+    double dt = (segment->prev)
+        ? (now - segment->t) / 1e9 : (now - block->started) / 1e9;
+
+    char pixfmt[5];
+    ch_pixfmt_to_string(block->pixfmt, pixfmt);
+
+    bool alive = (kill(block->pid, 0) == 0 || errno != ESRCH);
+
+    printf("%s  pid %u%s  %s %ux%u  up %.0f s\n", segment->mon.name,
+           block->pid, (alive) ? "" : " (exited)", pixfmt,
+           block->framesize.width, block->framesize.height,
+           (now - block->started) / 1e9);
+
+    printf("%-20s %8s %10s %10s %10s %6s %6s %6s %-10s %10s %10s\n", "source",
+           "rate", "frames", "dropped", "shed", "queue", "busy", "cpu %",
+           "stage", "p50 (us)", "p99 (us)");
+
+    uint32_t idx;
+    for (idx = 0; idx < block->n_sources; idx++) {
+        const struct ch_mon_source *source = &block->sources[idx];
+        const struct ch_mon_source *prev =
+            (segment->prev) ? &segment->prev->sources[idx] : NULL;
+
+        uint64_t frames = __atomic_load_n(&source->counters.frames,
+                                          __ATOMIC_RELAXED);
+        uint64_t delta = frames - ((prev) ? prev->counters.frames : 0);
+
+        printf("%-20.20s %8.1f %10llu %10llu %10llu", source->name,
+               (dt > 0) ? delta / dt : 0.0, (unsigned long long) frames,
+               (unsigned long long) __atomic_load_n(&source->counters.dropped,
+                                                    __ATOMIC_RELAXED),
+               (unsigned long long) __atomic_load_n(&source->counters.shed,
+                                                    __ATOMIC_RELAXED));
+
+        // The device has no queue of its own.
+        if (idx == 0)
+            printf(" %6s %6s", "-", "-");
+        else
+            printf(" %6llu %6s",
+                   (unsigned long long) __atomic_load_n(
+                       &source->counters.pending, __ATOMIC_RELAXED),
+                   __atomic_load_n(&source->counters.busy, __ATOMIC_RELAXED)
+                   ? "yes" : "no");
+
+        struct ch_mon_counters now_counters;
+        counters_load(&source->counters, &now_counters);
+
+        const struct ch_mon_counters *then = (prev) ? &prev->counters : NULL;
+        uint64_t cpu_ns = now_counters.cpu_ns - ((then) ? then->cpu_ns : 0);
+
+        printf(" %6.1f\n", (dt > 0) ? 100.0 * cpu_ns / 1e9 / dt : 0.0);
+
+        print_stages(source, prev);
+        print_perf(&now_counters, then);
+    }
+
+    printf("\n");
+
+    // Remember this refresh to diff the next one against.
+    if (segment->prev == NULL)
+        segment->prev = (struct ch_mon_block *) malloc(segment->mon.length);
+
+    if (segment->prev)
+        memcpy(segment->prev, block, segment->mon.length);
+
+    segment->t = now;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "n:i:1h?")) != -1) {
+        switch (opt) {
+        case 'n':
+            only = optarg;
+            break;
+
+        case 'i':
+            interval = atof(optarg);
+            if (interval <= 0.0) {
+                fprintf(stderr, "Invalid interval.\n");
+                return (-1);
+            }
+
+            break;
+
+        case '1':
+            once = true;
+            break;
+
+        case 'h':
+        case '?':
+        default:
+            printf(
+                "Usage: %s [OPTIONS]\n"
+                "Watches the counters published by running ch_stream processes.\n"
+                "Options:\n"
+                " -n   Name of the segment to watch. All " CH_MON_PREFIX "* by default.\n"
+                " -i   Seconds between refreshes. 1 by default.\n"
+                " -1   Print once after one interval and exit.\n"
+                " -?,h Show this help.\n",
+                argv[0]
+            );
+
+            return (0);
+        }
+    }
+
+    signal(SIGINT, signal_handler);
+
+    if (only)
+        ch_set_stderr(true);
+
+    // Take a first snapshot so the first refresh shows a full interval.
+    segments_scan();
+
+    size_t idx;
+    for (idx = 0; idx < n_segments; idx++) {
+        segments[idx].prev = (struct ch_mon_block *)
+            malloc(segments[idx].mon.length);
+
+        if (segments[idx].prev)
+            memcpy(segments[idx].prev, segments[idx].mon.block,
+                   segments[idx].mon.length);
+
+        segments[idx].t = ch_stats_now();
+    }
+
+    while (running) {
+        struct timespec ts = ch_sec_to_timespec(interval);
+        nanosleep(&ts, NULL);
+
+        if (!running)
+            break;
+
+        segments_scan();
+
+        if (!once)
+            printf("\033[H\033[2J");
+
+        if (n_segments == 0)
+            printf("No chiasm streams found.\n");
+
+        for (idx = 0; idx < n_segments; idx++)
+            print_segment(&segments[idx]);
+
+        fflush(stdout);
+
+        if (once)
+            break;
+    }
+
+    for (idx = 0; idx < n_segments; idx++) {
+        ch_detach_monitor(&segments[idx].mon);
+        free(segments[idx].prev);
+    }
+
+    return (0);
+}
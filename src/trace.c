@@ -0,0 +1,199 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include <sys/types.h>
+#include <sys/syscall.h>
+
+#include <chiasm.h>
+
+/**
+ * @brief A traced stage event.
+ */
+struct ch_trace_rec {
+    uint64_t t0;    /**< Start of the event. */
+    uint64_t t1;    /**< End of the event. */
+    uint64_t frame; /**< Frame the event belongs to. */
+    uint32_t stage; /**< Stage of the event, an enum ch_stage. */
+};
+
+/**
+ * @brief Ring of events recorded by one thread. Only the owning thread
+ *        writes to it.
+ */
+struct ch_trace_buf {
+    struct ch_trace_buf *next;     /**< Next buffer of another thread. */
+    pid_t                tid;      /**< Thread owning the buffer. */
+    char                 name[32]; /**< Name of the thread. */
+    uint64_t             count;    /**< Events ever recorded. */
+    struct ch_trace_rec  events[]; /**< The latest events. */
+};
+
+bool ch_tracing = false;
+
+// Buffers of all threads, pushed lock-free as threads first record.
+static struct ch_trace_buf *ch_trace_bufs = NULL;
+static size_t ch_trace_size = 0;       // Events kept per thread.
+static uint64_t ch_trace_origin = 0;   // Time tracing started.
+static uint64_t ch_trace_gen = 0;      // Bumped when buffers are freed.
+
+static __thread struct ch_trace_buf *ch_trace_local = NULL;
+static __thread uint64_t ch_trace_local_gen = 0;
+
+int
+ch_trace_start(size_t events)
+{
+    if (events == 0) {
+        ch_error("Trace must keep at least one event per thread.");
+        return (-1);
+    }
+
+    ch_trace_size = events;
+    ch_trace_origin = ch_stats_now();
+    __atomic_store_n(&ch_tracing, true, __ATOMIC_RELEASE);
+
+    return (0);
+}
+
+/**
+ * @brief Get the buffer of the calling thread, creating it on first use.
+ *
+ * @return The buffer, or NULL if it could not be allocated.
+ */
+static struct ch_trace_buf *
+ch_trace_buffer(void)
+{
+    if (ch_trace_local && ch_trace_local_gen == ch_trace_gen)
+        return (ch_trace_local);
+
+    struct ch_trace_buf *buf = (struct ch_trace_buf *)
+        ch_calloc(1, sizeof(struct ch_trace_buf)
+                  + ch_trace_size * sizeof(struct ch_trace_rec));
+
+    if (buf == NULL)
+        return (NULL);
+
+    buf->tid = (pid_t) syscall(SYS_gettid);
+    snprintf(buf->name, sizeof(buf->name), "thread %d", (int) buf->tid);
+
+    buf->next = __atomic_load_n(&ch_trace_bufs, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&ch_trace_bufs, &buf->next, buf, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    ch_trace_local = buf;
+    ch_trace_local_gen = ch_trace_gen;
+
+    return (buf);
+}
+
+void
+ch_trace_name(const char *name)
+{
+    if (!__atomic_load_n(&ch_tracing, __ATOMIC_RELAXED))
+        return;
+
+    struct ch_trace_buf *buf = ch_trace_buffer();
+    if (buf == NULL)
+        return;
+
+    const char *base = strrchr(name, '/');
+    if (base)
+        name = base + 1;
+
+    // Names are written into JSON strings unescaped.
+    size_t idx;
+    for (idx = 0; idx + 1 < sizeof(buf->name) && name[idx] != '\0'; idx++)
+        buf->name[idx] = (name[idx] == '"' || name[idx] == '\\'
+                          || (unsigned char) name[idx] < ' ') ? '_' : name[idx];
+
+    buf->name[idx] = '\0';
+}
+
+void
+ch_trace_event(enum ch_stage stage, uint64_t frame, uint64_t t0, uint64_t t1)
+{
+    if (!__atomic_load_n(&ch_tracing, __ATOMIC_RELAXED))
+        return;
+
+    struct ch_trace_buf *buf = ch_trace_buffer();
+    if (buf == NULL)
+        return;
+
+    struct ch_trace_rec *rec = &buf->events[buf->count % ch_trace_size];
+    rec->t0 = t0;
+    rec->t1 = t1;
+    rec->frame = frame;
+    rec->stage = stage;
+
+    __atomic_store_n(&buf->count, buf->count + 1, __ATOMIC_RELEASE);
+}
+
+int
+ch_trace_dump(const char *filename)
+{
+    FILE *file = fopen(filename, "w");
+    if (file == NULL) {
+        ch_error_no("Failed to open trace file.", errno);
+        return (-1);
+    }
+
+    int pid = (int) getpid();
+    bool first = true;
+
+    fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+    struct ch_trace_buf *buf;
+    for (buf = __atomic_load_n(&ch_trace_bufs, __ATOMIC_ACQUIRE); buf != NULL;
+         buf = buf->next) {
+        fprintf(file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+                "\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                (first) ? "" : ",", pid, (int) buf->tid, buf->name);
+        first = false;
+
+        // Oldest events still in the ring first.
+        uint64_t count = __atomic_load_n(&buf->count, __ATOMIC_ACQUIRE);
+        uint64_t idx = (count > ch_trace_size) ? count - ch_trace_size : 0;
+
+        for (; idx < count; idx++) {
+            const struct ch_trace_rec *rec = &buf->events[idx % ch_trace_size];
+            if (rec->t0 < ch_trace_origin || rec->t1 < rec->t0)
+                continue;
+
+            fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"chiasm\",\"ph\":\"X\","
+                    "\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+                    "\"args\":{\"frame\":%" PRIu64 "}}",
+                    ch_stage_name((enum ch_stage) rec->stage), pid,
+                    (int) buf->tid, (rec->t0 - ch_trace_origin) / 1e3,
+                    (rec->t1 - rec->t0) / 1e3, rec->frame);
+        }
+    }
+
+    fprintf(file, "\n]}\n");
+
+    if (fclose(file) == EOF) {
+        ch_error_no("Failed to write trace file.", errno);
+        return (-1);
+    }
+
+    return (0);
+}
+
+void
+ch_trace_stop(void)
+{
+    __atomic_store_n(&ch_tracing, false, __ATOMIC_RELEASE);
+
+    struct ch_trace_buf *buf = __atomic_exchange_n(&ch_trace_bufs, NULL,
+                                                   __ATOMIC_ACQUIRE);
+    while (buf) {
+        struct ch_trace_buf *next = buf->next;
+        free(buf);
+        buf = next;
+    }
+
+    // Threads still holding a freed buffer allocate a new one.
+    ch_trace_gen++;
+}
@@ -12,6 +12,7 @@
 bool ch_log = true;
 bool ch_stderr = false;
 bool ch_log_enable = false;
+const uint64_t *ch_allocs = NULL;   // Allocation counter of the program, if any.
 
 inline void *
 ch_calloc(size_t nmemb, size_t size)
@@ -116,6 +117,20 @@ ch_set_stderr(bool val) {
     ch_stderr = val;
 }
 
+void
+ch_set_alloc_counter(const uint64_t *counter) {
+    ch_allocs = counter;
+}
+
+bool
+ch_get_alloc_count(uint64_t *count) {
+    if (ch_allocs == NULL)
+        return (false);
+
+    *count = __atomic_load_n(ch_allocs, __ATOMIC_RELAXED);
+    return (true);
+}
+
 /**
  * @brief Enable logging if not already.
  *
@@ -128,13 +143,19 @@ ch_enable_log(void) {
 }
 
 void
-ch_error_no(const char *buf, int err) {
-    if (!ch_log)
-        return;
-
+ch_log_write(const char *buf, bool has_err, int err) {
     if (!ch_log_enable)
         ch_enable_log();
 
+    if (!has_err) {
+        syslog(LOG_ERR, "%s", buf);
+
+        if (ch_stderr)
+            fprintf(stderr, "[CH_ERROR] %s\n", buf);
+
+        return;
+    }
+
     char err_buf[100];
     strerror_r(err, err_buf, 100);
 
@@ -145,15 +166,24 @@ ch_error_no(const char *buf, int err) {
 }
 
 void
-ch_error(const char *buf) {
+ch_error_no(const char *buf, int err) {
     if (!ch_log)
         return;
 
-    if (!ch_log_enable)
-        ch_enable_log();
+    // Hand off to the background writer if running.
+    if (ch_log_post(buf, true, err) == 0)
+        return;
 
-    syslog(LOG_ERR, "%s", buf);
+    ch_log_write(buf, true, err);
+}
 
-    if (ch_stderr)
-        fprintf(stderr, "[CH_ERROR] %s\n", buf);
+void
+ch_error(const char *buf) {
+    if (!ch_log)
+        return;
+
+    if (ch_log_post(buf, false, 0) == 0)
+        return;
+
+    ch_log_write(buf, false, 0);
 }